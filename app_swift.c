@@ -33,24 +33,49 @@
 #include "asterisk.h"
 ASTERISK_FILE_VERSION(__FILE__, "$Revision: 304000 $")
 
+#include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <swift.h>
 #if defined _SWIFT_VER_6
 #include <swift_asterisk_interface.h>
 #endif
 
-#include <math.h>
+#include "swift_broker.h"
 
-#include "asterisk/astobj.h"
 #include "asterisk/channel.h"
 #include "asterisk/module.h"
 #include "asterisk/pbx.h"
 #include "asterisk/app.h"
 #include "asterisk/file.h"
+#include "asterisk/cli.h"
+#include "asterisk/manager.h"
+#include "asterisk/ulaw.h"
+#include "asterisk/alaw.h"
+#if !defined _AST_VER_1_4
+#include "asterisk/paths.h"
+#include "asterisk/utils.h"
+#endif
 
 #if (defined _AST_VER_13)
 #include "asterisk/format_cache.h"
 #endif
 
+#if defined __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined __GNUC__ && __GNUC__ >= 5 && defined __x86_64__
+#include <immintrin.h>
+#define SWIFT_HAVE_AVX2
+#endif
+
 
 /*** DOCUMENTATION
         <application name="Swift" language="en_US">
@@ -76,11 +101,99 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 304000 $")
                 will alternatively read DTMF into the ${SWIFT_DTMF} variable if the timeout
                 and digits options are used.  You may change the voice dynamically by 
                 setting the channel variable SWIFT_VOICE.</para>
+                <para>When every licensed swift port is busy the call waits in a queue for
+                up to ${SWIFT_QUEUE_TIMEOUT} milliseconds (queue_timeout in swift.conf by
+                default).  Calls with a higher ${SWIFT_PRIORITY} are served first.</para>
+                <para>Text already spoken in the same voice is played from the prompt cache
+                (cache_size in swift.conf), or from the prompt store on disk
+                (prompt_store), without using a swift port.  Calls that ask for the same
+                text while it is still being rendered share that one rendering.</para>
+                <para>Audio is sent in frames of ${SWIFT_PTIME} milliseconds (ptime in
+                swift.conf by default).</para>
+                <para>Audio is rendered in the format the channel sends natively when
+                Swift can produce it (ulaw, alaw, slin or slin16), so no transcoding is
+                needed.  Set ${SWIFT_FORMAT} (format in swift.conf) to choose one.</para>
+                <para>Text longer than a sentence is rendered a sentence at a time, so
+                playback begins as soon as the first sentence is ready (segment_text
+                in swift.conf).</para>
+                <para>This application sets the following channel variables:</para>
+                <variablelist>
+                        <variable name="SWIFT_STATUS">
+                                <value name="SUCCESS" />
+                                <value name="QUEUEFULL">Every port was busy and the queue was full.</value>
+                                <value name="TIMEOUT">No port became free within the queue timeout.</value>
+                                <value name="ERROR" />
+                        </variable>
+                        <variable name="SWIFT_QUEUE_WAIT">
+                                <para>Milliseconds spent waiting for a swift port.</para>
+                        </variable>
+                </variablelist>
+                </description>
+        </application>
+        <application name="SwiftTemplate" language="en_US">
+                <synopsis>
+                        Speak a template of fixed text and variable slots through Swift
+                        text-to-speech engine and optionally listen for DTMF.
+                </synopsis>
+                <syntax>
+                        <parameter name="'template'" required="true">
+                                <para>Text with the variable parts in square brackets, for
+                                example <literal>Your balance is [${AMT}] dollars as of
+                                [${DATE}].</literal></para>
+                        </parameter>
+                        <parameter name="options">
+                                <optionlist>
+                                        <option name="timeout">
+                                                <para>Timeout in milliseconds.</para>
+                                        </option>
+                                        <option name="digits">
+                                                <para>Maxiumum digits.</para>
+                                        </option>
+                                </optionlist>
+                        </parameter>
+                </syntax>
+                <description>
+                <para>Works like <literal>Swift</literal>, except that the fixed text of
+                the template is rendered once and played from the prompt cache (and prompt
+                store), so only the bracketed slots are synthesized on each call.  The
+                parts are played back to back as one prompt.  Channel variables are the
+                same as for <literal>Swift</literal>.</para>
                 </description>
         </application>
+        <function name="SWIFT_PREFETCH" language="en_US">
+                <synopsis>
+                        Start rendering text with Swift ahead of playback.
+                </synopsis>
+                <syntax>
+                        <parameter name="text" required="true"/>
+                </syntax>
+                <description>
+                <para>Starts rendering <replaceable>text</replaceable> in the channel's
+                ${SWIFT_VOICE} in the background and returns a handle at once, for example
+                while an AGI lookup runs or the previous prompt plays.  A later
+                <literal>Swift</literal> of the same text, or of the handle itself, plays
+                what has been rendered so far and carries on from there.</para>
+                <para>exten => s,n,Set(NEXT=${SWIFT_PREFETCH(Your order has shipped.)})</para>
+                <para>exten => s,n,Swift(${NEXT})</para>
+                </description>
+        </function>
+        <manager name="SwiftStats" language="en_US">
+                <synopsis>
+                        Show Swift synthesis, playback and cache statistics.
+                </synopsis>
+                <syntax>
+                        <xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+                </syntax>
+                <description>
+                <para>Reports the same counters as <literal>swift show stats</literal>: calls and
+                ports in use, engine and port open times, time to first audio, starved
+                frames, producer sleeps, audio rendered and sent, and the cache hit rate.</para>
+                </description>
+        </manager>
  ***/
 
 static char *app = "Swift";
+static char *template_app = "SwiftTemplate";
 
 #if (defined _AST_VER_1_4 || defined _AST_VER_1_6)
 static char *synopsis = "Speak text through the Cepstral Swift text-to-speech engine.";
@@ -93,9 +206,20 @@ static char *descrip =
 "and digits options are used.  You may change the voice dynamically by\n"
 "setting the channel variable SWIFT_VOICE.\n\n"
 " Syntax: Swift(text[|timeout in ms][|maximum digits])\n";
+
+static char *template_synopsis = "Speak a template of fixed text and [variable] slots through Swift.";
+
+static char *template_descrip = 
+"Like Swift(), but the text is a template in which the variable parts are\n"
+"enclosed in square brackets.  The fixed text is rendered once and played\n"
+"from the cache; only the bracketed slots are synthesized on each call,\n"
+"and the parts are played back to back as one prompt.\n\n"
+" Syntax: SwiftTemplate(template[|timeout in ms][|maximum digits])\n"
+" Example: SwiftTemplate(Your balance is [${AMT}] dollars as of [${DATE}].)\n";
 #endif
 
-const int framesize = 20;
+/* Longest frame we will send, in milliseconds */
+#define SWIFT_MAX_PTIME 200
 
 #define AST_MODULE "app_swift"
 #define SWIFT_CONFIG_FILE "swift.conf"
@@ -103,632 +227,6131 @@ const int framesize = 20;
 
 static unsigned int cfg_buffer_size;
 static int cfg_goto_exten;
-static int samplerate;
+static const struct swift_format *cfg_format;  /* NULL to match the channel */
+static int cfg_ptime;
+static int cfg_segment_text;
 static char cfg_voice[20];
+static char cfg_voices[256];
+static int cfg_port_pool_size;
+static int cfg_max_ports;
+static int cfg_queue_size;
+static int cfg_queue_timeout;
+static unsigned int cfg_max_buffer_memory;
+static unsigned int cfg_cache_size;
+static unsigned int cfg_cache_max_prompt;
+static char cfg_prompt_store[PATH_MAX];
+static unsigned int cfg_prompt_store_size;
+static int cfg_trim_silence;
+static int cfg_silence_threshold;  /* dBFS */
+static int cfg_trim_tail;          /* ms */
+static int cfg_normalize;          /* dBFS, 0 for off */
+static int cfg_max_prebuffer;      /* ms */
+static char cfg_broker[PATH_MAX];  /* swift_broker socket, or empty */
 
-struct stuff {
-	ASTOBJ_COMPONENTS(struct stuff);
-	int generating_done;
-	char *q;
-	char *pq_r;  /* queue read position */
-	char *pq_w;  /* queue write position */
-	int qc;
-	int immediate_exit;
+/*! \brief What we have learned about a voice from rendering with it. */
+struct swift_voice_stats {
+	char voice[sizeof(cfg_voice)];
+	uint64_t level_sum;      /* squared speech samples */
+	uint64_t level_samples;
+	/* How fast it renders, averaged over recent renderings */
+	unsigned int renders;
+	double speed;            /* ms of audio per ms of rendering */
+	double ms_per_char;      /* of text */
+	double gap_ms;           /* longest wait between pieces of audio */
 };
 
-struct dtmf_lookup {
-	long ast_res;
-	char* dtmf_res;
-};
+#define SWIFT_VOICE_STATS 32
+#define SWIFT_VOICE_AVG 8        /* renderings a new one weighs against */
 
-static struct dtmf_lookup ast_dtmf_table[dtmf_codes] = {
-	{35, "#"},
-	{42, "*"},
-	{48, "0"},
-	{49, "1"},
-	{50, "2"},
-	{51, "3"},
-	{52, "4"},
-	{53, "5"},
-	{54, "6"},
-	{55, "7"},
-	{56, "8"},
-	{57, "9"}
+/* Until a voice has rendered something, playback waits for this much */
+#define SWIFT_PREBUFFER_MS 100
+
+AST_MUTEX_DEFINE_STATIC(voice_lock);
+static struct swift_voice_stats voice_stats[SWIFT_VOICE_STATS];
+
+/* Time to first audio is counted in buckets up to these many ms, and a
+ * last one for anything slower */
+static const unsigned int swift_ttfa_bounds[] = { 20, 50, 100, 200, 500, 1000, 2000 };
+#define SWIFT_TTFA_BUCKETS (ARRAY_LEN(swift_ttfa_bounds) + 1)
+
+/*! \brief Counters for "swift show stats" and the SwiftStats action.
+ * They are only ever added to, with relaxed atomics, so the frame and
+ * audio paths count without taking a lock. */
+struct swift_stats {
+	int calls;                      /* in Swift() now */
+	uint64_t calls_total;
+	uint64_t engine_opens;
+	uint64_t engine_open_us;
+	uint64_t port_opens;
+	uint64_t port_open_us;
+	uint64_t ttfa_cached[SWIFT_TTFA_BUCKETS];
+	uint64_t ttfa_rendered[SWIFT_TTFA_BUCKETS];
+	uint64_t ttfa_ms;
+	uint64_t starved;               /* times playback ran dry */
+	uint64_t starved_us;            /* and waited to buffer again */
+	uint64_t producer_sleeps;
+	uint64_t producer_slept_us;
+	uint64_t bytes_rendered;
+	uint64_t frames_written;
+	uint64_t synth_jobs;            /* run by the worker pool */
+	uint64_t synth_wait_us;         /* queued for a worker */
+	uint64_t cancels;               /* hangups and barge-ins that stopped synthesis */
+	uint64_t cancel_us;             /* from the cancel to the port being given back */
+	uint64_t cancel_max_us;
+	uint64_t broker_calls;          /* rendered by swift_broker */
+	uint64_t broker_fallbacks;      /* rendered here as it could not be reached */
 };
 
-static void swift_init_stuff(struct stuff *ps)
-{
-	ASTOBJ_INIT(ps);
-	ps->generating_done = 0;
-	ps->q = malloc(cfg_buffer_size);
-	ps->pq_r = ps->q;
-	ps->pq_w = ps->q;
-	ps->qc = 0;
-	ps->immediate_exit = 0;
-}
+static struct swift_stats stats;
 
-static int swift_generator_running(struct stuff *ps)
+static int64_t swift_tvdiff_us(struct timeval end, struct timeval start)
 {
-	int r;
-	ASTOBJ_RDLOCK(ps);
-	r = !ps->immediate_exit && (!ps->generating_done || ps->qc);
-	ASTOBJ_UNLOCK(ps);
-	return r;
+	return (end.tv_sec - start.tv_sec) * (int64_t) 1000000 + (end.tv_usec - start.tv_usec);
 }
 
-static int swift_bytes_available(struct stuff *ps)
-{
-	int r;
-	ASTOBJ_RDLOCK(ps);
-	r = ps->qc;
-	ASTOBJ_UNLOCK(ps);
-	return r;
-}
+/*! \brief A reference counted handle on an open Swift engine.
+ *
+ * One engine is opened at load time and shared by every channel.  Callers
+ * take a reference for the duration of their synthesis, so a reload can
+ * swap in a fresh engine while calls in progress finish on the old one.
+ */
+struct swift_engine_ref {
+	swift_engine *engine;
+	int refs;
+};
 
-static swift_result_t swift_cb(swift_event *event, swift_event_t type, void *udata)
-{
-	void *buf;
-	int len, spacefree;
-	unsigned long sleepfor;
-	swift_event_t rv = SWIFT_SUCCESS;
-	struct stuff *ps = udata;
+AST_MUTEX_DEFINE_STATIC(engine_lock);
+static struct swift_engine_ref *shared_engine;
 
-	if (type == SWIFT_EVENT_AUDIO) {
-		rv = swift_event_get_audio(event, &buf, &len);
+/*! \brief A Swift port opened ahead of time with its voice already set. */
+struct swift_pooled_port {
+	swift_port *port;
+	struct swift_engine_ref *engine;  /* engine the port belongs to */
+	char voice[sizeof(cfg_voice)];
+	const struct swift_format *format;  /* audio the port renders */
+	AST_LIST_ENTRY(swift_pooled_port) list;
+};
 
-		if (!SWIFT_FAILED(rv) && len > 0) {
-			ast_log(LOG_DEBUG, "audio callback\n");
-			ASTOBJ_WRLOCK(ps);
-
-			/* Sleep while waiting for some queue space to become available */
-			while (len + ps->qc > cfg_buffer_size && !ps->immediate_exit) {
-				/* Each byte is 125us of time, so assume queue space will become available
-				   at that rate and guess when we'll have enough space available.
-				   + another (125 usec/sample * framesize samples) (1 frame) for fudge */
-				sleepfor = ((unsigned long)(len - (cfg_buffer_size - ps->qc)) * 125UL) + (125UL * (unsigned long)framesize);
-				/* ast_log(LOG_DEBUG, "generator: %d bytes to write but only %d space avail, sleeping %ldus\n", len, cfg_buffer_size - ps->qc, sleepfor); */
-				ASTOBJ_UNLOCK(ps);
-				usleep(sleepfor);
-				ASTOBJ_WRLOCK(ps);
-			}
-			if (ps->immediate_exit) {
-				ASTOBJ_UNLOCK(ps);
-				return SWIFT_SUCCESS;
-			}
-
-			spacefree = cfg_buffer_size - ((uintptr_t) ps->pq_w - (uintptr_t)ps->q);
-
-			if (len > spacefree) {
-				ast_log(LOG_DEBUG, "audio fancy write; %d bytes but only %d avail to end %d totalavail\n", len, spacefree, cfg_buffer_size - ps->qc);
-
-				/* write #1 to end of mem */
-				memcpy(ps->pq_w, buf, spacefree);
-				ps->pq_w = ps->q;
-				ps->qc += spacefree;
-
-				/* write #2 and beg of mem */
-				memcpy(ps->pq_w, buf + spacefree, len - spacefree);
-				ps->pq_w += len - spacefree;
-				ps->qc += len - spacefree;
-			} else {
-				ast_log(LOG_DEBUG, "audio easy write, %d avail to end %d totalavail\n", spacefree, cfg_buffer_size - ps->qc);
-				memcpy(ps->pq_w, buf, len);
-				ps->pq_w += len;
-				ps->qc += len;
-			}
+/* Idle ports waiting to be checked out.  ports_open counts idle and
+ * checked out ports together and is held to cfg_max_ports. */
+AST_MUTEX_DEFINE_STATIC(port_lock);
+static AST_LIST_HEAD_NOLOCK_STATIC(port_pool, swift_pooled_port);
+static int ports_open;
+/* Without max_ports, as many ports as were rendering when the engine
+ * first refused one for want of a license, or 0 until it does */
+static int ports_learned;
 
-			ASTOBJ_UNLOCK(ps);
-		} else {
-			ast_log(LOG_DEBUG, "got audio callback but get_audio call failed\n");
-		}
-	} else if (type == SWIFT_EVENT_END) {
-		ast_log(LOG_DEBUG, "got END callback; done generating audio\n");
-		ASTOBJ_WRLOCK(ps);
-		ps->generating_done = 1;
-		ASTOBJ_UNLOCK(ps);
-#if defined _SWIFT_VER_6
-	} else if (type == SWIFT_EVENT_ERROR) {
-		/* 
-		 * Error events are used to communicate to app_swift that there are no more swift_ports available.
-		 * So check to make sure that is the cause of the error signal, then terminate. 
-		 * Termination may not be the best behavior, but any queuing should be managed on the Asterisk side.
-		 */
-		swift_result_t error_code;
+/*! \brief A call waiting for a port once all licensed ports are in use. */
+struct swift_port_waiter {
+	int priority;
+	int granted;                    /* a port or a free slot was handed over */
+	struct swift_pooled_port *pp;   /* the port, or NULL to open a new one */
+	ast_cond_t cond;
+	AST_LIST_ENTRY(swift_port_waiter) list;
+};
 
-		if ((swift_event_get_error(event, &error_code, NULL)==SWIFT_SUCCESS) && (error_code == SWIFT_PORT_UNAVAILABLE)) {
-			ast_log(LOG_WARNING, "Received SWIFT_EVENT_ERROR with code: SWIFT_PORT_UNAVAILABLE.  There are no ports available for simultaneous synthesis.  All licensed ports are already in use.\n");
-			ASTOBJ_WRLOCK(ps);
-			ps->generating_done = 1;
-			ASTOBJ_UNLOCK(ps);
-		}
+/* Waiters are kept highest priority first, FIFO within a priority.  All
+ * of this is protected by port_lock. */
+static AST_LIST_HEAD_NOLOCK_STATIC(port_waiters, swift_port_waiter);
+static ast_cond_t port_released;
+static int queue_depth;
+static int queue_peak;
+static unsigned int queue_admitted;
+static unsigned int queue_timeouts;
+static unsigned int queue_rejected;
+static unsigned long queue_wait_total;
+static unsigned int queue_wait_max;
+
+/* The audio queue is shared by exactly one producer (the Swift callback
+ * thread) and one consumer (the channel thread), so it needs no lock.
+ * head and tail are free running byte counters; only the producer stores
+ * head and only the consumer stores tail.
+ *
+ * The queue is a list of fixed size chunks drawn from a pool shared by
+ * all calls.  The producer links a new chunk when its current one fills,
+ * and the consumer hands chunks back as it drains them, so a call only
+ * holds memory for the audio it has actually buffered. */
+#if defined __GNUC__ && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7))
+#define swift_atomic_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define swift_atomic_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define swift_atomic_load_sc(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define swift_atomic_store_sc(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define swift_stat_add(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#else
+#define swift_atomic_load(p) ({ typeof(*(p)) __v = *(volatile typeof(*(p)) *)(p); __sync_synchronize(); __v; })
+#define swift_atomic_store(p, v) do { __sync_synchronize(); *(volatile typeof(*(p)) *)(p) = (v); } while (0)
+#define swift_atomic_load_sc(p) ({ __sync_synchronize(); swift_atomic_load(p); })
+#define swift_atomic_store_sc(p, v) do { swift_atomic_store(p, v); __sync_synchronize(); } while (0)
+#define swift_stat_add(p, v) __sync_fetch_and_add((p), (v))
 #endif
-	} else {
-		ast_log(LOG_DEBUG, "UNKNOWN callback\n");
-	}
-	return rv;
-}
 
-static int dtmf_conv(int dtmf)
+/*! \brief Raise a counter to v if it is below it. */
+static inline void swift_stat_max(uint64_t *p, uint64_t v)
 {
-	char *res = (char *) malloc(100);
-	int dtmf_search_counter = 0, dtmf_search_match = 0;
+	uint64_t cur = swift_atomic_load(p);
 
-	memset(res, 0, 100);
-
-	while ((dtmf_search_counter < dtmf_codes) && (dtmf_search_match == 0)) {
-		if (dtmf == ast_dtmf_table[dtmf_search_counter].ast_res) {
-			dtmf_search_match += 1;
-			sprintf(res, "%s", ast_dtmf_table[dtmf_search_counter].dtmf_res);
-		}
-		dtmf_search_counter = dtmf_search_counter + 1;
+	while (cur < v && !__sync_bool_compare_and_swap(p, cur, v)) {
+		cur = swift_atomic_load(p);
 	}
-	return *res;
 }
 
-static char *listen_for_dtmf(struct ast_channel *chan, int timeout, int max_digits)
-{
-	char *dtmf_conversion = (char *) malloc(100);
-	char cnv[2];
-	int dtmf = 0, i = 0;
+#define SWIFT_CHUNK_SIZE 4096
+#define SWIFT_CHUNK_FREE_MAX 256
 
-	memset(dtmf_conversion, 0, 100);
-	memset(cnv, 0, 2);
+struct swift_chunk {
+	struct swift_chunk *next;   /* published by the producer */
+	unsigned char data[SWIFT_CHUNK_SIZE];
+};
 
-	while (i < max_digits) {
-		dtmf = ast_waitfordigit(chan, timeout);
+AST_MUTEX_DEFINE_STATIC(chunk_lock);
+static ast_cond_t chunk_cond;
+static struct swift_chunk *chunk_free_list;
+static int chunks_free;
+static int chunks_in_use;
+static int chunk_waiters;
 
-		if (!dtmf) {
-			break;
-		}
+/*! \brief Rendered audio for one prompt, shared by reference.
+ *
+ * The audio is only ever appended to, and readers each keep their own
+ * cursor, so any number of channels can play it at once, even while it is
+ * still being synthesized.  The cache holds a reference on each entry it
+ * keeps.
+ */
+struct swift_audio {
+	int refs;
+	unsigned int len;            /* bytes appended, published last */
+	int done;                    /* 1 complete, -1 abandoned part way */
+	struct swift_chunk *first;
+	struct swift_chunk *last;
+	const unsigned char *data;   /* or all of it, in the prompt store */
+	struct swift_store_map *map;
+	unsigned int hash;
+	struct swift_audio *hnext;   /* cache hash chain */
+	struct swift_audio *inext;   /* in flight hash chain */
+	struct swift_audio *prev;    /* cache LRU list, most recent first */
+	struct swift_audio *next;
+	const char *params;          /* swift_format params */
+	char voice[sizeof(cfg_voice)];
+	char text[0];
+};
 
-		sprintf(cnv, "%c", dtmf_conv(dtmf));
-		strcat(dtmf_conversion, cnv);
-		i += 1;
-	}
-	return strdup(dtmf_conversion);
-}
+/*! \brief A reader's position in a swift_audio. */
+struct swift_audio_cursor {
+	struct swift_chunk *chunk;
+	unsigned int off;
+	unsigned int pos;
+};
 
-#if (defined _AST_VER_1_4 || defined _AST_VER_1_6)
-static int app_exec(struct ast_channel *chan, void *data)
-#elif (defined _AST_VER_1_8 || defined _AST_VER_10 || defined _AST_VER_11 || defined _AST_VER_12 || defined _AST_VER_13)
-static int app_exec(struct ast_channel *chan, const char *data)
-#endif
-{
-	int res = 0, max_digits = 0, timeout = 0, alreadyran = 0;
-	int ms, len, availatend;
-	char *argv[3], *text = NULL, *rc = NULL;
-	char tmp_exten[2], results[20];
-	struct ast_module_user *u;
-	struct ast_frame *f;
-	struct timeval next;
-	struct stuff *ps;
-	char *parse;
-#if (defined _AST_VER_10 || defined _AST_VER_11 || defined _AST_VER_12)
-	struct ast_format old_writeformat;
-#elif (defined _AST_VER_13)
-	RAII_VAR(struct ast_format *, old_writeformat, NULL, ao2_cleanup);
+/*! \brief An audio format Swift can render and we can send to the
+ * channel as is.  params is part of the cache key, so audio rendered one
+ * way is never played back for another.
+ */
+struct swift_format {
+	const char *name;       /* as in swift.conf */
+	const char *ext;        /* of Asterisk sound files */
+	const char *encoding;   /* Swift audio/encoding */
+	const char *rate;       /* Swift audio/sampling-rate */
+	unsigned int samplerate;
+	unsigned int bytes;     /* per sample */
+	const char *params;
+#if (defined _AST_VER_13)
+	struct ast_format **format;
 #else
-	int old_writeformat = 0;
+	int format;
 #endif
-	parse = ast_strdupa(data);
-
-	AST_DECLARE_APP_ARGS(args,
-		AST_APP_ARG(text);
-		AST_APP_ARG(timeout);
-		AST_APP_ARG(max_digits);
-	);
+};
 
-	AST_STANDARD_APP_ARGS(args, parse);
+#if (defined _AST_VER_13)
+#define SWIFT_AST_FORMAT(id, cached) &cached
+#else
+#define SWIFT_AST_FORMAT(id, cached) id
+#endif
 
-	struct myframe {
-		struct ast_frame f;
-		unsigned char offset[AST_FRIENDLY_OFFSET];
-		unsigned char frdata[framesize];
-	} myf;
+/* Ports are opened for the first one */
+static const struct swift_format swift_formats[] = {
+	{ "ulaw", "ulaw", "ulaw", "8000", 8000, 1, "ulaw/8000/raw/utf-8", SWIFT_AST_FORMAT(AST_FORMAT_ULAW, ast_format_ulaw) },
+	{ "alaw", "alaw", "alaw", "8000", 8000, 1, "alaw/8000/raw/utf-8", SWIFT_AST_FORMAT(AST_FORMAT_ALAW, ast_format_alaw) },
+	{ "slin", "sln", "pcm16", "8000", 8000, 2, "pcm16/8000/raw/utf-8", SWIFT_AST_FORMAT(AST_FORMAT_SLINEAR, ast_format_slin) },
+#if !defined _AST_VER_1_4
+	{ "slin16", "sln16", "pcm16", "16000", 16000, 2, "pcm16/16000/raw/utf-8", SWIFT_AST_FORMAT(AST_FORMAT_SLINEAR16, ast_format_slin16) },
+#endif
+};
 
-	swift_engine *engine;
-	swift_port *port = NULL;
-	swift_voice *voice;
-	swift_params *params;
-	swift_result_t sresult;
-	swift_background_t tts_stream;
-	unsigned int event_mask;
-	const char *vvoice = NULL;
+static const struct swift_format *swift_format_by_name(const char *name)
+{
+	unsigned int i;
 
-	memset(results, 0 ,20);
-	memset(tmp_exten, 0, 2);
-	memset(argv, 0, 3);
+	for (i = 0; i < sizeof(swift_formats) / sizeof(swift_formats[0]); i++) {
+		if (!strcasecmp(swift_formats[i].name, name)) {
+			return &swift_formats[i];
+		}
+	}
+	return NULL;
+}
 
-	u = ast_module_user_add(chan);
+/*! \brief Pick the format to render for a channel: the one it sends
+ * natively if Swift can render that, so the core does not have to
+ * translate every frame, otherwise signed linear at its sample rate.
+ */
+static const struct swift_format *swift_format_for_channel(struct ast_channel *chan)
+{
+	const struct swift_format *fmt = NULL;
+	unsigned int rate = 8000;
+	unsigned int i;
 
-	if (!ast_strlen_zero(args.timeout)) {
-		timeout = strtol(args.timeout, NULL, 0);
+	for (i = 0; i < sizeof(swift_formats) / sizeof(swift_formats[0]) && !fmt; i++) {
+#if (defined _AST_VER_13)
+		if (ast_format_cmp(ast_channel_rawwriteformat(chan), *swift_formats[i].format) == AST_FORMAT_CMP_EQUAL) {
+#elif (defined _AST_VER_11 || defined _AST_VER_12)
+		if (ast_channel_rawwriteformat(chan)->id == swift_formats[i].format) {
+#elif (defined _AST_VER_10)
+		if (chan->rawwriteformat.id == swift_formats[i].format) {
+#else
+		if (chan->rawwriteformat == swift_formats[i].format) {
+#endif
+			fmt = &swift_formats[i];
+		}
 	}
-	if (!ast_strlen_zero(args.max_digits)) {
-		max_digits = strtol(args.max_digits, NULL, 0);
+	if (fmt) {
+		return fmt;
 	}
-	text = args.text;
 
-	if (ast_strlen_zero(text)) {
-		ast_log(LOG_WARNING, "%s requires text to speak!\n", app);
-		return -1;
-	}else{
-		ast_log(LOG_DEBUG, "Text to Speak : %s\n", text);
+#if (defined _AST_VER_13)
+	rate = ast_format_get_sample_rate(ast_channel_rawwriteformat(chan));
+#elif (defined _AST_VER_11 || defined _AST_VER_12)
+	rate = ast_format_rate(ast_channel_rawwriteformat(chan));
+#elif (defined _AST_VER_10)
+	rate = ast_format_rate(&chan->rawwriteformat);
+#elif !defined _AST_VER_1_4
+	rate = ast_format_rate(chan->rawwriteformat);
+#endif
+	if (rate >= 16000 && (fmt = swift_format_by_name("slin16"))) {
+		return fmt;
 	}
-	if (timeout > 0) {
-		ast_log(LOG_DEBUG, "Timeout : %d\n", timeout);
+	return swift_format_by_name("slin");
+}
+
+/*! \brief The format to render for a call: ${SWIFT_FORMAT}, then format in
+ * swift.conf, then whatever suits the channel.  Without a channel, the
+ * format ports are opened with.
+ */
+static const struct swift_format *swift_format_for_call(struct ast_channel *chan)
+{
+	const struct swift_format *fmt;
+	const char *val;
+
+	if (chan && (val = pbx_builtin_getvar_helper(chan, "SWIFT_FORMAT")) && strcasecmp(val, "auto")) {
+		if ((fmt = swift_format_by_name(val))) {
+			return fmt;
+		}
+		ast_log(LOG_WARNING, "Unknown SWIFT_FORMAT '%s'\n", val);
 	}
-	if (max_digits > 0) {
-		ast_log(LOG_DEBUG, "Max Digits : %d\n", max_digits);
+	if (cfg_format) {
+		return cfg_format;
 	}
+	return chan ? swift_format_for_channel(chan) : &swift_formats[0];
+}
 
-	ps = malloc(sizeof(struct stuff));
-	swift_init_stuff(ps);
+/* Rendered audio is cleaned up in blocks of SWIFT_TRIM_BLOCK_MS: leading
+ * silence is dropped, silent runs are passed on up to trim_tail and then
+ * held back until speech resumes, so whatever is held at the end is
+ * dropped.  A pause longer than SWIFT_TRIM_HOLD_MS is meant, and passed on.
+ */
+#define SWIFT_TRIM_BLOCK_MS 10
+#define SWIFT_TRIM_BLOCK_MAX (SWIFT_TRIM_BLOCK_MS * 32)  /* up to 16 bit, 16kHz */
+#define SWIFT_TRIM_HOLD_MS 1000
+#define SWIFT_GAIN_UNITY 4096
 
-	/* Setup synthesis */
+struct swift_trim {
+	const struct swift_format *format;
+	char voice[sizeof(cfg_voice)];
+	unsigned int block;          /* bytes per block */
+	unsigned int thresh;         /* mean square of a silent block */
+	unsigned int keep;           /* bytes of a silent run passed on */
+	int gain;                    /* Q12, SWIFT_GAIN_UNITY for none */
+	int started;                 /* past the leading silence */
+	unsigned int quiet;          /* bytes of the current silent run passed on */
+	unsigned int carry_len;
+	unsigned char carry[SWIFT_TRIM_BLOCK_MAX];
+	unsigned char *hold;
+	unsigned int hold_len;
+	unsigned int hold_size;
+	unsigned char *out;
+	unsigned int out_size;
+	uint64_t level_sum;          /* of the speech, for the voice's level */
+	uint64_t level_samples;
+	unsigned int dropped;        /* bytes of silence trimmed */
+};
 
-	if ((engine = swift_engine_open(NULL)) == NULL) {
-		ast_log(LOG_ERROR, "Failed to open Swift Engine.\n");
-		goto exception;
-	}
+#define SWIFT_CACHE_BUCKETS 1024
 
-	params = swift_params_new(NULL);
-	swift_params_set_string(params, "audio/encoding", "ulaw");
-	swift_params_set_string(params, "audio/sampling-rate", "8000");
-	swift_params_set_string(params, "audio/output-format", "raw");
-	swift_params_set_string(params, "tts/text-encoding", "utf-8");
+/* Long text is spoken a sentence at a time.  A sentence break needs at
+ * least SEGMENT_MIN characters before it (so "Hi." is not rendered on its
+ * own), a clause break SEGMENT_CLAUSE, and past SEGMENT_MAX we break at
+ * any space.
+ */
+#define SWIFT_SEGMENT_MIN 12
+#define SWIFT_SEGMENT_CLAUSE 60
+#define SWIFT_SEGMENT_MAX 250
 
-	/* Additional swift parameters
-	 *
-	 * swift_params_set_float(params, "speech/pitch/shift", 1.0);
-	 * swift_params_set_int(params, "speech/rate", 150);
-	 * swift_params_set_int(params, "audio/volume", 110);
-	 * swift_params_set_int(params, "audio/deadair", 0);
-	 */
+/*! \brief One piece of a call's text, and its audio once it is cached,
+ * being rendered by us, or being rendered by another call. */
+struct swift_segment {
+	const char *text;
+	struct swift_audio *audio;
+	int slot;               /* a template's variable part */
+};
 
-	if ((port = swift_port_open(engine, params)) == NULL) {
-		ast_log(LOG_ERROR, "Failed to open Swift Port.\n");
-		goto exception;
-	}
+AST_MUTEX_DEFINE_STATIC(cache_lock);
+static struct swift_audio *cache_buckets[SWIFT_CACHE_BUCKETS];
+static struct swift_audio *cache_lru_head;
+static struct swift_audio *cache_lru_tail;
+static unsigned int cache_bytes;
+static int cache_entries;
+static unsigned int cache_hits;
+static unsigned int cache_misses;
+static unsigned int cache_evictions;
 
-#if defined _SWIFT_VER_6
-	if (port!=NULL) {
-		/* 
-		 * This registers a chan with swift, otherwise through repeated DTMF+synth requests
-		 * a single call could consume all available concurrent synthesis ports.
-		*/
-		swift_register_ast_chan(port, chan);
-	}
-#endif
+/* Syntheses under way, so identical requests can share one.  Also
+ * protected by cache_lock. */
+static struct swift_audio *inflight_buckets[SWIFT_CACHE_BUCKETS];
+static int inflight_count;
+static unsigned int inflight_joins;
 
-	ast_log(LOG_DEBUG, "Config voice is %s via %s\n", cfg_voice, SWIFT_CONFIG_FILE);
+/*! \brief A read-only mapping of the prompt store's data file.  Audio
+ * served from the store points straight into it, so it stays mapped until
+ * the last reader lets go, even after a remap or compaction. */
+struct swift_store_map {
+	int refs;
+	unsigned char *base;
+	size_t size;
+};
 
-	/* allow exten => x,n,Set(SWIFT_VOICE=Callie) */
-	if ((vvoice = pbx_builtin_getvar_helper(chan, "SWIFT_VOICE"))) {
-		ast_copy_string(cfg_voice, vvoice, sizeof(cfg_voice));
-		ast_log(LOG_DEBUG, "Config voice override to %s via SWIFT_VOICE\n", cfg_voice);
-	}
+/* The prompt store is one append-only file of records, each holding the
+ * key (params, voice and text) and the raw audio.  Every record carries a
+ * checksum, so a record torn by a crash is simply never indexed, and the
+ * next writer cuts it off.  The hash index is rebuilt in memory from the
+ * record headers, and picks up records other processes append.  Appends
+ * and compaction take an exclusive flock() on a lock file beside it. */
+#define SWIFT_STORE_MAGIC "SWIFTPS1"
+#define SWIFT_STORE_REC_MAGIC 0x53574654
+#define SWIFT_STORE_BUCKETS 4096
 
-	if ((voice = swift_port_set_voice_by_name(port, cfg_voice)) == NULL) {
-		ast_log(LOG_ERROR, "Failed to set voice.\n");
-		goto exception;
-	}
+struct swift_store_rec {
+	uint32_t magic;
+	uint32_t hash;
+	uint32_t key_len;
+	uint32_t audio_len;
+	uint32_t sum;         /* over hash, lengths, key and audio */
+	uint32_t pad;
+};
 
+struct swift_store_entry {
+	unsigned int hash;
+	size_t off;
+	struct swift_store_entry *next;
+};
 
-#if defined _SWIFT_VER_6
-	event_mask = SWIFT_EVENT_AUDIO | SWIFT_EVENT_END | SWIFT_EVENT_ERROR;
-#elif defined _SWIFT_VER_5
-	event_mask = SWIFT_EVENT_AUDIO | SWIFT_EVENT_END;
-#endif
+/* The store in use, as swift.conf named it when it was opened; a reload
+ * rewrites the cfg_ values while calls are using the store. */
+AST_MUTEX_DEFINE_STATIC(store_lock);
+static char store_path[PATH_MAX];
+static unsigned int store_size;
+static int store_fd = -1;
+static int store_lock_fd = -1;
+static ino_t store_ino;
+static size_t store_scanned;  /* bytes indexed so far */
+static struct swift_store_map *store_map;
+static struct swift_store_entry *store_buckets[SWIFT_STORE_BUCKETS];
+static int store_entries;
+static unsigned int store_hits;
+static unsigned int store_writes;
+static unsigned int store_compactions;
 
-	swift_port_set_callback(port, &swift_cb, event_mask, ps);
+/* Prefetches render on threads of their own; handles name the recent ones
+ * so Swift() can speak them without repeating the text. */
+#define SWIFT_PREFETCH_HANDLES 256
+#define SWIFT_PREFETCH_THREADS 64
+#define SWIFT_PREFETCH_PREFIX "prefetch:"
 
-	if (SWIFT_FAILED(swift_port_speak_text(port, text, 0, NULL, &tts_stream, NULL))) {
-		ast_log(LOG_ERROR, "Failed to speak.\n");
-		goto exception;
+struct swift_prefetch {
+	unsigned int id;
+	char voice[20];
+	const struct swift_format *format;
+	char *text;
+	int priority;
+	AST_LIST_ENTRY(swift_prefetch) list;
+};
+
+AST_MUTEX_DEFINE_STATIC(prefetch_lock);
+static ast_cond_t prefetch_cond;
+static struct swift_prefetch prefetch_handles[SWIFT_PREFETCH_HANDLES];
+static unsigned int prefetch_next_id;
+static int prefetch_threads;
+static int prefetch_shutdown;
+static unsigned int prefetch_started;
+static unsigned int prefetch_dropped;
+
+/* Prompts from the [preload] section, and those waiting to be warmed up.
+ * Workers share the prefetch lock and thread count. */
+#define SWIFT_PRELOAD_PRIORITY -100
+
+static int cfg_preload_workers;
+static AST_LIST_HEAD_NOLOCK_STATIC(preload_list, swift_prefetch);
+static AST_LIST_HEAD_NOLOCK_STATIC(preload_queue, swift_prefetch);
+static int preload_workers;
+static unsigned int preload_rendered;
+
+/* "swift render" works through a manifest of prompts on workers of its
+ * own, which also share the prefetch lock and thread count.  A state file
+ * beside the manifest records what each sound file was rendered from. */
+#define SWIFT_BATCH_WORKERS 4           /* with no limit on ports */
+#define SWIFT_BATCH_WAIT 60000          /* ms to queue for a port */
+#define SWIFT_BATCH_TRIES 20            /* times a refused port is tried again */
+#define SWIFT_BATCH_STATE ".state"
+
+struct swift_batch_entry {
+	char voice[20];
+	const struct swift_format *format;
+	unsigned int hash;
+	char *output;                       /* sound file, or NULL for the prompt store */
+	AST_LIST_ENTRY(swift_batch_entry) list;
+	char text[0];
+};
+
+static AST_LIST_HEAD_NOLOCK_STATIC(batch_queue, swift_batch_entry);
+static char batch_manifest[PATH_MAX];
+static FILE *batch_state;
+static int batch_running;
+static int batch_workers;
+static unsigned int batch_total;
+static unsigned int batch_rendered;
+static unsigned int batch_unchanged;
+static unsigned int batch_failed;
+static struct timeval batch_start;
+static struct timeval batch_end;
+
+/* With synth_workers set, a fixed pool of threads runs every synthesis,
+ * speaking synchronously on the caller's port, in place of a background
+ * thread from the engine for each request.  Calls still check out their
+ * own port; only the rendering is handed over. */
+#define SWIFT_SYNTH_MAX 256
+
+enum swift_synth_state {
+	SWIFT_SYNTH_IDLE,
+	SWIFT_SYNTH_QUEUED,
+	SWIFT_SYNTH_RUNNING,
+};
+
+struct swift_synth_job {
+	struct stuff *ps;
+	swift_port *port;               /* NULL when rendering on the engine's thread */
+	const char *text;
+	enum swift_synth_state state;
+	struct timeval queued;
+	AST_LIST_ENTRY(swift_synth_job) list;
+};
+
+static int cfg_synth_workers;
+static char cfg_synth_cpus[64];
+AST_MUTEX_DEFINE_STATIC(synth_lock);
+static ast_cond_t synth_cond;       /* work queued, or workers to retire */
+static ast_cond_t synth_done;       /* a job finished, or a worker exited */
+static AST_LIST_HEAD_NOLOCK_STATIC(synth_queue, swift_synth_job);
+static int synth_target;            /* workers wanted */
+static int synth_threads;           /* workers running */
+static int synth_busy;
+static int synth_queued;
+static unsigned int synth_pin_gen;  /* bumped when synth_cpus may have changed */
+
+/* Waiting on swift_broker's answer, beyond the call's queue_timeout */
+#define SWIFT_BROKER_GRACE 1000
+/* Or, when not waiting for a port, a frame at most; it answers at once */
+#define SWIFT_BROKER_PROBE 20
+
+/*! \brief A rendering swift_broker does for a call.  The broker renders
+ * into a memory file we map, and a thread of ours hands the audio to the
+ * call as it is told how far it goes, as swift_cb() would. */
+struct swift_broker_call {
+	int fd;                         /* connection to the broker */
+	unsigned char *map;
+	size_t size;                    /* bytes mapped */
+	size_t done;                    /* bytes handed to the call */
+	pthread_t thread;
+	int passed;                     /* descriptor received, or -1 */
+	size_t have;                    /* bytes in buf */
+	size_t used;                    /* of them, already returned as a line */
+	char buf[128];
+};
+
+static time_t broker_warned;
+
+/* Each call keeps a ring of its recent trace records, written from both
+ * the Swift callback and the channel thread without a lock.  A record
+ * being overwritten while "swift show trace" copies it may come out
+ * mixed; that is the price of keeping it off the audio path.  Build with
+ * -DSWIFT_NO_TRACE to compile the trace points out altogether. */
+#define SWIFT_TRACE_SIZE 256    /* records per call, a power of 2 */
+#define SWIFT_TRACE_KEEP 16     /* traces of finished calls kept */
+
+enum swift_trace_event {
+	SWIFT_TRACE_START,          /* value: 1 if cached */
+	SWIFT_TRACE_PORT,           /* value: ms waited */
+	SWIFT_TRACE_SPEAK,          /* value: segment, or 0 */
+	SWIFT_TRACE_AUDIO,          /* value: bytes rendered */
+	SWIFT_TRACE_SLEEP,          /* producer waits on a full queue */
+	SWIFT_TRACE_WAKE,           /* value: us slept */
+	SWIFT_TRACE_END,
+	SWIFT_TRACE_FRAME,          /* value: bytes sent in place */
+	SWIFT_TRACE_FRAME_COPY,     /* value: bytes copied and sent */
+	SWIFT_TRACE_WRITE_FAIL,
+	SWIFT_TRACE_STARVED,        /* value: bytes available */
+	SWIFT_TRACE_CANCEL,
+	SWIFT_TRACE_CHECKIN,        /* value: us since the cancel, if cancelled */
+	SWIFT_TRACE_WORKER,         /* value: ms queued for a synthesis worker */
+};
+
+#if !defined SWIFT_NO_TRACE
+static const char * const swift_trace_names[] = {
+	[SWIFT_TRACE_START] = "start",
+	[SWIFT_TRACE_PORT] = "port",
+	[SWIFT_TRACE_SPEAK] = "speak",
+	[SWIFT_TRACE_AUDIO] = "audio",
+	[SWIFT_TRACE_SLEEP] = "sleep",
+	[SWIFT_TRACE_WAKE] = "wake",
+	[SWIFT_TRACE_END] = "end",
+	[SWIFT_TRACE_FRAME] = "frame",
+	[SWIFT_TRACE_FRAME_COPY] = "frame-copy",
+	[SWIFT_TRACE_WRITE_FAIL] = "write-fail",
+	[SWIFT_TRACE_STARVED] = "starved",
+	[SWIFT_TRACE_CANCEL] = "cancel",
+	[SWIFT_TRACE_CHECKIN] = "checkin",
+	[SWIFT_TRACE_WORKER] = "worker",
+};
+
+struct swift_trace_rec {
+	int64_t us;                 /* since the epoch */
+	uint32_t depth;             /* bytes in the call's queue */
+	uint32_t value;
+	uint32_t event;
+};
+
+struct swift_trace {
+	char name[80];              /* channel */
+	unsigned int next;
+	struct swift_trace_rec recs[SWIFT_TRACE_SIZE];
+	AST_LIST_ENTRY(swift_trace) list;
+};
+
+/* Traces of calls in progress, and copies of the last few finished */
+AST_MUTEX_DEFINE_STATIC(trace_lock);
+static AST_LIST_HEAD_NOLOCK_STATIC(trace_calls, swift_trace);
+static struct swift_trace *trace_done[SWIFT_TRACE_KEEP];
+static unsigned int trace_done_next;
+#endif
+
+struct stuff {
+	int generating_done;
+	int fill_only;       /* audio only goes to fill, not the queue */
+	unsigned int qsize;  /* most bytes this call may buffer */
+	unsigned int head;   /* bytes written by the producer */
+	unsigned int tail;   /* bytes read by the consumer */
+	struct swift_chunk *rchunk;  /* consumer's chunk */
+	unsigned int roff;
+	struct swift_chunk *wchunk;  /* producer's chunk */
+	unsigned int woff;
+	int immediate_exit;
+	struct timeval cancelled;  /* first asked to stop, by the channel thread */
+	int port_unavailable;
+	/* The producer sleeps here only when the queue is full, and the
+	 * consumer wakes it once want bytes are free. */
+	ast_mutex_t lock;
+	ast_cond_t cond;
+	int producer_waiting;
+	unsigned int want;
+	/* Set when playing a cached prompt instead of the queue */
+	struct swift_audio *audio;
+	struct swift_audio_cursor cursor;
+	/* Producer's copy of the audio, to be cached when synthesis ends.
+	 * Identical requests meanwhile play it as it grows. */
+	struct swift_audio *fill;
+	/* Silence trimming and level, applied to audio as it is rendered */
+	struct swift_trim *trim;
+	/* Bytes of synthesized audio to drop, already played from a shared
+	 * synthesis that was abandoned */
+	unsigned int skip;
+	/* Text split into segments, played one after another from their own
+	 * audio.  Only used when there is more than one. */
+	struct swift_segment *segs;
+	char *seg_buf;
+	int nsegs;
+	int seg_play;           /* segment being played */
+	int seg_render;         /* segment our port is rendering, or -1 */
+	int seg_looked;         /* last segment looked up in the cache */
+	int seg_probed;         /* last segment swift_broker had no free port for */
+	unsigned int seek;      /* bytes of it to skip, already played */
+	/* Playback, driven by the channel's generator */
+	struct timeval start;   /* Swift() was called */
+	int cached;             /* played from the cache or prompt store */
+	int first_frame_sent;
+	const struct swift_format *format;
+	/* Playback waits until enough is buffered to play through to the
+	 * end at the voice's speed, and again if it ever starves. */
+	int buffering;
+	struct timeval starved_at;
+	unsigned int played;    /* bytes */
+	unsigned int expected;  /* bytes the text should come to */
+	unsigned int pb_gap;    /* bytes to cover the engine's longest pause */
+	unsigned int pb_max;    /* bytes never to wait beyond */
+	double pb_speed;
+	/* The rendering under way, to learn the voice's speed from */
+	char render_voice[sizeof(cfg_voice)];
+	unsigned int render_chars;
+	unsigned int render_bytes;
+	unsigned int render_first_bytes;
+	struct timeval render_first;
+	struct timeval render_last;
+	int64_t render_gap_us;
+	int no_cache;           /* fill is not offered to the cache */
+	/* The rendering as handed to the worker pool */
+	struct swift_synth_job job;
+	/* Or as rendered by swift_broker */
+	struct swift_broker_call *broker;
+	unsigned int framesize;
+	unsigned int owed;      /* bytes the channel has asked for */
+	struct ast_frame f;
+	unsigned char offset[AST_FRIENDLY_OFFSET];
+	unsigned char frdata[SWIFT_MAX_PTIME * 32];  /* frames not sent in place */
+#if !defined SWIFT_NO_TRACE
+	struct swift_trace trace;
+#endif
+};
+
+#if defined SWIFT_NO_TRACE
+#define swift_trace(ps, event, value) do { } while (0)
+#define swift_trace_begin(ps, chan) do { } while (0)
+#define swift_trace_finish(ps) do { } while (0)
+#define swift_trace_clear() do { } while (0)
+#else
+#define swift_trace(ps, event, value) swift_trace_add(&(ps)->trace, (event), \
+	swift_atomic_load(&(ps)->head) - swift_atomic_load(&(ps)->tail), (value))
+
+static void swift_trace_add(struct swift_trace *tr, enum swift_trace_event event, unsigned int depth, unsigned int value)
+{
+	struct swift_trace_rec *rec = &tr->recs[swift_stat_add(&tr->next, 1) & (SWIFT_TRACE_SIZE - 1)];
+	struct timeval now = ast_tvnow();
+
+	rec->us = now.tv_sec * (int64_t) 1000000 + now.tv_usec;
+	rec->depth = depth;
+	rec->value = value;
+	rec->event = event;
+}
+
+/*! \brief Make a call's trace visible to "swift show trace". */
+static void swift_trace_begin(struct stuff *ps, struct ast_channel *chan)
+{
+#if (defined _AST_VER_11 || defined _AST_VER_12 || defined _AST_VER_13)
+	ast_copy_string(ps->trace.name, ast_channel_name(chan), sizeof(ps->trace.name));
+#else
+	ast_copy_string(ps->trace.name, chan->name, sizeof(ps->trace.name));
+#endif
+	ast_mutex_lock(&trace_lock);
+	AST_LIST_INSERT_HEAD(&trace_calls, &ps->trace, list);
+	ast_mutex_unlock(&trace_lock);
+}
+
+/*! \brief Take a call's trace off the live list, keeping a copy of it
+ * among the recently finished. */
+static void swift_trace_finish(struct stuff *ps)
+{
+	struct swift_trace *copy = ast_malloc(sizeof(*copy));
+
+	ast_mutex_lock(&trace_lock);
+	AST_LIST_REMOVE(&trace_calls, &ps->trace, list);
+	if (copy) {
+		*copy = ps->trace;
+		ast_free(trace_done[trace_done_next]);
+		trace_done[trace_done_next] = copy;
+		trace_done_next = (trace_done_next + 1) % SWIFT_TRACE_KEEP;
+	}
+	ast_mutex_unlock(&trace_lock);
+}
+
+static void swift_trace_clear(void)
+{
+	int i;
+
+	ast_mutex_lock(&trace_lock);
+	for (i = 0; i < SWIFT_TRACE_KEEP; i++) {
+		ast_free(trace_done[i]);
+		trace_done[i] = NULL;
+	}
+	ast_mutex_unlock(&trace_lock);
+}
+#endif
+
+struct dtmf_lookup {
+	long ast_res;
+	char* dtmf_res;
+};
+
+static struct dtmf_lookup ast_dtmf_table[dtmf_codes] = {
+	{35, "#"},
+	{42, "*"},
+	{48, "0"},
+	{49, "1"},
+	{50, "2"},
+	{51, "3"},
+	{52, "4"},
+	{53, "5"},
+	{54, "6"},
+	{55, "7"},
+	{56, "8"},
+	{57, "9"}
+};
+
+static struct swift_engine_ref *swift_engine_ref_open(void)
+{
+	struct swift_engine_ref *ref;
+	struct timeval start = ast_tvnow();
+
+	if (!(ref = ast_calloc(1, sizeof(*ref)))) {
+		return NULL;
+	}
+	if ((ref->engine = swift_engine_open(NULL)) == NULL) {
+		ast_log(LOG_ERROR, "Failed to open Swift Engine.\n");
+		ast_free(ref);
+		return NULL;
+	}
+	ref->refs = 1;
+	swift_stat_add(&stats.engine_opens, 1);
+	swift_stat_add(&stats.engine_open_us, swift_tvdiff_us(ast_tvnow(), start));
+	return ref;
+}
+
+static void swift_engine_release(struct swift_engine_ref *ref)
+{
+	if (ref && ast_atomic_dec_and_test(&ref->refs)) {
+		ast_log(LOG_DEBUG, "Closing Swift engine, last reference released\n");
+		swift_engine_close(ref->engine);
+		ast_free(ref);
+	}
+}
+
+/*! \brief Get a reference on the shared engine, or NULL if none is open. */
+static struct swift_engine_ref *swift_engine_acquire(void)
+{
+	struct swift_engine_ref *ref;
+
+	ast_mutex_lock(&engine_lock);
+	if ((ref = shared_engine)) {
+		ast_atomic_fetchadd_int(&ref->refs, 1);
+	}
+	ast_mutex_unlock(&engine_lock);
+	return ref;
+}
+
+/*! \brief Replace the shared engine.  Channels still using the old one keep
+ * it alive until they release their reference.
+ */
+static void swift_engine_replace(struct swift_engine_ref *ref)
+{
+	struct swift_engine_ref *old;
+
+	ast_mutex_lock(&engine_lock);
+	old = shared_engine;
+	shared_engine = ref;
+	ast_mutex_unlock(&engine_lock);
+
+	swift_engine_release(old);
+}
+
+/*! \brief Most ports to have open at once, or 0 for no limit: max_ports,
+ * or failing that what the engine has shown it is licensed for.  Must
+ * hold port_lock.
+ */
+static int swift_port_limit_locked(void)
+{
+	return cfg_max_ports ? cfg_max_ports : ports_learned;
+}
+
+/*! \brief Give a port slot back.  If a call is queued, the slot passes
+ * straight to it and it opens a new port, unless more are open than the
+ * limit now allows.  Must hold port_lock.
+ */
+static void swift_port_slot_release_locked(void)
+{
+	struct swift_port_waiter *w;
+	int limit = swift_port_limit_locked();
+
+	if ((!limit || ports_open <= limit) && (w = AST_LIST_REMOVE_HEAD(&port_waiters, list))) {
+		queue_depth--;
+		w->granted = 1;
+		w->pp = NULL;
+		ast_cond_signal(&w->cond);
+	} else {
+		ports_open--;
+	}
+	ast_cond_broadcast(&port_released);
+}
+
+static void swift_port_slot_release(void)
+{
+	ast_mutex_lock(&port_lock);
+	swift_port_slot_release_locked();
+	ast_mutex_unlock(&port_lock);
+}
+
+static void swift_pooled_port_close(struct swift_pooled_port *pp)
+{
+	swift_port_close(pp->port);
+	swift_engine_release(pp->engine);
+	ast_free(pp);
+
+	swift_port_slot_release();
+}
+
+/*! \brief Open a new port on the shared engine, rendering fmt, and bind a
+ * voice to it.  The caller must already have counted it in ports_open.
+ */
+static struct swift_pooled_port *swift_pooled_port_open(const char *voice_name, const struct swift_format *fmt)
+{
+	struct swift_pooled_port *pp;
+	swift_params *params;
+	struct timeval start = ast_tvnow();
+
+	if (!(pp = ast_calloc(1, sizeof(*pp)))) {
+		return NULL;
+	}
+	if ((pp->engine = swift_engine_acquire()) == NULL) {
+		ast_log(LOG_ERROR, "Swift Engine is not available.\n");
+		ast_free(pp);
+		return NULL;
+	}
+
+	params = swift_params_new(NULL);
+	pp->format = fmt;
+	swift_params_set_string(params, "audio/encoding", pp->format->encoding);
+	swift_params_set_string(params, "audio/sampling-rate", pp->format->rate);
+	swift_params_set_string(params, "audio/output-format", "raw");
+	swift_params_set_string(params, "tts/text-encoding", "utf-8");
+
+	/* Additional swift parameters
+	 *
+	 * swift_params_set_float(params, "speech/pitch/shift", 1.0);
+	 * swift_params_set_int(params, "speech/rate", 150);
+	 * swift_params_set_int(params, "audio/volume", 110);
+	 * swift_params_set_int(params, "audio/deadair", 0);
+	 */
+
+	if ((pp->port = swift_port_open(pp->engine->engine, params)) == NULL) {
+		ast_log(LOG_ERROR, "Failed to open Swift Port.\n");
+		swift_engine_release(pp->engine);
+		ast_free(pp);
+		return NULL;
+	}
+
+	if (swift_port_set_voice_by_name(pp->port, voice_name) == NULL) {
+		ast_log(LOG_ERROR, "Failed to set voice %s.\n", voice_name);
+		swift_port_close(pp->port);
+		swift_engine_release(pp->engine);
+		ast_free(pp);
+		return NULL;
+	}
+	ast_copy_string(pp->voice, voice_name, sizeof(pp->voice));
+	swift_stat_add(&stats.port_opens, 1);
+	swift_stat_add(&stats.port_open_us, swift_tvdiff_us(ast_tvnow(), start));
+
+	return pp;
+}
+
+static int swift_port_rebind(struct swift_pooled_port *pp, const char *voice_name)
+{
+	if (!strcasecmp(pp->voice, voice_name)) {
+		return 0;
+	}
+	ast_log(LOG_DEBUG, "Rebinding pooled port from voice %s to %s\n", pp->voice, voice_name);
+	if (swift_port_set_voice_by_name(pp->port, voice_name) == NULL) {
+		ast_log(LOG_ERROR, "Failed to set voice %s.\n", voice_name);
+		return -1;
+	}
+	ast_copy_string(pp->voice, voice_name, sizeof(pp->voice));
+	return 0;
+}
+
+/*! \brief Queue up for a port.  Must be called with port_lock held.
+ * \retval 1 granted, with *ppp set to a port, or NULL to open a new one
+ * \retval 0 timed out
+ */
+static int swift_port_wait_locked(int priority, int max_wait, int *waited, struct swift_pooled_port **ppp)
+{
+	struct swift_port_waiter w = { .priority = priority, };
+	struct swift_port_waiter *cur, *prev = NULL;
+	struct timeval start = ast_tvnow(), until;
+	struct timespec ts;
+	unsigned int elapsed;
+
+	ast_cond_init(&w.cond, NULL);
+
+	AST_LIST_TRAVERSE(&port_waiters, cur, list) {
+		if (cur->priority < priority) {
+			break;
+		}
+		prev = cur;
+	}
+	if (prev) {
+		AST_LIST_INSERT_AFTER(&port_waiters, prev, &w, list);
+	} else {
+		AST_LIST_INSERT_HEAD(&port_waiters, &w, list);
+	}
+	if (++queue_depth > queue_peak) {
+		queue_peak = queue_depth;
+	}
+	ast_log(LOG_DEBUG, "Waiting up to %dms for a Swift port, %d in queue\n", max_wait, queue_depth);
+
+	until = ast_tvadd(start, ast_samp2tv(max_wait, 1000));
+	ts.tv_sec = until.tv_sec;
+	ts.tv_nsec = until.tv_usec * 1000;
+
+	while (!w.granted) {
+		if (ast_cond_timedwait(&w.cond, &port_lock, &ts) == ETIMEDOUT) {
+			break;
+		}
+	}
+
+	elapsed = ast_tvdiff_ms(ast_tvnow(), start);
+	*waited = elapsed;
+	queue_wait_total += elapsed;
+	if (elapsed > queue_wait_max) {
+		queue_wait_max = elapsed;
+	}
+
+	if (!w.granted) {
+		AST_LIST_REMOVE(&port_waiters, &w, list);
+		queue_depth--;
+		queue_timeouts++;
+	} else {
+		queue_admitted++;
+		*ppp = w.pp;
+	}
+	ast_cond_destroy(&w.cond);
+
+	return w.granted;
+}
+
+/*! \brief Check out a port with the requested voice, for audio in fmt.
+ *
+ * An idle port already bound to the voice is preferred, rendering fmt if
+ * one is, so swift_port_attach() need not switch it.  Otherwise a new port
+ * is opened if we are under the licensed port count, and failing that an
+ * idle port bound to some other voice (again preferably in fmt) is
+ * switched over.  When every licensed port is busy the caller queues for
+ * up to max_wait milliseconds.
+ *
+ * \param status set to a SWIFT_STATUS value when no port is returned
+ * \param waited set to the time spent in the queue, in milliseconds
+ */
+static struct swift_pooled_port *swift_port_checkout(const char *voice_name, const struct swift_format *fmt, int priority,
+	int max_wait, int *waited, const char **status)
+{
+	struct swift_pooled_port *pp, *voiced = NULL, *other = NULL;
+	struct swift_engine_ref *current;
+
+	*waited = 0;
+
+	ast_mutex_lock(&engine_lock);
+	current = shared_engine;
+	ast_mutex_unlock(&engine_lock);
+
+	ast_mutex_lock(&port_lock);
+	AST_LIST_TRAVERSE_SAFE_BEGIN(&port_pool, pp, list) {
+		if (pp->engine != current) {
+			continue;
+		}
+		if (!strcasecmp(pp->voice, voice_name)) {
+			if (pp->format == fmt) {
+				AST_LIST_REMOVE_CURRENT(list);
+				ast_mutex_unlock(&port_lock);
+				ast_log(LOG_DEBUG, "Checked out pooled port for voice %s\n", voice_name);
+				return pp;
+			}
+			if (!voiced) {
+				voiced = pp;
+			}
+		} else if (!other || (pp->format == fmt && other->format != fmt)) {
+			other = pp;
+		}
+	}
+	AST_LIST_TRAVERSE_SAFE_END;
+
+	if (voiced) {
+		/* Switching the format is cheaper than opening or rebinding */
+		AST_LIST_REMOVE(&port_pool, voiced, list);
+		ast_mutex_unlock(&port_lock);
+		ast_log(LOG_DEBUG, "Checked out pooled port for voice %s\n", voice_name);
+		return voiced;
+	}
+	if (!swift_port_limit_locked() || ports_open < swift_port_limit_locked()) {
+		ports_open++;
+		pp = NULL;
+	} else if (other) {
+		AST_LIST_REMOVE(&port_pool, other, list);
+		pp = other;
+	} else if (max_wait <= 0 || queue_depth >= cfg_queue_size) {
+		queue_rejected++;
+		ast_mutex_unlock(&port_lock);
+		ast_log(LOG_WARNING, "All %d Swift ports are in use and %d calls are queued\n", swift_port_limit_locked(), queue_depth);
+		*status = "QUEUEFULL";
+		return NULL;
+	} else if (!swift_port_wait_locked(priority, max_wait, waited, &pp)) {
+		ast_mutex_unlock(&port_lock);
+		ast_log(LOG_WARNING, "Gave up waiting for a Swift port after %dms\n", *waited);
+		*status = "TIMEOUT";
+		return NULL;
+	}
+	ast_mutex_unlock(&port_lock);
+
+	if (!pp) {
+		/* We hold a slot; open a port to fill it */
+		if (!(pp = swift_pooled_port_open(voice_name, fmt))) {
+			swift_port_slot_release();
+			*status = "ERROR";
+		}
+		return pp;
+	}
+
+	if (swift_port_rebind(pp, voice_name)) {
+		swift_pooled_port_close(pp);
+		*status = "ERROR";
+		return NULL;
+	}
+	return pp;
+}
+
+/*! \brief Whether a port can be checked out without queueing. */
+static int swift_port_available(void)
+{
+	int res;
+
+	ast_mutex_lock(&port_lock);
+	res = !AST_LIST_EMPTY(&port_pool) || !swift_port_limit_locked() || ports_open < swift_port_limit_locked();
+	ast_mutex_unlock(&port_lock);
+	return res;
+}
+
+/*! \brief Number of calls queued for a port. */
+static int swift_port_queued(void)
+{
+	int depth;
+
+	ast_mutex_lock(&port_lock);
+	depth = queue_depth;
+	ast_mutex_unlock(&port_lock);
+	return depth;
+}
+
+/*! \brief Wait up to ms milliseconds for any port to be checked back in. */
+static void swift_port_wait_release(int ms)
+{
+	struct timeval until = ast_tvadd(ast_tvnow(), ast_samp2tv(ms, 1000));
+	struct timespec ts = {
+		.tv_sec = until.tv_sec,
+		.tv_nsec = until.tv_usec * 1000,
+	};
+
+	ast_mutex_lock(&port_lock);
+	ast_cond_timedwait(&port_released, &port_lock, &ts);
+	ast_mutex_unlock(&port_lock);
+}
+
+/*! \brief Return a port once synthesis has stopped or ended.  If a call is
+ * queued the port goes straight to it, otherwise back to the pool.  Ports
+ * opened on an engine that has since been replaced are closed, as are
+ * ports beyond the limit.
+ */
+static void swift_port_checkin(struct swift_pooled_port *pp)
+{
+	struct swift_port_waiter *w;
+	int stale, limit;
+
+	swift_port_set_callback(pp->port, NULL, 0, NULL);
+
+	ast_mutex_lock(&engine_lock);
+	stale = (pp->engine != shared_engine);
+	ast_mutex_unlock(&engine_lock);
+
+	if (stale) {
+		swift_pooled_port_close(pp);
+		return;
+	}
+
+	ast_mutex_lock(&port_lock);
+	if ((limit = swift_port_limit_locked()) && ports_open > limit) {
+		ast_mutex_unlock(&port_lock);
+		swift_pooled_port_close(pp);
+		return;
+	}
+	if ((w = AST_LIST_REMOVE_HEAD(&port_waiters, list))) {
+		queue_depth--;
+		w->granted = 1;
+		w->pp = pp;
+		ast_cond_signal(&w->cond);
+	} else {
+		AST_LIST_INSERT_HEAD(&port_pool, pp, list);
+	}
+	ast_cond_broadcast(&port_released);
+	ast_mutex_unlock(&port_lock);
+}
+
+/*! \brief Give back a port the engine refused for want of a license.
+ * Without max_ports, the ports rendering now are taken to be all it is
+ * licensed for, so later calls queue for them (by priority) instead of
+ * each trying its luck with a port of its own.
+ */
+static void swift_port_refused(struct swift_pooled_port *pp)
+{
+	struct swift_pooled_port *cur;
+	int rendering;
+
+	ast_mutex_lock(&port_lock);
+	if (!cfg_max_ports) {
+		/* Checked out, less the one refused */
+		rendering = ports_open - 1;
+		AST_LIST_TRAVERSE(&port_pool, cur, list) {
+			rendering--;
+		}
+		if (rendering < 1) {
+			rendering = 1;
+		}
+		if (!ports_learned || rendering < ports_learned) {
+			ports_learned = rendering;
+			ast_log(LOG_NOTICE, "The Swift engine refused a port with %d rendering; "
+				"holding to %d ports (set max_ports to the licensed number)\n", rendering, rendering);
+		}
+	}
+	ast_mutex_unlock(&port_lock);
+	swift_port_checkin(pp);
+}
+
+/*! \brief Close every idle port.  Checked out ports close on checkin. */
+static void swift_port_pool_flush(void)
+{
+	struct swift_pooled_port *pp;
+
+	for (;;) {
+		ast_mutex_lock(&port_lock);
+		pp = AST_LIST_REMOVE_HEAD(&port_pool, list);
+		ast_mutex_unlock(&port_lock);
+		if (!pp) {
+			break;
+		}
+		swift_pooled_port_close(pp);
+	}
+}
+
+static void swift_port_pool_prewarm_voice(const char *voice_name)
+{
+	struct swift_pooled_port *pp;
+	int i;
+
+	for (i = 0; i < cfg_port_pool_size; i++) {
+		ast_mutex_lock(&port_lock);
+		if (swift_port_limit_locked() && ports_open >= swift_port_limit_locked()) {
+			ast_mutex_unlock(&port_lock);
+			return;
+		}
+		ports_open++;
+		ast_mutex_unlock(&port_lock);
+
+		if (!(pp = swift_pooled_port_open(voice_name, swift_format_for_call(NULL)))) {
+			swift_port_slot_release();
+			return;
+		}
+		ast_mutex_lock(&port_lock);
+		AST_LIST_INSERT_TAIL(&port_pool, pp, list);
+		ast_mutex_unlock(&port_lock);
+	}
+}
+
+/*! \brief Fill the pool with port_pool_size ports for the default voice and
+ * each voice listed in the voices option, rendering the format set in
+ * swift.conf (ulaw when that is auto).
+ */
+static void swift_port_pool_prewarm(void)
+{
+	char *voices, *cur;
+
+	swift_port_pool_prewarm_voice(cfg_voice);
+
+	voices = ast_strdupa(cfg_voices);
+	while ((cur = strsep(&voices, ","))) {
+		cur = ast_strip(cur);
+		if (!ast_strlen_zero(cur) && strcasecmp(cur, cfg_voice)) {
+			swift_port_pool_prewarm_voice(cur);
+		}
+	}
+	ast_log(LOG_DEBUG, "Swift port pool holds %d ports\n", ports_open);
+}
+
+/*! \brief Take a chunk from the shared pool.  If the global budget is
+ * spent and ps is given, wait for a chunk to be given back.
+ * Returns NULL if ps was cancelled while waiting.
+ *
+ * A call whose consumer has caught up to the producer's chunk may always
+ * take one more, past the budget.  Otherwise the consumer could not move
+ * off (and free) that chunk, and every call could end up waiting.
+ */
+static struct swift_chunk *swift_chunk_get(struct stuff *ps)
+{
+	struct swift_chunk *chunk;
+	unsigned int max = cfg_max_buffer_memory / SWIFT_CHUNK_SIZE;
+	struct timeval start;
+
+	ast_mutex_lock(&chunk_lock);
+	while (ps && max && chunks_in_use >= max &&
+		ps->head - swift_atomic_load(&ps->tail) > SWIFT_CHUNK_SIZE) {
+		if (swift_atomic_load(&ps->immediate_exit)) {
+			ast_mutex_unlock(&chunk_lock);
+			return NULL;
+		}
+		chunk_waiters++;
+		start = ast_tvnow();
+		ast_cond_wait(&chunk_cond, &chunk_lock);
+		swift_stat_add(&stats.producer_sleeps, 1);
+		swift_stat_add(&stats.producer_slept_us, swift_tvdiff_us(ast_tvnow(), start));
+		chunk_waiters--;
+	}
+	chunks_in_use++;
+	if ((chunk = chunk_free_list)) {
+		chunk_free_list = chunk->next;
+		chunks_free--;
+	}
+	ast_mutex_unlock(&chunk_lock);
+
+	if (!chunk && !(chunk = ast_malloc(sizeof(*chunk)))) {
+		ast_mutex_lock(&chunk_lock);
+		chunks_in_use--;
+		ast_mutex_unlock(&chunk_lock);
+		return NULL;
+	}
+	chunk->next = NULL;
+	return chunk;
+}
+
+static void swift_chunk_put(struct swift_chunk *chunk)
+{
+	ast_mutex_lock(&chunk_lock);
+	chunks_in_use--;
+	if (chunks_free < SWIFT_CHUNK_FREE_MAX) {
+		chunk->next = chunk_free_list;
+		chunk_free_list = chunk;
+		chunks_free++;
+		chunk = NULL;
+	}
+	if (chunk_waiters) {
+		ast_cond_broadcast(&chunk_cond);
+	}
+	ast_mutex_unlock(&chunk_lock);
+
+	ast_free(chunk);
+}
+
+static void swift_chunk_pool_flush(void)
+{
+	struct swift_chunk *chunk;
+
+	ast_mutex_lock(&chunk_lock);
+	while ((chunk = chunk_free_list)) {
+		chunk_free_list = chunk->next;
+		chunks_free--;
+		ast_free(chunk);
+	}
+	ast_mutex_unlock(&chunk_lock);
+}
+
+static unsigned int swift_audio_hash(const char *params, const char *voice, const char *text)
+{
+	unsigned int hash = 2166136261U;
+	const char *c;
+
+	for (c = params; *c; c++) {
+		hash = (hash ^ (unsigned char) *c) * 16777619U;
+	}
+	hash = (hash ^ '/') * 16777619U;
+	for (c = voice; *c; c++) {
+		hash = (hash ^ (unsigned char) tolower(*c)) * 16777619U;
+	}
+	hash = (hash ^ '/') * 16777619U;
+	for (c = text; *c; c++) {
+		hash = (hash ^ (unsigned char) *c) * 16777619U;
+	}
+	return hash;
+}
+
+static struct swift_audio *swift_audio_new(const struct swift_format *fmt, const char *voice, const char *text)
+{
+	struct swift_audio *a;
+	size_t text_len = strlen(text);
+
+	if (!(a = ast_calloc(1, sizeof(*a) + text_len + 1))) {
+		return NULL;
+	}
+	a->refs = 1;
+	a->params = fmt->params;
+	ast_copy_string(a->voice, voice, sizeof(a->voice));
+	memcpy(a->text, text, text_len + 1);
+	a->hash = swift_audio_hash(a->params, a->voice, a->text);
+	return a;
+}
+
+static void swift_store_map_release(struct swift_store_map *map)
+{
+	if (map && ast_atomic_dec_and_test(&map->refs)) {
+		munmap(map->base, map->size);
+		ast_free(map);
+	}
+}
+
+static void swift_audio_ref(struct swift_audio *a)
+{
+	ast_atomic_fetchadd_int(&a->refs, 1);
+}
+
+static void swift_audio_release(struct swift_audio *a)
+{
+	struct swift_chunk *chunk;
+
+	if (!a || !ast_atomic_dec_and_test(&a->refs)) {
+		return;
+	}
+	while ((chunk = a->first)) {
+		a->first = chunk->next;
+		ast_free(chunk);
+	}
+	swift_store_map_release(a->map);
+	ast_free(a);
+}
+
+/*! \brief Memory held by a, counted against cache_size. */
+static unsigned int swift_audio_footprint(struct swift_audio *a)
+{
+	return sizeof(*a) + strlen(a->text) + (a->len + SWIFT_CHUNK_SIZE - 1) / SWIFT_CHUNK_SIZE * sizeof(struct swift_chunk);
+}
+
+/*! \brief Append len bytes.  Only one thread may append to a given audio.
+ * \retval -1 out of memory, or a would grow past max bytes
+ */
+static int swift_audio_append(struct swift_audio *a, const unsigned char *buf, unsigned int len, unsigned int max)
+{
+	struct swift_chunk *chunk;
+	unsigned int off = a->len % SWIFT_CHUNK_SIZE, n, total = a->len;
+
+	if (total + len > max) {
+		return -1;
+	}
+	while (len) {
+		if (!a->last || (!off && total)) {
+			if (!(chunk = ast_malloc(sizeof(*chunk)))) {
+				return -1;
+			}
+			chunk->next = NULL;
+			if (a->last) {
+				swift_atomic_store(&a->last->next, chunk);
+			} else {
+				swift_atomic_store(&a->first, chunk);
+			}
+			a->last = chunk;
+		}
+		n = SWIFT_CHUNK_SIZE - off;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(a->last->data + off, buf, n);
+		buf += n;
+		len -= n;
+		total += n;
+		off = (off + n) % SWIFT_CHUNK_SIZE;
+	}
+	swift_atomic_store(&a->len, total);
+	return 0;
+}
+
+/*! \brief Copy up to max bytes from the reader's position into dst, or
+ * just skip them if dst is NULL. */
+static unsigned int swift_audio_read(struct swift_audio *a, struct swift_audio_cursor *cur, unsigned char *dst, unsigned int max)
+{
+	unsigned int len = swift_atomic_load(&a->len) - cur->pos, copied = 0, n;
+
+	if (len > max) {
+		len = max;
+	}
+	if (a->data) {
+		if (dst) {
+			memcpy(dst, a->data + cur->pos, len);
+		}
+		cur->pos += len;
+		return len;
+	}
+	while (copied < len) {
+		if (!cur->chunk) {
+			cur->chunk = swift_atomic_load(&a->first);
+		} else if (cur->off == SWIFT_CHUNK_SIZE) {
+			cur->chunk = swift_atomic_load(&cur->chunk->next);
+			cur->off = 0;
+		}
+		n = SWIFT_CHUNK_SIZE - cur->off;
+		if (n > len - copied) {
+			n = len - copied;
+		}
+		if (dst) {
+			memcpy(dst + copied, cur->chunk->data + cur->off, n);
+		}
+		cur->off += n;
+		copied += n;
+	}
+	cur->pos += len;
+	return len;
+}
+
+static int swift_audio_key_match(struct swift_audio *a, struct swift_audio *b)
+{
+	return a->hash == b->hash && !strcmp(a->params, b->params) &&
+		!strcasecmp(a->voice, b->voice) && !strcmp(a->text, b->text);
+}
+
+static void swift_cache_unlink_locked(struct swift_audio *a)
+{
+	struct swift_audio **pa;
+
+	for (pa = &cache_buckets[a->hash % SWIFT_CACHE_BUCKETS]; *pa; pa = &(*pa)->hnext) {
+		if (*pa == a) {
+			*pa = a->hnext;
+			break;
+		}
+	}
+	if (a->prev) {
+		a->prev->next = a->next;
+	} else {
+		cache_lru_head = a->next;
+	}
+	if (a->next) {
+		a->next->prev = a->prev;
+	} else {
+		cache_lru_tail = a->prev;
+	}
+	a->hnext = a->prev = a->next = NULL;
+	cache_bytes -= swift_audio_footprint(a);
+	cache_entries--;
+}
+
+/*! \brief Drop least recently played prompts until the cache fits its
+ * budget.  Channels still playing an evicted prompt keep their reference.
+ * Must hold cache_lock; the dropped entries are returned for release.
+ */
+static struct swift_audio *swift_cache_trim_locked(unsigned int budget)
+{
+	struct swift_audio *a, *dropped = NULL;
+
+	while ((a = cache_lru_tail) && cache_bytes > budget) {
+		swift_cache_unlink_locked(a);
+		cache_evictions++;
+		a->hnext = dropped;
+		dropped = a;
+	}
+	return dropped;
+}
+
+static void swift_cache_release_list(struct swift_audio *a)
+{
+	struct swift_audio *next;
+
+	for (; a; a = next) {
+		next = a->hnext;
+		swift_audio_release(a);
+	}
+}
+
+/*! \brief Look up a finished rendering of text in voice and format.
+ * Returns a new reference, or NULL on a miss.
+ */
+static struct swift_audio *swift_cache_lookup(const struct swift_format *fmt, const char *voice, const char *text)
+{
+	struct swift_audio *a;
+	unsigned int hash;
+
+	if (!cfg_cache_size) {
+		return NULL;
+	}
+	hash = swift_audio_hash(fmt->params, voice, text);
+
+	ast_mutex_lock(&cache_lock);
+	for (a = cache_buckets[hash % SWIFT_CACHE_BUCKETS]; a; a = a->hnext) {
+		if (a->hash == hash && !strcmp(a->params, fmt->params) &&
+			!strcasecmp(a->voice, voice) && !strcmp(a->text, text)) {
+			break;
+		}
+	}
+	if (a) {
+		cache_hits++;
+		if (a != cache_lru_head) {
+			/* Move to the front of the LRU list */
+			a->prev->next = a->next;
+			if (a->next) {
+				a->next->prev = a->prev;
+			} else {
+				cache_lru_tail = a->prev;
+			}
+			a->prev = NULL;
+			a->next = cache_lru_head;
+			cache_lru_head->prev = a;
+			cache_lru_head = a;
+		}
+		swift_audio_ref(a);
+	} else {
+		cache_misses++;
+	}
+	ast_mutex_unlock(&cache_lock);
+
+	return a;
+}
+
+/*! \brief Add a finished rendering to the cache, unless it is too big or
+ * another call got there first.
+ */
+static void swift_cache_insert(struct swift_audio *a)
+{
+	struct swift_audio *cur, *dropped;
+	unsigned int size = swift_audio_footprint(a);
+
+	if (!a->len || a->len > cfg_cache_max_prompt || size > cfg_cache_size) {
+		return;
+	}
+
+	ast_mutex_lock(&cache_lock);
+	for (cur = cache_buckets[a->hash % SWIFT_CACHE_BUCKETS]; cur; cur = cur->hnext) {
+		if (swift_audio_key_match(cur, a)) {
+			ast_mutex_unlock(&cache_lock);
+			return;
+		}
+	}
+	dropped = swift_cache_trim_locked(cfg_cache_size - size);
+
+	swift_audio_ref(a);
+	a->hnext = cache_buckets[a->hash % SWIFT_CACHE_BUCKETS];
+	cache_buckets[a->hash % SWIFT_CACHE_BUCKETS] = a;
+	a->prev = NULL;
+	a->next = cache_lru_head;
+	if (cache_lru_head) {
+		cache_lru_head->prev = a;
+	} else {
+		cache_lru_tail = a;
+	}
+	cache_lru_head = a;
+	cache_bytes += size;
+	cache_entries++;
+	ast_mutex_unlock(&cache_lock);
+
+	ast_log(LOG_DEBUG, "Cached %u bytes of audio for '%s'\n", a->len, a->text);
+	swift_cache_release_list(dropped);
+}
+
+/*! \brief Register fill as the synthesis of its text, unless an identical
+ * one is already under way.  In that case return a new reference to the
+ * audio it is producing, to be played instead.
+ */
+static struct swift_audio *swift_inflight_join(struct swift_audio *fill)
+{
+	struct swift_audio *a;
+	unsigned int bucket = fill->hash % SWIFT_CACHE_BUCKETS;
+
+	ast_mutex_lock(&cache_lock);
+	for (a = inflight_buckets[bucket]; a; a = a->inext) {
+		if (swift_audio_key_match(a, fill)) {
+			swift_audio_ref(a);
+			inflight_joins++;
+			ast_mutex_unlock(&cache_lock);
+			return a;
+		}
+	}
+	fill->inext = inflight_buckets[bucket];
+	inflight_buckets[bucket] = fill;
+	inflight_count++;
+	ast_mutex_unlock(&cache_lock);
+
+	return NULL;
+}
+
+/*! \brief Mark synthesis into a over, successfully or not, and stop
+ * offering it to new requests.  Calls playing an abandoned synthesis pick
+ * up where it left off with their own port.
+ */
+static void swift_audio_finish(struct swift_audio *a, int ok)
+{
+	struct swift_audio **pa;
+
+	ast_mutex_lock(&cache_lock);
+	for (pa = &inflight_buckets[a->hash % SWIFT_CACHE_BUCKETS]; *pa; pa = &(*pa)->inext) {
+		if (*pa == a) {
+			*pa = a->inext;
+			a->inext = NULL;
+			inflight_count--;
+			break;
+		}
+	}
+	if (!a->done) {
+		swift_atomic_store(&a->done, ok ? 1 : -1);
+	}
+	ast_mutex_unlock(&cache_lock);
+}
+
+/*! \brief Shrink the cache to cache_size, or empty it if flush is set. */
+static void swift_cache_trim(int flush)
+{
+	struct swift_audio *dropped;
+
+	ast_mutex_lock(&cache_lock);
+	dropped = swift_cache_trim_locked(flush ? 0 : cfg_cache_size);
+	ast_mutex_unlock(&cache_lock);
+
+	swift_cache_release_list(dropped);
+}
+
+static uint32_t swift_store_sum(uint32_t sum, const void *buf, size_t len)
+{
+	const unsigned char *c = buf;
+
+	while (len--) {
+		sum = (sum ^ *c++) * 16777619U;
+	}
+	return sum;
+}
+
+static size_t swift_store_rec_size(const struct swift_store_rec *rec)
+{
+	return (sizeof(*rec) + rec->key_len + rec->audio_len + 7) & ~(size_t) 7;
+}
+
+/*! \brief Build the record key: params, lower cased voice and text, each
+ * but the last followed by a NUL.  Returns an ast_malloc'd buffer.
+ */
+static unsigned char *swift_store_key(const char *params, const char *voice, const char *text, uint32_t *key_len)
+{
+	size_t plen = strlen(params) + 1, vlen = strlen(voice) + 1, tlen = strlen(text);
+	unsigned char *key;
+	size_t i;
+
+	if (!(key = ast_malloc(plen + vlen + tlen))) {
+		return NULL;
+	}
+	memcpy(key, params, plen);
+	for (i = 0; i < vlen; i++) {
+		key[plen + i] = tolower(voice[i]);
+	}
+	memcpy(key + plen + vlen, text, tlen);
+	*key_len = plen + vlen + tlen;
+	return key;
+}
+
+static void swift_store_index_clear_locked(void)
+{
+	struct swift_store_entry *e;
+	int i;
+
+	for (i = 0; i < SWIFT_STORE_BUCKETS; i++) {
+		while ((e = store_buckets[i])) {
+			store_buckets[i] = e->next;
+			ast_free(e);
+		}
+	}
+	store_entries = 0;
+	store_scanned = 0;
+}
+
+/*! \brief Find the index entry for a key in the current mapping. */
+static struct swift_store_entry *swift_store_find_locked(uint32_t hash, const unsigned char *key, uint32_t key_len)
+{
+	struct swift_store_entry *e;
+	const struct swift_store_rec *rec;
+
+	for (e = store_buckets[hash % SWIFT_STORE_BUCKETS]; e; e = e->next) {
+		rec = (const struct swift_store_rec *) (store_map->base + e->off);
+		if (e->hash == hash && rec->key_len == key_len && !memcmp(rec + 1, key, key_len)) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/*! \brief Catch up with the data file: reopen it if it was replaced by a
+ * compaction, remap it if it grew, and index any new records.  Must hold
+ * store_lock.
+ */
+static int swift_store_refresh_locked(void)
+{
+	struct swift_store_map *map;
+	struct swift_store_entry *e;
+	const struct swift_store_rec *rec;
+	struct stat st;
+	size_t off, size;
+	int fd;
+
+	if (stat(store_path, &st)) {
+		return -1;
+	}
+	if (st.st_ino != store_ino) {
+		if ((fd = open(store_path, O_RDWR | O_APPEND)) < 0) {
+			return -1;
+		}
+		close(store_fd);
+		store_fd = fd;
+		store_ino = st.st_ino;
+		swift_store_index_clear_locked();
+		swift_store_map_release(store_map);
+		store_map = NULL;
+	}
+	if (fstat(store_fd, &st)) {
+		return -1;
+	}
+	size = st.st_size;
+	if (size <= sizeof(SWIFT_STORE_MAGIC) - 1 || (store_map && size == store_map->size)) {
+		return 0;
+	}
+
+	if (!(map = ast_calloc(1, sizeof(*map)))) {
+		return -1;
+	}
+	if ((map->base = mmap(NULL, size, PROT_READ, MAP_SHARED, store_fd, 0)) == MAP_FAILED) {
+		ast_log(LOG_WARNING, "Unable to map prompt store %s: %s\n", store_path, strerror(errno));
+		ast_free(map);
+		return -1;
+	}
+	map->size = size;
+	map->refs = 1;
+	swift_store_map_release(store_map);
+	store_map = map;
+
+	if (!store_scanned) {
+		if (memcmp(map->base, SWIFT_STORE_MAGIC, sizeof(SWIFT_STORE_MAGIC) - 1)) {
+			ast_log(LOG_WARNING, "%s is not a Swift prompt store\n", store_path);
+			return -1;
+		}
+		store_scanned = sizeof(SWIFT_STORE_MAGIC) - 1;
+	}
+
+	/* Index records until the end of the file, or a record that is torn
+	 * or still being written. */
+	for (off = store_scanned; off + sizeof(*rec) <= size; off += swift_store_rec_size(rec)) {
+		rec = (const struct swift_store_rec *) (map->base + off);
+		if (rec->magic != SWIFT_STORE_REC_MAGIC || off + swift_store_rec_size(rec) > size ||
+			rec->sum != swift_store_sum(swift_store_sum(2166136261U, &rec->hash, 3 * sizeof(uint32_t)), rec + 1, rec->key_len + rec->audio_len)) {
+			break;
+		}
+		if ((e = swift_store_find_locked(rec->hash, (const unsigned char *) (rec + 1), rec->key_len))) {
+			/* Two processes stored the same prompt; use the newer */
+			e->off = off;
+			continue;
+		}
+		if (!(e = ast_calloc(1, sizeof(*e)))) {
+			break;
+		}
+		e->hash = rec->hash;
+		e->off = off;
+		e->next = store_buckets[e->hash % SWIFT_STORE_BUCKETS];
+		store_buckets[e->hash % SWIFT_STORE_BUCKETS] = e;
+		store_entries++;
+	}
+	store_scanned = off;
+	return 0;
+}
+
+static void swift_store_close(void)
+{
+	ast_mutex_lock(&store_lock);
+	if (store_fd >= 0) {
+		close(store_fd);
+		close(store_lock_fd);
+	}
+	store_fd = store_lock_fd = -1;
+	store_path[0] = '\0';
+	store_ino = 0;
+	swift_store_index_clear_locked();
+	swift_store_map_release(store_map);
+	store_map = NULL;
+	ast_mutex_unlock(&store_lock);
+}
+
+/*! \brief Open (creating if need be) the prompt store named in swift.conf. */
+static void swift_store_open(void)
+{
+	char lock_path[PATH_MAX + 8];
+
+	if (ast_strlen_zero(cfg_prompt_store) || !cfg_prompt_store_size) {
+		return;
+	}
+
+	ast_mutex_lock(&store_lock);
+	ast_copy_string(store_path, cfg_prompt_store, sizeof(store_path));
+	store_size = cfg_prompt_store_size;
+	snprintf(lock_path, sizeof(lock_path), "%s.lock", store_path);
+	if ((store_lock_fd = open(lock_path, O_RDWR | O_CREAT, 0644)) < 0 ||
+		(store_fd = open(store_path, O_RDWR | O_APPEND | O_CREAT, 0644)) < 0) {
+		ast_log(LOG_WARNING, "Unable to open prompt store %s: %s\n", store_path, strerror(errno));
+		if (store_lock_fd >= 0) {
+			close(store_lock_fd);
+		}
+		store_fd = store_lock_fd = -1;
+		store_path[0] = '\0';
+		ast_mutex_unlock(&store_lock);
+		return;
+	}
+
+	flock(store_lock_fd, LOCK_EX);
+	if (lseek(store_fd, 0, SEEK_END) == 0 &&
+		write(store_fd, SWIFT_STORE_MAGIC, sizeof(SWIFT_STORE_MAGIC) - 1) != sizeof(SWIFT_STORE_MAGIC) - 1) {
+		ast_log(LOG_WARNING, "Unable to initialize prompt store %s: %s\n", store_path, strerror(errno));
+	}
+	flock(store_lock_fd, LOCK_UN);
+
+	/* Force the first refresh to (re)open and index the file by name */
+	store_ino = 0;
+	if (!swift_store_refresh_locked()) {
+		ast_log(LOG_NOTICE, "Prompt store %s holds %d prompts\n", store_path, store_entries);
+	}
+	ast_mutex_unlock(&store_lock);
+}
+
+/*! \brief Look up a stored rendering of text in voice and format.  The
+ * audio is read in place from the mapping.  Returns a new reference, or NULL.
+ */
+static struct swift_audio *swift_store_lookup(const struct swift_format *fmt, const char *voice, const char *text)
+{
+	struct swift_store_entry *e;
+	const struct swift_store_rec *rec;
+	struct swift_audio *a = NULL;
+	unsigned char *key;
+	uint32_t key_len;
+	unsigned int hash = swift_audio_hash(fmt->params, voice, text);
+
+	if (swift_atomic_load(&store_fd) < 0 || !(key = swift_store_key(fmt->params, voice, text, &key_len))) {
+		return NULL;
+	}
+
+	ast_mutex_lock(&store_lock);
+	if (store_fd >= 0) {
+		flock(store_lock_fd, LOCK_SH);
+		swift_store_refresh_locked();
+		flock(store_lock_fd, LOCK_UN);
+	}
+	if (store_fd >= 0 && store_map && (e = swift_store_find_locked(hash, key, key_len)) && (a = swift_audio_new(fmt, voice, text))) {
+		rec = (const struct swift_store_rec *) (store_map->base + e->off);
+		a->data = (const unsigned char *) (rec + 1) + rec->key_len;
+		a->len = rec->audio_len;
+		a->done = 1;
+		a->map = store_map;
+		ast_atomic_fetchadd_int(&store_map->refs, 1);
+		store_hits++;
+	}
+	ast_mutex_unlock(&store_lock);
+
+	ast_free(key);
+	return a;
+}
+
+static int swift_store_entry_cmp(const void *a, const void *b)
+{
+	size_t x = (*(struct swift_store_entry **) a)->off, y = (*(struct swift_store_entry **) b)->off;
+
+	return x < y ? -1 : x > y;
+}
+
+/*! \brief Rewrite the store with only the newest distinct prompts that fit
+ * in keep bytes, and swap it in by rename.  Must hold store_lock and the
+ * exclusive file lock.
+ */
+static void swift_store_compact_locked(size_t keep)
+{
+	struct swift_store_entry **entries, *e;
+	const struct swift_store_rec *rec;
+	char tmp_path[PATH_MAX + 8];
+	size_t kept = sizeof(SWIFT_STORE_MAGIC) - 1, size;
+	int i, n = 0, first, fd, res = 0;
+
+	if (!store_map || !(entries = ast_calloc(store_entries + 1, sizeof(*entries)))) {
+		return;
+	}
+	for (i = 0; i < SWIFT_STORE_BUCKETS; i++) {
+		for (e = store_buckets[i]; e; e = e->next) {
+			entries[n++] = e;
+		}
+	}
+	qsort(entries, n, sizeof(*entries), swift_store_entry_cmp);
+
+	/* Keep the most recently written records, in their original order */
+	for (first = n; first > 0; first--) {
+		rec = (const struct swift_store_rec *) (store_map->base + entries[first - 1]->off);
+		if (kept + swift_store_rec_size(rec) > keep) {
+			break;
+		}
+		kept += swift_store_rec_size(rec);
+	}
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", store_path);
+	if ((fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		ast_log(LOG_WARNING, "Unable to compact prompt store: %s\n", strerror(errno));
+		ast_free(entries);
+		return;
+	}
+	res = write(fd, SWIFT_STORE_MAGIC, sizeof(SWIFT_STORE_MAGIC) - 1) != sizeof(SWIFT_STORE_MAGIC) - 1;
+	for (i = first; i < n && !res; i++) {
+		rec = (const struct swift_store_rec *) (store_map->base + entries[i]->off);
+		size = swift_store_rec_size(rec);
+		res = write(fd, rec, size) != size;
+	}
+	/* The new file must be complete on disk before it replaces the old */
+	if (res || fsync(fd) || rename(tmp_path, store_path)) {
+		ast_log(LOG_WARNING, "Unable to compact prompt store: %s\n", strerror(errno));
+		unlink(tmp_path);
+	} else {
+		ast_log(LOG_DEBUG, "Compacted prompt store to %d of %d prompts\n", n - first, n);
+		store_compactions++;
+	}
+	close(fd);
+	ast_free(entries);
+
+	swift_store_refresh_locked();
+}
+
+/*! \brief Append a finished rendering to the prompt store, compacting it
+ * first if it would grow past prompt_store_size.
+ * \retval 0 if the store has it, now or already
+ * \retval -1 if it was not stored
+ */
+static int swift_store_add(struct swift_audio *a)
+{
+	struct swift_store_rec *rec;
+	struct swift_audio_cursor cur = { NULL, };
+	unsigned char *key;
+	uint32_t key_len;
+	size_t size;
+	off_t end;
+	int res = -1;
+
+	if (a->data) {
+		/* Played from the store */
+		return 0;
+	}
+	if (swift_atomic_load(&store_fd) < 0 || !a->len || !(key = swift_store_key(a->params, a->voice, a->text, &key_len))) {
+		return -1;
+	}
+
+	size = (sizeof(*rec) + key_len + a->len + 7) & ~(size_t) 7;
+	if (!(rec = ast_calloc(1, size))) {
+		ast_free(key);
+		return -1;
+	}
+	rec->magic = SWIFT_STORE_REC_MAGIC;
+	rec->hash = a->hash;
+	rec->key_len = key_len;
+	rec->audio_len = a->len;
+	memcpy(rec + 1, key, key_len);
+	swift_audio_read(a, &cur, (unsigned char *) (rec + 1) + key_len, a->len);
+	rec->sum = swift_store_sum(swift_store_sum(2166136261U, &rec->hash, 3 * sizeof(uint32_t)), rec + 1, key_len + a->len);
+
+	ast_mutex_lock(&store_lock);
+	if (store_fd < 0 || size > store_size / 2) {
+		ast_mutex_unlock(&store_lock);
+		ast_free(rec);
+		ast_free(key);
+		return -1;
+	}
+	flock(store_lock_fd, LOCK_EX);
+	if (swift_store_refresh_locked()) {
+		goto done;
+	}
+	if (store_map && swift_store_find_locked(rec->hash, key, key_len)) {
+		/* Another call or process stored it first */
+		res = 0;
+		goto done;
+	}
+	end = lseek(store_fd, 0, SEEK_END);
+	if (store_map && end > store_scanned) {
+		/* A writer died part way through a record; cut it off */
+		ast_log(LOG_WARNING, "Discarding %ld bytes of torn records from the prompt store\n", (long) (end - store_scanned));
+		if (ftruncate(store_fd, store_scanned)) {
+			goto done;
+		}
+		end = store_scanned;
+	}
+	if (end + size > store_size) {
+		swift_store_compact_locked(store_size / 2);
+		end = lseek(store_fd, 0, SEEK_END);
+	}
+	if (write(store_fd, rec, size) != size) {
+		ast_log(LOG_WARNING, "Unable to write to prompt store: %s\n", strerror(errno));
+		if (ftruncate(store_fd, end)) {
+			ast_log(LOG_WARNING, "Unable to truncate prompt store: %s\n", strerror(errno));
+		}
+		goto done;
+	}
+	store_writes++;
+	swift_store_refresh_locked();
+	res = 0;
+done:
+	flock(store_lock_fd, LOCK_UN);
+	ast_mutex_unlock(&store_lock);
+	ast_free(rec);
+	ast_free(key);
+	return res;
+}
+
+/*! \brief Sum of the squared samples.  Samples are halved first so a
+ * pair of them always fits the 32 bit lanes; the sum is scaled back.
+ */
+static uint64_t swift_pcm_energy_scalar(const int16_t *pcm, unsigned int n)
+{
+	uint64_t sum = 0;
+	unsigned int i;
+	int v;
+
+	for (i = 0; i < n; i++) {
+		v = pcm[i] >> 1;
+		sum += v * v;
+	}
+	return sum << 2;
+}
+
+/*! \brief Scale samples by gain (Q12), saturating. */
+static void swift_pcm_gain_scalar(int16_t *pcm, unsigned int n, int gain)
+{
+	unsigned int i;
+	int v;
+
+	for (i = 0; i < n; i++) {
+		v = (pcm[i] * gain) >> 12;
+		pcm[i] = v > 32767 ? 32767 : v < -32768 ? -32768 : v;
+	}
+}
+
+#if defined __SSE2__
+static uint64_t swift_pcm_energy_sse2(const int16_t *pcm, unsigned int n)
+{
+	__m128i acc = _mm_setzero_si128(), zero = _mm_setzero_si128(), v;
+	uint64_t lanes[2];
+	unsigned int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		v = _mm_srai_epi16(_mm_loadu_si128((const __m128i *) (pcm + i)), 1);
+		v = _mm_madd_epi16(v, v);
+		acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+		acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+	}
+	_mm_storeu_si128((__m128i *) lanes, acc);
+	return ((lanes[0] + lanes[1]) << 2) + swift_pcm_energy_scalar(pcm + i, n - i);
+}
+
+static void swift_pcm_gain_sse2(int16_t *pcm, unsigned int n, int gain)
+{
+	__m128i g = _mm_set1_epi16(gain), v, lo, hi;
+	unsigned int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		v = _mm_loadu_si128((const __m128i *) (pcm + i));
+		lo = _mm_mullo_epi16(v, g);
+		hi = _mm_mulhi_epi16(v, g);
+		v = _mm_packs_epi32(_mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), 12),
+			_mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), 12));
+		_mm_storeu_si128((__m128i *) (pcm + i), v);
+	}
+	swift_pcm_gain_scalar(pcm + i, n - i, gain);
+}
+#endif
+
+#if defined SWIFT_HAVE_AVX2
+__attribute__((target("avx2")))
+static uint64_t swift_pcm_energy_avx2(const int16_t *pcm, unsigned int n)
+{
+	__m256i acc = _mm256_setzero_si256(), zero = _mm256_setzero_si256(), v;
+	uint64_t lanes[4];
+	unsigned int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		v = _mm256_srai_epi16(_mm256_loadu_si256((const __m256i *) (pcm + i)), 1);
+		v = _mm256_madd_epi16(v, v);
+		acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(v, zero));
+		acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(v, zero));
+	}
+	_mm256_storeu_si256((__m256i *) lanes, acc);
+	return ((lanes[0] + lanes[1] + lanes[2] + lanes[3]) << 2) + swift_pcm_energy_scalar(pcm + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void swift_pcm_gain_avx2(int16_t *pcm, unsigned int n, int gain)
+{
+	__m256i g = _mm256_set1_epi16(gain), v, lo, hi;
+	unsigned int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		v = _mm256_loadu_si256((const __m256i *) (pcm + i));
+		lo = _mm256_mullo_epi16(v, g);
+		hi = _mm256_mulhi_epi16(v, g);
+		/* Unpack and pack both work within 128 bit lanes, so the samples
+		 * come back in order */
+		v = _mm256_packs_epi32(_mm256_srai_epi32(_mm256_unpacklo_epi16(lo, hi), 12),
+			_mm256_srai_epi32(_mm256_unpackhi_epi16(lo, hi), 12));
+		_mm256_storeu_si256((__m256i *) (pcm + i), v);
+	}
+	swift_pcm_gain_scalar(pcm + i, n - i, gain);
+}
+#endif
+
+static uint64_t (*swift_pcm_energy)(const int16_t *pcm, unsigned int n) = swift_pcm_energy_scalar;
+static void (*swift_pcm_gain)(int16_t *pcm, unsigned int n, int gain) = swift_pcm_gain_scalar;
+
+/*! \brief Use the widest vector kernels this CPU runs. */
+static void swift_pcm_init(void)
+{
+#if defined __SSE2__
+	swift_pcm_energy = swift_pcm_energy_sse2;
+	swift_pcm_gain = swift_pcm_gain_sse2;
+#endif
+#if defined SWIFT_HAVE_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		swift_pcm_energy = swift_pcm_energy_avx2;
+		swift_pcm_gain = swift_pcm_gain_avx2;
+	}
+#endif
+}
+
+/*! \brief Find a voice's stats, making room for them if need be.  NULL
+ * once the table is full.  Must hold voice_lock.
+ */
+static struct swift_voice_stats *swift_voice_stats_locked(const char *voice)
+{
+	int i;
+
+	for (i = 0; i < SWIFT_VOICE_STATS && voice_stats[i].voice[0]; i++) {
+		if (!strcasecmp(voice_stats[i].voice, voice)) {
+			return &voice_stats[i];
+		}
+	}
+	if (i == SWIFT_VOICE_STATS) {
+		return NULL;
+	}
+	ast_copy_string(voice_stats[i].voice, voice, sizeof(voice_stats[i].voice));
+	return &voice_stats[i];
+}
+
+/*! \brief Gain (Q12) that brings voice to the normalize level, judged by
+ * what it has rendered so far. */
+static int swift_voice_gain(const char *voice)
+{
+	struct swift_voice_stats *vs;
+	double level = 0, gain;
+
+	if (!cfg_normalize) {
+		return SWIFT_GAIN_UNITY;
+	}
+	ast_mutex_lock(&voice_lock);
+	if ((vs = swift_voice_stats_locked(voice)) && vs->level_samples) {
+		level = sqrt((double) vs->level_sum / vs->level_samples);
+	}
+	ast_mutex_unlock(&voice_lock);
+	if (level < 1) {
+		return SWIFT_GAIN_UNITY;
+	}
+
+	gain = 32768.0 * pow(10, cfg_normalize / 20.0) / level;
+	if (gain < 0.25) {
+		gain = 0.25;
+	} else if (gain > 4) {
+		gain = 4;
+	}
+	return gain * SWIFT_GAIN_UNITY;
+}
+
+/*! \brief Add the level of a finished rendering to its voice's. */
+static void swift_voice_level_add(const char *voice, uint64_t sum, uint64_t samples)
+{
+	struct swift_voice_stats *vs;
+
+	if (!samples) {
+		return;
+	}
+	ast_mutex_lock(&voice_lock);
+	if ((vs = swift_voice_stats_locked(voice))) {
+		/* Let old renderings fade out before the sum can overflow */
+		if (vs->level_samples > (1 << 24)) {
+			vs->level_sum /= 2;
+			vs->level_samples /= 2;
+		}
+		vs->level_sum += sum;
+		vs->level_samples += samples;
+	}
+	ast_mutex_unlock(&voice_lock);
+}
+
+/*! \brief Start learning how fast voice renders from a rendering of text. */
+static void swift_render_start(struct stuff *ps, const char *voice, const char *text)
+{
+	ast_copy_string(ps->render_voice, voice, sizeof(ps->render_voice));
+	ps->render_chars = strlen(text);
+	ps->render_bytes = 0;
+	ps->render_first_bytes = 0;
+	ps->render_gap_us = 0;
+}
+
+/*! \brief Note len bytes of audio coming from the engine. */
+static void swift_render_audio(struct stuff *ps, unsigned int len)
+{
+	struct timeval now = ast_tvnow();
+	int64_t gap;
+
+	if (!ps->render_bytes) {
+		ps->render_first = now;
+		ps->render_first_bytes = len;
+	} else if ((gap = swift_tvdiff_us(now, ps->render_last)) > ps->render_gap_us) {
+		ps->render_gap_us = gap;
+	}
+	ps->render_last = now;
+	ps->render_bytes += len;
+}
+
+/*! \brief Fold a finished rendering into its voice's speed.  The speed is
+ * judged on the audio after the first piece, which only tells us when
+ * the rendering got going. */
+static void swift_render_end(struct stuff *ps)
+{
+	struct swift_voice_stats *vs;
+	unsigned int per_ms = ps->format->samplerate / 1000 * ps->format->bytes, n;
+	double audio_ms, took_ms;
+
+	audio_ms = (double) (ps->render_bytes - ps->render_first_bytes) / per_ms;
+	took_ms = swift_tvdiff_us(ps->render_last, ps->render_first) / 1000.0;
+	if (audio_ms < SWIFT_PREBUFFER_MS || !ps->render_chars) {
+		/* Too little to go on */
+		return;
+	}
+	if (took_ms < 1) {
+		took_ms = 1;
+	}
+
+	ast_mutex_lock(&voice_lock);
+	if ((vs = swift_voice_stats_locked(ps->render_voice))) {
+		n = vs->renders < SWIFT_VOICE_AVG ? vs->renders + 1 : SWIFT_VOICE_AVG;
+		vs->speed += (audio_ms / took_ms - vs->speed) / n;
+		vs->ms_per_char += ((double) ps->render_bytes / per_ms / ps->render_chars - vs->ms_per_char) / n;
+		vs->gap_ms += (ps->render_gap_us / 1000.0 - vs->gap_ms) / n;
+		vs->renders++;
+	}
+	ast_mutex_unlock(&voice_lock);
+}
+
+/*! \brief Set up silence trimming and level for a rendering of voice
+ * about to start, if either is configured. */
+static void swift_trim_start(struct stuff *ps, const char *voice)
+{
+	struct swift_trim *t = ps->trim;
+	double amp;
+
+	if (!cfg_trim_silence && !cfg_normalize) {
+		return;
+	}
+	if (!t && !(t = ps->trim = ast_calloc(1, sizeof(*t)))) {
+		return;
+	}
+	t->format = ps->format;
+	ast_copy_string(t->voice, voice, sizeof(t->voice));
+	t->block = ps->format->samplerate * SWIFT_TRIM_BLOCK_MS / 1000 * ps->format->bytes;
+	amp = 32768.0 * pow(10, cfg_silence_threshold / 20.0);
+	t->thresh = cfg_trim_silence ? amp * amp : 0;
+	t->keep = ps->format->samplerate / 1000 * ps->format->bytes * cfg_trim_tail;
+	t->hold_size = ps->format->samplerate / 1000 * ps->format->bytes * SWIFT_TRIM_HOLD_MS;
+	t->gain = swift_voice_gain(voice);
+	t->started = !cfg_trim_silence;
+	t->quiet = 0;
+	t->carry_len = 0;
+	t->hold_len = 0;
+	t->level_sum = 0;
+	t->level_samples = 0;
+	t->dropped = 0;
+}
+
+/*! \brief Trim and level one block of len bytes into out.  Returns the
+ * bytes written there, which may include held back silence.
+ */
+static unsigned int swift_trim_block(struct swift_trim *t, const unsigned char *in, unsigned int len, unsigned char *out)
+{
+	int16_t pcm[SWIFT_TRIM_BLOCK_MAX / 2];
+	unsigned int n = len / t->format->bytes, i, written = 0;
+	unsigned char *dst;
+	uint64_t energy;
+	int silent;
+
+	if (t->format->bytes == 2) {
+		memcpy(pcm, in, n * 2);
+	} else if (!strcmp(t->format->encoding, "alaw")) {
+		for (i = 0; i < n; i++) {
+			pcm[i] = AST_ALAW(in[i]);
+		}
+	} else {
+		for (i = 0; i < n; i++) {
+			pcm[i] = AST_MULAW(in[i]);
+		}
+	}
+
+	energy = swift_pcm_energy(pcm, n);
+	silent = energy < (uint64_t) t->thresh * n;
+	if (!silent) {
+		t->level_sum += energy;
+		t->level_samples += n;
+	}
+	if (!t->started) {
+		if (silent) {
+			t->dropped += len;
+			return 0;
+		}
+		t->started = 1;
+	}
+
+	if (!silent) {
+		memcpy(out, t->hold, t->hold_len);
+		written = t->hold_len;
+		t->hold_len = 0;
+		t->quiet = 0;
+		dst = out + written;
+	} else if (t->quiet < t->keep) {
+		t->quiet += len;
+		dst = out;
+	} else {
+		if (t->hold_len + len > t->hold_size) {
+			/* Too long to be the end; a pause the text asked for */
+			memcpy(out, t->hold, t->hold_len);
+			written = t->hold_len;
+			t->hold_len = 0;
+		}
+		dst = t->hold + t->hold_len;
+		t->hold_len += len;
+	}
+
+	if (t->gain == SWIFT_GAIN_UNITY) {
+		memcpy(dst, in, n * t->format->bytes);
+	} else {
+		swift_pcm_gain(pcm, n, t->gain);
+		if (t->format->bytes == 2) {
+			memcpy(dst, pcm, n * 2);
+		} else if (!strcmp(t->format->encoding, "alaw")) {
+			for (i = 0; i < n; i++) {
+				dst[i] = AST_LIN2A(pcm[i]);
+			}
+		} else {
+			for (i = 0; i < n; i++) {
+				dst[i] = AST_LIN2MU(pcm[i]);
+			}
+		}
+	}
+	return dst == out + written ? written + n * t->format->bytes : written;
+}
+
+/*! \brief Run rendered audio through trimming, or with buf NULL flush
+ * what is left at the end of the rendering.  *out is set to the audio to
+ * pass on.  Returns its length, or -1 if out of memory.
+ */
+static int swift_trim_process(struct swift_trim *t, const unsigned char *buf, unsigned int len, unsigned char **out)
+{
+	unsigned int need = t->carry_len + len + t->hold_size, n, written = 0;
+	unsigned char *tmp;
+
+	if (need > t->out_size) {
+		if (!(tmp = ast_realloc(t->out, need))) {
+			return -1;
+		}
+		t->out = tmp;
+		t->out_size = need;
+	}
+	if (!t->hold && !(t->hold = ast_malloc(t->hold_size))) {
+		return -1;
+	}
+	*out = t->out;
+
+	if (!buf) {
+		/* A short last block, then whatever silence was still held */
+		n = t->carry_len - t->carry_len % t->format->bytes;
+		if (n) {
+			written = swift_trim_block(t, t->carry, n, t->out);
+		}
+		t->dropped += t->hold_len;
+		t->hold_len = 0;
+		t->carry_len = 0;
+		return written;
+	}
+
+	while (len) {
+		if (!t->carry_len && len >= t->block) {
+			written += swift_trim_block(t, buf, t->block, t->out + written);
+			buf += t->block;
+			len -= t->block;
+			continue;
+		}
+		n = t->block - t->carry_len;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(t->carry + t->carry_len, buf, n);
+		t->carry_len += n;
+		buf += n;
+		len -= n;
+		if (t->carry_len == t->block) {
+			written += swift_trim_block(t, t->carry, t->block, t->out + written);
+			t->carry_len = 0;
+		}
+	}
+	return written;
+}
+
+/*! \brief Give back every chunk the queue holds and start it over empty.
+ * The producer must be finished with it.
+ */
+static int swift_queue_reset(struct stuff *ps)
+{
+	struct swift_chunk *chunk;
+
+	while ((chunk = ps->rchunk)) {
+		ps->rchunk = chunk->next;
+		swift_chunk_put(chunk);
+	}
+	ps->head = 0;
+	ps->tail = 0;
+	ps->roff = 0;
+	ps->woff = 0;
+
+	/* The first chunk is not held to the global budget, so every call can
+	 * make progress. */
+	if (!(ps->rchunk = ps->wchunk = swift_chunk_get(NULL))) {
+		return -1;
+	}
+	return 0;
+}
+
+static int swift_init_stuff(struct stuff *ps)
+{
+	memset(ps, 0, sizeof(*ps));
+	ps->format = &swift_formats[0];
+
+	/* Whole chunks, and at least two so the producer can always run ahead */
+	ps->qsize = (cfg_buffer_size + SWIFT_CHUNK_SIZE - 1) & ~(SWIFT_CHUNK_SIZE - 1);
+	if (ps->qsize < 2 * SWIFT_CHUNK_SIZE) {
+		ps->qsize = 2 * SWIFT_CHUNK_SIZE;
+	}
+	if (swift_queue_reset(ps)) {
+		return -1;
+	}
+	ast_mutex_init(&ps->lock);
+	ast_cond_init(&ps->cond, NULL);
+	return 0;
+}
+
+static void swift_destroy_stuff(struct stuff *ps)
+{
+	struct swift_chunk *chunk;
+	int i;
+
+	while ((chunk = ps->rchunk)) {
+		ps->rchunk = chunk->next;
+		swift_chunk_put(chunk);
+	}
+	swift_audio_release(ps->audio);
+	if (ps->fill) {
+		swift_audio_finish(ps->fill, 0);
+		swift_audio_release(ps->fill);
+	}
+	for (i = 0; i < ps->nsegs; i++) {
+		swift_audio_release(ps->segs[i].audio);
+	}
+	ast_free(ps->segs);
+	ast_free(ps->seg_buf);
+	if (ps->trim) {
+		ast_free(ps->trim->hold);
+		ast_free(ps->trim->out);
+		ast_free(ps->trim);
+	}
+	ast_cond_destroy(&ps->cond);
+	ast_mutex_destroy(&ps->lock);
+	ast_free(ps);
+}
+
+/*! \brief Split text at sentence and clause boundaries.  Returns the
+ * number of segments; only when there is more than one are *segs and *buf
+ * allocated.
+ */
+static int swift_split_text(const char *text, char **buf, struct swift_segment **segs)
+{
+	struct swift_segment *list = NULL, *tmp;
+	char *copy, *start, *end, *c, *seg;
+	int n = 0, alloced = 0, brk;
+
+	/* Leave SSML and other markup alone */
+	if (*ast_skip_blanks(text) == '<' || !(copy = ast_strdup(text))) {
+		return 1;
+	}
+	end = copy + strlen(copy);
+
+	for (start = c = copy; ; c++) {
+		brk = 0;
+		if (!*c) {
+			brk = 1;
+		} else if (strchr(".!?", *c) && isspace((unsigned char) c[1]) && c + 1 - start >= SWIFT_SEGMENT_MIN) {
+			*++c = '\0';
+			brk = 1;
+		} else if (strchr(",;:", *c) && isspace((unsigned char) c[1]) && c + 1 - start >= SWIFT_SEGMENT_CLAUSE) {
+			*++c = '\0';
+			brk = 1;
+		} else if (isspace((unsigned char) *c) && c - start >= SWIFT_SEGMENT_MAX) {
+			*c = '\0';
+			brk = 1;
+		}
+		if (!brk) {
+			continue;
+		}
+		seg = ast_strip(start);
+		if (!ast_strlen_zero(seg)) {
+			if (n == alloced) {
+				alloced = alloced ? alloced * 2 : 8;
+				if (!(tmp = ast_realloc(list, alloced * sizeof(*list)))) {
+					ast_free(list);
+					ast_free(copy);
+					return 1;
+				}
+				list = tmp;
+			}
+			list[n].text = seg;
+			list[n].audio = NULL;
+			list[n].slot = 0;
+			n++;
+		}
+		if (c == end) {
+			break;
+		}
+		start = c + 1;
+	}
+
+	if (n <= 1) {
+		ast_free(list);
+		ast_free(copy);
+		return 1;
+	}
+	*buf = copy;
+	*segs = list;
+	return n;
+}
+
+/*! \brief Split a template into its fixed text and the [bracketed]
+ * variable slots.  Returns the number of segments, allocating *segs and
+ * *buf whenever there is at least one.
+ */
+static int swift_split_template(const char *text, char **buf, struct swift_segment **segs)
+{
+	struct swift_segment *list = NULL, *tmp;
+	char *copy, *c, *next, *seg;
+	int n = 0, alloced = 0, slot = 0;
+
+	if (!(copy = ast_strdup(text))) {
+		return -1;
+	}
+
+	for (c = copy; c; c = next, slot = !slot) {
+		if ((next = strchr(c, slot ? ']' : '['))) {
+			*next++ = '\0';
+		}
+		seg = ast_strip(c);
+		if (ast_strlen_zero(seg)) {
+			continue;
+		}
+		if (n == alloced) {
+			alloced = alloced ? alloced * 2 : 8;
+			if (!(tmp = ast_realloc(list, alloced * sizeof(*list)))) {
+				ast_free(list);
+				ast_free(copy);
+				return -1;
+			}
+			list = tmp;
+		}
+		list[n].text = seg;
+		list[n].audio = NULL;
+		list[n].slot = slot;
+		n++;
+	}
+
+	if (!n) {
+		ast_free(copy);
+		return 0;
+	}
+	*buf = copy;
+	*segs = list;
+	return n;
+}
+
+/*! \brief Move playback on to the next segment once the current one has
+ * been played out.  Consumer side only.
+ */
+static void swift_segments_advance(struct stuff *ps)
+{
+	struct swift_audio *a;
+	unsigned int n;
+
+	while (ps->seg_play < ps->nsegs) {
+		if (!ps->audio) {
+			if (!(a = ps->segs[ps->seg_play].audio)) {
+				return;
+			}
+			swift_audio_ref(a);
+			ps->audio = a;
+			memset(&ps->cursor, 0, sizeof(ps->cursor));
+		}
+		if (ps->seek) {
+			/* Resume a re-rendered segment where we left off */
+			n = swift_atomic_load(&ps->audio->len) - ps->cursor.pos;
+			n = swift_audio_read(ps->audio, &ps->cursor, NULL, n < ps->seek ? n : ps->seek);
+			ps->seek -= n;
+		}
+		if (swift_atomic_load(&ps->audio->done) <= 0 || ps->cursor.pos < ps->audio->len ||
+			ps->seg_play + 1 >= ps->nsegs) {
+			return;
+		}
+		swift_audio_release(ps->audio);
+		ps->audio = NULL;
+		ps->seek = 0;
+		ps->seg_play++;
+	}
+}
+
+/*! \brief Bytes ready to play across the current and following segments.
+ * \param complete set if no more will ever come
+ */
+static unsigned int swift_segments_available(struct stuff *ps, int *complete)
+{
+	struct swift_audio *a;
+	unsigned int avail;
+	int i, done;
+
+	swift_segments_advance(ps);
+	*complete = 0;
+	if (!ps->audio || ps->seek) {
+		return 0;
+	}
+	done = swift_atomic_load(&ps->audio->done);
+	avail = swift_atomic_load(&ps->audio->len) - ps->cursor.pos;
+	for (i = ps->seg_play + 1; done > 0 && i < ps->nsegs && (a = ps->segs[i].audio); i++) {
+		done = swift_atomic_load(&a->done);
+		avail += swift_atomic_load(&a->len);
+	}
+	*complete = done > 0 && i == ps->nsegs;
+	return avail;
+}
+
+static unsigned int swift_segments_read(struct stuff *ps, unsigned char *dst, unsigned int max)
+{
+	unsigned int copied = 0, n;
+
+	while (copied < max) {
+		swift_segments_advance(ps);
+		if (!ps->audio || ps->seek ||
+			!(n = swift_audio_read(ps->audio, &ps->cursor, dst + copied, max - copied))) {
+			break;
+		}
+		copied += n;
+	}
+	return copied;
+}
+
+static unsigned int swift_bytes_available(struct stuff *ps)
+{
+	int complete;
+
+	if (ps->segs) {
+		return swift_segments_available(ps, &complete);
+	}
+	if (ps->audio) {
+		return swift_atomic_load(&ps->audio->len) - ps->cursor.pos;
+	}
+	return swift_atomic_load(&ps->head) - ps->tail;
+}
+
+/*! \brief Whether every byte of the audio has been produced. */
+static int swift_audio_complete(struct stuff *ps)
+{
+	int complete;
+
+	if (ps->segs) {
+		swift_segments_available(ps, &complete);
+		return complete;
+	}
+	if (ps->audio) {
+		return swift_atomic_load(&ps->audio->done) != 0;
+	}
+	return swift_atomic_load(&ps->generating_done);
+}
+
+static int swift_generator_running(struct stuff *ps)
+{
+	/* Check generating_done before the queue, so that once we see it set
+	 * every byte written ahead of it is visible too. */
+	if (ps->segs) {
+		return !swift_atomic_load(&ps->immediate_exit) &&
+			(swift_bytes_available(ps) || !swift_audio_complete(ps));
+	}
+	if (ps->audio) {
+		return !swift_atomic_load(&ps->immediate_exit) &&
+			(!swift_atomic_load(&ps->audio->done) || swift_bytes_available(ps));
+	}
+	return !swift_atomic_load(&ps->immediate_exit) &&
+		(!swift_atomic_load(&ps->generating_done) || swift_bytes_available(ps));
+}
+
+/*! \brief Wake the producer if it is sleeping on a full queue.  With
+ * force, wake it regardless of how much space is free (used to cancel).
+ */
+static void swift_wake_producer(struct stuff *ps, int force)
+{
+	/* Pairs with the producer setting producer_waiting before it checks
+	 * tail one last time; one of us is bound to see the other. */
+	if (!swift_atomic_load_sc(&ps->producer_waiting)) {
+		return;
+	}
+	ast_mutex_lock(&ps->lock);
+	if (ps->producer_waiting && (force || ps->qsize - (swift_atomic_load(&ps->head) - ps->tail) >= ps->want)) {
+		ast_cond_signal(&ps->cond);
+	}
+	ast_mutex_unlock(&ps->lock);
+}
+
+/*! \brief Stop the stream from the consumer side and wake the producer,
+ * whether it waits on this queue or on the shared chunk pool.
+ */
+static void swift_cancel_stuff(struct stuff *ps)
+{
+	swift_trace(ps, SWIFT_TRACE_CANCEL, 0);
+	if (ast_tvzero(ps->cancelled)) {
+		ps->cancelled = ast_tvnow();
+	}
+	swift_atomic_store_sc(&ps->immediate_exit, 1);
+	swift_wake_producer(ps, 1);
+
+	ast_mutex_lock(&chunk_lock);
+	if (chunk_waiters) {
+		ast_cond_broadcast(&chunk_cond);
+	}
+	ast_mutex_unlock(&chunk_lock);
+}
+
+/*! \brief Move the consumer on to the next chunk, giving back the one it
+ * has drained.  Only once more data is queued.
+ */
+static void swift_queue_next_chunk(struct stuff *ps)
+{
+	struct swift_chunk *done = ps->rchunk;
+
+	/* More data means the producer has linked the next chunk */
+	ps->rchunk = swift_atomic_load(&done->next);
+	ps->roff = 0;
+	swift_chunk_put(done);
+}
+
+/*! \brief Point *data at the next len bytes of the queue where they lie,
+ * if they are all in one chunk with a frame header's worth of played audio
+ * in front of them for the channel driver to write into.  Consumer side
+ * only; the bytes stay put until swift_queue_consume().
+ * \retval 0 if they have to be copied out with swift_queue_read()
+ */
+static int swift_queue_peek(struct stuff *ps, unsigned int len, unsigned char **data)
+{
+	if (ps->segs || ps->audio) {
+		/* Shared with other calls, or mapped read only */
+		return 0;
+	}
+	if (swift_bytes_available(ps) < len) {
+		return 0;
+	}
+	if (ps->roff == SWIFT_CHUNK_SIZE) {
+		swift_queue_next_chunk(ps);
+	}
+	if (ps->roff < AST_FRIENDLY_OFFSET || SWIFT_CHUNK_SIZE - ps->roff < len) {
+		return 0;
+	}
+	*data = ps->rchunk->data + ps->roff;
+	return 1;
+}
+
+/*! \brief Mark len bytes returned by swift_queue_peek() played. */
+static void swift_queue_consume(struct stuff *ps, unsigned int len)
+{
+	ps->roff += len;
+	swift_atomic_store_sc(&ps->tail, ps->tail + len);
+	swift_wake_producer(ps, 0);
+}
+
+/*! \brief Consume up to max bytes into dst.  Consumer side only. */
+static unsigned int swift_queue_read(struct stuff *ps, unsigned char *dst, unsigned int max)
+{
+	unsigned int len, copied = 0, n;
+
+	if (ps->segs) {
+		return swift_segments_read(ps, dst, max);
+	}
+	if (ps->audio) {
+		return swift_audio_read(ps->audio, &ps->cursor, dst, max);
+	}
+
+	len = swift_bytes_available(ps);
+	if (len > max) {
+		len = max;
+	}
+
+	while (copied < len) {
+		if (ps->roff == SWIFT_CHUNK_SIZE) {
+			swift_queue_next_chunk(ps);
+		}
+		n = SWIFT_CHUNK_SIZE - ps->roff;
+		if (n > len - copied) {
+			n = len - copied;
+		}
+		memcpy(dst + copied, ps->rchunk->data + ps->roff, n);
+		ps->roff += n;
+		copied += n;
+	}
+	swift_atomic_store_sc(&ps->tail, ps->tail + len);
+	swift_wake_producer(ps, 0);
+
+	return len;
+}
+
+/*! \brief Queue len bytes of audio.  Producer side only.  When the call
+ * has buffered all it may, sleep until the consumer has drained some.
+ * \retval 0 all written
+ * \retval -1 stopped early by the consumer
+ */
+static int swift_queue_write(struct stuff *ps, const unsigned char *buf, unsigned int len)
+{
+	struct swift_chunk *chunk;
+	unsigned int space, n;
+	struct timeval start;
+	int64_t slept;
+
+	while (len) {
+		if (swift_atomic_load(&ps->immediate_exit)) {
+			return -1;
+		}
+
+		space = ps->qsize - (ps->head - swift_atomic_load(&ps->tail));
+		if (!space) {
+			ast_mutex_lock(&ps->lock);
+			/* Wait for a quarter of the queue (or what we still need) */
+			ps->want = len < ps->qsize / 4 ? len : ps->qsize / 4;
+			swift_atomic_store_sc(&ps->producer_waiting, 1);
+			swift_trace(ps, SWIFT_TRACE_SLEEP, len);
+			start = ast_tvnow();
+			while (ps->qsize - (ps->head - swift_atomic_load_sc(&ps->tail)) < ps->want &&
+				!swift_atomic_load_sc(&ps->immediate_exit)) {
+				ast_cond_wait(&ps->cond, &ps->lock);
+			}
+			swift_atomic_store(&ps->producer_waiting, 0);
+			ast_mutex_unlock(&ps->lock);
+			slept = swift_tvdiff_us(ast_tvnow(), start);
+			swift_trace(ps, SWIFT_TRACE_WAKE, slept);
+			swift_stat_add(&stats.producer_sleeps, 1);
+			swift_stat_add(&stats.producer_slept_us, slept);
+			continue;
+		}
+
+		if (ps->woff == SWIFT_CHUNK_SIZE) {
+			if (!(chunk = swift_chunk_get(ps))) {
+				return -1;
+			}
+			swift_atomic_store(&ps->wchunk->next, chunk);
+			ps->wchunk = chunk;
+			ps->woff = 0;
+		}
+
+		n = SWIFT_CHUNK_SIZE - ps->woff;
+		if (n > len) {
+			n = len;
+		}
+		if (n > space) {
+			n = space;
+		}
+		memcpy(ps->wchunk->data + ps->woff, buf, n);
+		ps->woff += n;
+		swift_atomic_store(&ps->head, ps->head + n);
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*! \brief Pass rendered audio on to the queue and the copy being
+ * cached.  Producer side only.
+ * \retval -1 stopped early by the consumer
+ */
+static int swift_cb_audio(struct stuff *ps, const unsigned char *buf, unsigned int len)
+{
+	unsigned int n;
+
+	if (ps->skip) {
+		/* Already played from the synthesis we were sharing */
+		n = ps->skip < len ? ps->skip : len;
+		buf += n;
+		len -= n;
+		ps->skip -= n;
+	}
+	if (!len) {
+		return 0;
+	}
+	if (ps->fill_only) {
+		/* Segments play straight from their own audio */
+		if (ps->fill && swift_audio_append(ps->fill, buf, len, UINT_MAX)) {
+			swift_audio_finish(ps->fill, 0);
+			swift_audio_release(ps->fill);
+			ps->fill = NULL;
+		}
+		return 0;
+	}
+	if (swift_queue_write(ps, buf, len)) {
+		return -1;
+	}
+	if (ps->fill && swift_audio_append(ps->fill, buf, len, cfg_cache_max_prompt)) {
+		/* Too long to be worth caching (or sharing) */
+		swift_audio_finish(ps->fill, 0);
+		swift_audio_release(ps->fill);
+		ps->fill = NULL;
+	}
+	return 0;
+}
+
+/*! \brief Take rendered audio, from the engine or from swift_broker. */
+static void swift_cb_rendered(struct stuff *ps, const unsigned char *buf, unsigned int len)
+{
+	unsigned char *out;
+	int n;
+
+	swift_trace(ps, SWIFT_TRACE_AUDIO, len);
+	swift_stat_add(&stats.bytes_rendered, len);
+	swift_render_audio(ps, len);
+
+	if (ps->trim && (n = swift_trim_process(ps->trim, buf, len, &out)) >= 0) {
+		buf = out;
+		len = n;
+	}
+	if (len > 0) {
+		swift_cb_audio(ps, buf, len);
+	}
+}
+
+/*! \brief The rendering is over, complete unless the call cancelled it. */
+static void swift_cb_end(struct stuff *ps)
+{
+	unsigned char *out;
+	int len;
+
+	swift_trace(ps, SWIFT_TRACE_END, 0);
+	if (!swift_atomic_load(&ps->immediate_exit)) {
+		swift_render_end(ps);
+	}
+	if (ps->trim && !swift_atomic_load(&ps->immediate_exit)) {
+		/* The rest of a short last block; trailing silence is dropped */
+		if ((len = swift_trim_process(ps->trim, NULL, 0, &out)) > 0) {
+			swift_cb_audio(ps, out, len);
+		}
+		ast_log(LOG_DEBUG, "Trimmed %u bytes of silence\n", ps->trim->dropped);
+		swift_voice_level_add(ps->trim->voice, ps->trim->level_sum, ps->trim->level_samples);
+	}
+	if (ps->fill) {
+		if (!swift_atomic_load(&ps->immediate_exit)) {
+			/* app_exec() adds it to the prompt store after playback */
+			swift_audio_finish(ps->fill, 1);
+			if (!ps->no_cache) {
+				swift_cache_insert(ps->fill);
+			}
+		} else {
+			swift_audio_finish(ps->fill, 0);
+			swift_audio_release(ps->fill);
+			ps->fill = NULL;
+		}
+	}
+	swift_atomic_store(&ps->generating_done, 1);
+}
+
+static swift_result_t swift_cb(swift_event *event, swift_event_t type, void *udata)
+{
+	void *buf;
+	int len;
+	swift_event_t rv = SWIFT_SUCCESS;
+	struct stuff *ps = udata;
+
+	if (type == SWIFT_EVENT_AUDIO) {
+		if (ps->job.port && swift_atomic_load(&ps->immediate_exit)) {
+			/* Free the synthesis worker for someone who is listening */
+			return SWIFT_INTERRUPTED;
+		}
+		rv = swift_event_get_audio(event, &buf, &len);
+
+		if (!SWIFT_FAILED(rv) && len > 0) {
+			swift_cb_rendered(ps, buf, len);
+		} else {
+			ast_log(LOG_DEBUG, "got audio callback but get_audio call failed\n");
+		}
+	} else if (type == SWIFT_EVENT_END) {
+		swift_cb_end(ps);
+#if defined _SWIFT_VER_6
+	} else if (type == SWIFT_EVENT_ERROR) {
+		/* 
+		 * Error events are used to communicate to app_swift that there are no more swift_ports available.
+		 * So check to make sure that is the cause of the error signal, then terminate this attempt.
+		 * app_exec() puts the call back in the port queue and tries again.
+		 */
+		swift_result_t error_code;
+
+		if ((swift_event_get_error(event, &error_code, NULL)==SWIFT_SUCCESS) && (error_code == SWIFT_PORT_UNAVAILABLE)) {
+			ast_log(LOG_WARNING, "Received SWIFT_EVENT_ERROR with code: SWIFT_PORT_UNAVAILABLE.  There are no ports available for simultaneous synthesis.  All licensed ports are already in use.\n");
+			swift_atomic_store(&ps->port_unavailable, 1);
+			swift_atomic_store(&ps->generating_done, 1);
+		}
+#endif
+	} else {
+		ast_log(LOG_DEBUG, "UNKNOWN callback\n");
+	}
+	return rv;
+}
+
+/*! \brief Pin the calling synthesis worker to the CPUs in synth_cpus, a
+ * list of numbers and ranges such as "2-5,8", or unpin it if that is empty.
+ * \param pinned whether the worker is pinned now; updated
+ */
+static void swift_synth_pin(int *pinned)
+{
+	char cpus[sizeof(cfg_synth_cpus)];
+#if defined __linux__
+	char *range, *list = cpus;
+	cpu_set_t set;
+	int lo, hi, n = 0;
+#endif
+
+	ast_copy_string(cpus, cfg_synth_cpus, sizeof(cpus));
+	if (ast_strlen_zero(cpus) && !*pinned) {
+		return;
+	}
+#if defined __linux__
+	CPU_ZERO(&set);
+	if (ast_strlen_zero(cpus)) {
+		/* Back to anywhere the process may run */
+		for (lo = 0; lo < CPU_SETSIZE; lo++) {
+			CPU_SET(lo, &set);
+		}
+		n = CPU_SETSIZE;
+	}
+	while ((range = strsep(&list, ","))) {
+		switch (sscanf(range, "%d-%d", &lo, &hi)) {
+		case 1:
+			hi = lo;
+			/* fall through */
+		case 2:
+			break;
+		default:
+			continue;
+		}
+		for (; lo <= hi && lo >= 0 && lo < CPU_SETSIZE; lo++) {
+			CPU_SET(lo, &set);
+			n++;
+		}
+	}
+	if (!n || pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+		ast_log(LOG_WARNING, "Unable to pin Swift synthesis worker to CPUs '%s'\n", cpus);
+		return;
+	}
+	*pinned = !ast_strlen_zero(cpus);
+#else
+	ast_log(LOG_WARNING, "Pinning Swift synthesis workers to CPUs is not supported here\n");
+	*pinned = 0;
+#endif
+}
+
+/*! \brief Run queued syntheses until there are more workers than wanted.
+ * Workers on their way out still finish whatever is queued. */
+static void *swift_synth_thread(void *data)
+{
+	struct swift_synth_job *job;
+	struct stuff *ps;
+	unsigned int pin_gen = 0;
+	int pinned = 0;
+	int64_t waited;
+
+	ast_mutex_lock(&synth_lock);
+	for (;;) {
+		if (pin_gen != synth_pin_gen) {
+			pin_gen = synth_pin_gen;
+			ast_mutex_unlock(&synth_lock);
+			swift_synth_pin(&pinned);
+			ast_mutex_lock(&synth_lock);
+		}
+		if (!(job = AST_LIST_REMOVE_HEAD(&synth_queue, list))) {
+			if (synth_threads > synth_target) {
+				break;
+			}
+			ast_cond_wait(&synth_cond, &synth_lock);
+			continue;
+		}
+		job->state = SWIFT_SYNTH_RUNNING;
+		synth_queued--;
+		synth_busy++;
+		ast_mutex_unlock(&synth_lock);
+
+		ps = job->ps;
+		waited = swift_tvdiff_us(ast_tvnow(), job->queued);
+		swift_stat_add(&stats.synth_jobs, 1);
+		swift_stat_add(&stats.synth_wait_us, waited);
+		swift_trace(ps, SWIFT_TRACE_WORKER, waited / 1000);
+		if (SWIFT_FAILED(swift_port_speak_text(job->port, job->text, 0, NULL, NULL, NULL)) &&
+			!swift_atomic_load(&ps->generating_done) && !swift_atomic_load(&ps->immediate_exit)) {
+			ast_log(LOG_ERROR, "Failed to speak.\n");
+			/* Nothing more is coming; playback ends with what there is */
+			if (ps->fill) {
+				swift_audio_finish(ps->fill, 0);
+				swift_audio_release(ps->fill);
+				ps->fill = NULL;
+			}
+			swift_atomic_store(&ps->generating_done, 1);
+		}
+
+		ast_mutex_lock(&synth_lock);
+		/* The job belongs to the call again as soon as it is idle */
+		job->state = SWIFT_SYNTH_IDLE;
+		synth_busy--;
+		ast_cond_broadcast(&synth_done);
+	}
+	synth_threads--;
+	ast_cond_broadcast(&synth_done);
+	ast_mutex_unlock(&synth_lock);
+	return NULL;
+}
+
+/*! \brief Start or retire workers to match synth_workers, and have them
+ * all pick up synth_cpus again.  With no workers, syntheses go back to
+ * the engine's own threads. */
+static void swift_synth_resize(void)
+{
+	pthread_t thread;
+
+	ast_mutex_lock(&synth_lock);
+	synth_target = cfg_synth_workers < SWIFT_SYNTH_MAX ? cfg_synth_workers : SWIFT_SYNTH_MAX;
+	synth_pin_gen++;
+	while (synth_threads < synth_target) {
+		if (ast_pthread_create_detached(&thread, NULL, swift_synth_thread, NULL)) {
+			ast_log(LOG_WARNING, "Unable to start Swift synthesis worker\n");
+			synth_target = synth_threads;
+			break;
+		}
+		synth_threads++;
+	}
+	ast_cond_broadcast(&synth_cond);
+	ast_mutex_unlock(&synth_lock);
+}
+
+/*! \brief Retire every worker once the queue is empty. */
+static void swift_synth_shutdown(void)
+{
+	ast_mutex_lock(&synth_lock);
+	synth_target = 0;
+	ast_cond_broadcast(&synth_cond);
+	while (synth_threads) {
+		ast_cond_wait(&synth_done, &synth_lock);
+	}
+	ast_mutex_unlock(&synth_lock);
+}
+
+/*! \brief Start rendering text on pp's port: on a synthesis worker if
+ * there are any, or else in the background on a thread of the engine's.
+ */
+static swift_result_t swift_speak(struct stuff *ps, struct swift_pooled_port *pp, const char *text,
+	swift_background_t *tts_stream)
+{
+	struct swift_synth_job *job = &ps->job;
+
+	ast_mutex_lock(&synth_lock);
+	if (!synth_target) {
+		ast_mutex_unlock(&synth_lock);
+		job->port = NULL;
+		return swift_port_speak_text(pp->port, text, 0, NULL, tts_stream, NULL);
+	}
+	job->ps = ps;
+	job->port = pp->port;
+	job->text = text;
+	job->state = SWIFT_SYNTH_QUEUED;
+	job->queued = ast_tvnow();
+	AST_LIST_INSERT_TAIL(&synth_queue, job, list);
+	synth_queued++;
+	ast_cond_signal(&synth_cond);
+	ast_mutex_unlock(&synth_lock);
+	return SWIFT_SUCCESS;
+}
+
+/*! \brief Wait for the rendering on pp's port to finish. */
+static void swift_speak_wait(struct stuff *ps, struct swift_pooled_port *pp, swift_background_t tts_stream)
+{
+	if (!ps->job.port) {
+		swift_port_wait(pp->port, tts_stream);
+		return;
+	}
+	ast_mutex_lock(&synth_lock);
+	while (ps->job.state != SWIFT_SYNTH_IDLE) {
+		ast_cond_wait(&synth_done, &synth_lock);
+	}
+	ast_mutex_unlock(&synth_lock);
+}
+
+/*! \brief Stop the rendering on pp's port if it is still under way, so
+ * the port can be given back.  A worker rendering for us is stopped on the
+ * port as well as at its next piece of audio, so an engine that is slow to
+ * produce it does not hold up the release.  Either way we wait for the
+ * rendering thread to let go of the port and the call.
+ */
+static void swift_speak_stop(struct stuff *ps, struct swift_pooled_port *pp, swift_background_t tts_stream)
+{
+	if (!ps->job.port) {
+		if (tts_stream && !swift_atomic_load(&ps->generating_done)) {
+			/* Make sure the producer is not asleep on a full queue */
+			swift_cancel_stuff(ps);
+			if (SWIFT_FAILED(swift_port_stop(pp->port, tts_stream, SWIFT_EVENT_NOW))) {
+				ast_log(LOG_NOTICE, "Early top of swift port failed\n");
+			}
+		}
+		if (tts_stream) {
+			/* The engine's thread may still be in swift_cb(); only once it
+			 * is done with the call may the port or fill be touched */
+			swift_port_wait(pp->port, tts_stream);
+		}
+		return;
+	}
+	ast_mutex_lock(&synth_lock);
+	if (ps->job.state == SWIFT_SYNTH_QUEUED) {
+		AST_LIST_REMOVE(&synth_queue, &ps->job, list);
+		ps->job.state = SWIFT_SYNTH_IDLE;
+		synth_queued--;
+	} else if (ps->job.state == SWIFT_SYNTH_RUNNING && !swift_atomic_load(&ps->generating_done)) {
+		ast_mutex_unlock(&synth_lock);
+		swift_cancel_stuff(ps);
+		if (SWIFT_FAILED(swift_port_stop(pp->port, SWIFT_ASYNC_ANY, SWIFT_EVENT_NOW))) {
+			ast_log(LOG_DEBUG, "Stop of the worker's swift port failed, waiting for its next audio\n");
+		}
+		ast_mutex_lock(&synth_lock);
+	}
+	while (ps->job.state != SWIFT_SYNTH_IDLE) {
+		ast_cond_wait(&synth_done, &synth_lock);
+	}
+	ast_mutex_unlock(&synth_lock);
+}
+
+/*! \brief The call has let go of its port.  When it cancelled, the time
+ * from the cancel to the release is counted. */
+static void swift_stats_released(struct stuff *ps)
+{
+	int64_t us = 0;
+
+	if (!ast_tvzero(ps->cancelled)) {
+		us = swift_tvdiff_us(ast_tvnow(), ps->cancelled);
+		swift_stat_add(&stats.cancels, 1);
+		swift_stat_add(&stats.cancel_us, us);
+		swift_stat_max(&stats.cancel_max_us, us);
+	}
+	swift_trace(ps, SWIFT_TRACE_CHECKIN, us);
+}
+
+/*! \brief Stop synthesis if it is still running and give the port back.
+ * Anyone sharing the synthesis carries on with a port of their own.
+ */
+static void swift_stop_synthesis(struct stuff *ps, struct swift_pooled_port *pp, swift_background_t tts_stream)
+{
+	swift_speak_stop(ps, pp, tts_stream);
+	swift_port_checkin(pp);
+	swift_stats_released(ps);
+	if (ps->fill) {
+		swift_audio_finish(ps->fill, 0);
+	}
+}
+
+/*! \brief Say, at most once a minute, why swift_broker was not used. */
+static void swift_broker_unavailable(const char *why)
+{
+	time_t now = time(NULL);
+
+	if (now - broker_warned >= 60) {
+		broker_warned = now;
+		ast_log(LOG_WARNING, "swift_broker at %s %s; rendering here instead\n", cfg_broker, why);
+	}
+}
+
+static void swift_broker_close(struct swift_broker_call *bc)
+{
+	if (bc->map) {
+		munmap(bc->map, bc->size);
+	}
+	if (bc->passed >= 0) {
+		close(bc->passed);
+	}
+	if (bc->fd >= 0) {
+		close(bc->fd);
+	}
+	ast_free(bc);
+}
+
+/*! \brief Read a line from the broker, keeping a descriptor passed with it. */
+static char *swift_broker_line(struct swift_broker_call *bc)
+{
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char *nl;
+	ssize_t n;
+	int fd;
+
+	if (bc->used) {
+		memmove(bc->buf, bc->buf + bc->used, bc->have - bc->used);
+		bc->have -= bc->used;
+		bc->used = 0;
+	}
+	while (!(nl = memchr(bc->buf, '\n', bc->have))) {
+		if (bc->have == sizeof(bc->buf)) {
+			return NULL;
+		}
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = bc->buf + bc->have;
+		iov.iov_len = sizeof(bc->buf) - bc->have;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		if ((n = recvmsg(bc->fd, &msg, 0)) <= 0) {
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			return NULL;
+		}
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+				continue;
+			}
+			memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+			if (bc->passed < 0) {
+				fcntl(fd, F_SETFD, FD_CLOEXEC);
+				bc->passed = fd;
+			} else {
+				close(fd);
+			}
+		}
+		bc->have += n;
+	}
+	*nl = '\0';
+	bc->used = nl - bc->buf + 1;
+	return bc->buf;
+}
+
+/*! \brief Ask swift_broker, if one is set, to render text for this call.
+ *
+ * Like swift_port_checkout(), this waits up to max_wait for the broker to
+ * have a port for us, and then sets ps->broker for swift_broker_start().
+ * It is left NULL when the broker cannot be reached or cannot render the
+ * text, for the call to render it here instead.  Without max_wait, a
+ * broker too busy to answer within a frame has no port for us either.
+ *
+ * \retval -1 if the broker had no port for us in time; status says why
+ */
+static int swift_broker_request(struct stuff *ps, const char *voice, const char *text, int priority, int max_wait,
+	int *waited, const char **status)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX, };
+	struct swift_broker_call *bc;
+	struct timeval tv;
+	char *req = NULL, *c, *line, word[16];
+	size_t size;
+	int len, sent, n;
+
+	*waited = 0;
+	if (ast_strlen_zero(cfg_broker)) {
+		return 0;
+	}
+	if (!(bc = ast_calloc(1, sizeof(*bc)))) {
+		return 0;
+	}
+	bc->passed = -1;
+	if ((bc->fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || !(req = ast_malloc(SWIFT_BROKER_REQUEST_MAX))) {
+		goto local;
+	}
+	fcntl(bc->fd, F_SETFD, FD_CLOEXEC);
+	len = snprintf(req, SWIFT_BROKER_REQUEST_MAX, "SPEAK %d %d %s %s %s %s\n", priority, max_wait,
+		ps->format->encoding, ps->format->rate, voice, text);
+	if (len >= SWIFT_BROKER_REQUEST_MAX) {
+		ast_log(LOG_DEBUG, "Text is too long for swift_broker\n");
+		goto local;
+	}
+	/* The text goes on the one line */
+	for (c = req; c < req + len - 1; c++) {
+		if (*c == '\n' || *c == '\r') {
+			*c = ' ';
+		}
+	}
+
+	ast_copy_string(addr.sun_path, cfg_broker, sizeof(addr.sun_path));
+	if (connect(bc->fd, (struct sockaddr *) &addr, sizeof(addr))) {
+		swift_broker_unavailable(strerror(errno));
+		goto local;
+	}
+	for (sent = 0; sent < len; sent += n) {
+		if ((n = send(bc->fd, req + sent, len - sent, MSG_NOSIGNAL)) <= 0) {
+			swift_broker_unavailable(strerror(errno));
+			goto local;
+		}
+	}
+
+	/* It answers as soon as it has a port for us, within max_wait */
+	tv = ast_samp2tv(max_wait > 0 ? max_wait + SWIFT_BROKER_GRACE : SWIFT_BROKER_PROBE, 1000);
+	setsockopt(bc->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (!(line = swift_broker_line(bc))) {
+		if (max_wait <= 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			/* Busy rather than gone, which is no reason to render here */
+			*status = "TIMEOUT";
+			ast_free(req);
+			swift_broker_close(bc);
+			return -1;
+		}
+		swift_broker_unavailable("did not answer");
+		goto local;
+	}
+	if (sscanf(line, "OK %d %zu", waited, &size) == 2 && bc->passed >= 0 && size) {
+		if ((bc->map = mmap(NULL, size, PROT_READ, MAP_SHARED, bc->passed, 0)) == MAP_FAILED) {
+			ast_log(LOG_WARNING, "Unable to map swift_broker's audio: %s\n", strerror(errno));
+			bc->map = NULL;
+			goto local;
+		}
+		bc->size = size;
+		close(bc->passed);
+		bc->passed = -1;
+		/* From here on the rendering takes as long as it takes */
+		tv = ast_tv(0, 0);
+		setsockopt(bc->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		ast_free(req);
+		ps->broker = bc;
+		swift_trace(ps, SWIFT_TRACE_PORT, *waited);
+		return 0;
+	}
+	if (sscanf(line, "FAIL %15s %d", word, waited) == 2 && (!strcmp(word, "TIMEOUT") || !strcmp(word, "QUEUEFULL"))) {
+		if (max_wait > 0) {
+			ast_log(LOG_WARNING, "swift_broker had no port for us after %dms\n", *waited);
+		}
+		*status = !strcmp(word, "TIMEOUT") ? "TIMEOUT" : "QUEUEFULL";
+		swift_trace(ps, SWIFT_TRACE_PORT, *waited);
+		ast_free(req);
+		swift_broker_close(bc);
+		return -1;
+	}
+	swift_broker_unavailable("could not render the text");
+
+local:
+	swift_stat_add(&stats.broker_fallbacks, 1);
+	ast_free(req);
+	swift_broker_close(bc);
+	return 0;
+}
+
+/*! \brief Hand the call the audio swift_broker renders for it, as far as
+ * the broker says it goes, until the end or until the call hangs up on
+ * the broker. */
+static void *swift_broker_thread(void *data)
+{
+	struct stuff *ps = data;
+	struct swift_broker_call *bc = ps->broker;
+	char *line;
+	size_t len;
+	int end = 0;
+
+	while (!end && (line = swift_broker_line(bc))) {
+		if (sscanf(line, "AUDIO %zu", &len) != 1 && !(end = (sscanf(line, "END %zu", &len) == 1))) {
+			break;
+		}
+		if (len > bc->size) {
+			len = bc->size;
+		}
+		if (len > bc->done && !swift_atomic_load(&ps->immediate_exit)) {
+			swift_cb_rendered(ps, bc->map + bc->done, len - bc->done);
+			bc->done = len;
+		}
+	}
+	if (end) {
+		swift_cb_end(ps);
+		return NULL;
+	}
+
+	if (!swift_atomic_load(&ps->immediate_exit)) {
+		ast_log(LOG_WARNING, "swift_broker stopped rendering after %u bytes\n", (unsigned int) bc->done);
+	}
+	/* Nothing more is coming; playback ends with what there is */
+	swift_trace(ps, SWIFT_TRACE_END, 0);
+	if (ps->fill) {
+		swift_audio_finish(ps->fill, 0);
+		swift_audio_release(ps->fill);
+		ps->fill = NULL;
+	}
+	swift_atomic_store(&ps->generating_done, 1);
+	return NULL;
+}
+
+/*! \brief Start handing the call what swift_broker renders for it. */
+static int swift_broker_start(struct stuff *ps)
+{
+	if (ast_pthread_create(&ps->broker->thread, NULL, swift_broker_thread, ps)) {
+		ast_log(LOG_WARNING, "Unable to start a thread for swift_broker\n");
+		swift_broker_close(ps->broker);
+		ps->broker = NULL;
+		return -1;
+	}
+	swift_stat_add(&stats.broker_calls, 1);
+	return 0;
+}
+
+/*! \brief Hang up on swift_broker, which stops rendering for us if it has
+ * not finished and gives its port to the next call, and wait for our
+ * thread to let go of the call. */
+static void swift_broker_stop(struct stuff *ps)
+{
+	struct swift_broker_call *bc = ps->broker;
+
+	if (!swift_atomic_load(&ps->generating_done)) {
+		/* Make sure the thread is not asleep on a full queue */
+		swift_cancel_stuff(ps);
+	}
+	shutdown(bc->fd, SHUT_RDWR);
+	pthread_join(bc->thread, NULL);
+	swift_stats_released(ps);
+	swift_broker_close(bc);
+	ps->broker = NULL;
+}
+
+/*! \brief Point a freshly checked out port at this call, switching it to
+ * the call's audio format if it last rendered another.
+ */
+static int swift_port_attach(struct swift_pooled_port *pp, struct ast_channel *chan, struct stuff *ps)
+{
+	unsigned int event_mask;
+
+	if (pp->format != ps->format) {
+		ast_log(LOG_DEBUG, "Switching port to %s audio\n", ps->format->name);
+		if (SWIFT_FAILED(swift_port_set_param_string(pp->port, "audio/encoding", ps->format->encoding, SWIFT_ASYNC_NONE)) ||
+			SWIFT_FAILED(swift_port_set_param_string(pp->port, "audio/sampling-rate", ps->format->rate, SWIFT_ASYNC_NONE))) {
+			ast_log(LOG_ERROR, "Failed to set Swift port to %s audio.\n", ps->format->name);
+			/* Half switched; make sure it is set again next time */
+			pp->format = NULL;
+			return -1;
+		}
+		pp->format = ps->format;
+	}
+
+#if defined _SWIFT_VER_6
+	/* 
+	 * This registers a chan with swift, otherwise through repeated DTMF+synth requests
+	 * a single call could consume all available concurrent synthesis ports.
+	*/
+	if (chan) {
+		swift_register_ast_chan(pp->port, chan);
+	}
+#endif
+
+#if defined _SWIFT_VER_6
+	event_mask = SWIFT_EVENT_AUDIO | SWIFT_EVENT_END | SWIFT_EVENT_ERROR;
+#elif defined _SWIFT_VER_5
+	event_mask = SWIFT_EVENT_AUDIO | SWIFT_EVENT_END;
+#endif
+
+	swift_port_set_callback(pp->port, &swift_cb, event_mask, ps);
+	return 0;
+}
+
+/*! \brief Collect the segment our port (or swift_broker) was rendering,
+ * once it is done.  The port stays checked out for the next segment.
+ */
+static void swift_segments_collect(struct stuff *ps, struct swift_pooled_port **pp, swift_background_t tts_stream)
+{
+	if (ps->seg_render < 0 || !swift_atomic_load(&ps->generating_done)) {
+		return;
+	}
+	if (ps->port_unavailable) {
+		/* The engine refused the port; the segment gets queued again */
+		swift_speak_stop(ps, *pp, tts_stream);
+		if (ps->fill) {
+			swift_audio_finish(ps->fill, 0);
+		}
+		swift_port_refused(*pp);
+		*pp = NULL;
+		ps->port_unavailable = 0;
+	} else {
+		if (ps->broker) {
+			swift_broker_stop(ps);
+		} else {
+			swift_speak_wait(ps, *pp, tts_stream);
+		}
+		/* Slot values are kept in memory only; they rarely repeat enough
+		 * to earn a place on disk */
+		if (ps->fill && ps->fill->done > 0 && !ps->segs[ps->seg_render].slot) {
+			swift_store_add(ps->fill);
+		}
+	}
+	swift_audio_release(ps->fill);
+	ps->fill = NULL;
+	ps->seg_render = -1;
+}
+
+/*! \brief Keep synthesis of the segments ahead of playback.  Runs on the
+ * channel thread between frames; it only blocks to queue for a port when
+ * playback would otherwise starve (or, with eager, to start the call).
+ * \retval -1 if no port could be had within max_wait
+ */
+static int swift_segments_schedule(struct stuff *ps, struct ast_channel *chan, struct swift_pooled_port **pp,
+	swift_background_t *tts_stream, const char *voice, int priority, int max_wait, int eager,
+	int *total_wait, const char **status)
+{
+	struct swift_segment *seg;
+	unsigned int ahead = 0;
+	const char *probed;
+	int i, waited = 0, now, dry;
+
+	swift_segments_collect(ps, pp, *tts_stream);
+	if (ps->seg_render >= 0) {
+		return 0;
+	}
+
+	/* Drop anything whose rendering was given up on, by us or by the call
+	 * we were sharing it with, so it is rendered again.  Playback of the
+	 * current segment resumes where it stopped. */
+	for (i = ps->seg_play; i < ps->nsegs; i++) {
+		seg = &ps->segs[i];
+		if (!seg->audio || swift_atomic_load(&seg->audio->done) >= 0) {
+			continue;
+		}
+		if (i == ps->seg_play && ps->audio == seg->audio) {
+			if (ps->cursor.pos < swift_atomic_load(&seg->audio->len)) {
+				continue;
+			}
+			ps->seek = ps->cursor.pos;
+			swift_audio_release(ps->audio);
+			ps->audio = NULL;
+		}
+		swift_audio_release(seg->audio);
+		seg->audio = NULL;
+	}
+
+	for (i = ps->seg_play; i < ps->nsegs && ps->segs[i].audio; i++) {
+		ahead += swift_atomic_load(&ps->segs[i].audio->len);
+	}
+	if (ps->audio && ps->audio == ps->segs[ps->seg_play].audio) {
+		ahead -= ps->cursor.pos;
+	}
+	if (i == ps->nsegs) {
+		if (*pp) {
+			/* Everything is rendered; let the next call have the port */
+			swift_trace(ps, SWIFT_TRACE_CHECKIN, 0);
+			swift_port_checkin(*pp);
+			*pp = NULL;
+		}
+		return 0;
+	}
+	if (ahead >= ps->qsize) {
+		if (*pp && swift_port_queued()) {
+			/* Plenty buffered; someone else needs the port more */
+			swift_trace(ps, SWIFT_TRACE_CHECKIN, 0);
+			swift_port_checkin(*pp);
+			*pp = NULL;
+		}
+		return 0;
+	}
+	seg = &ps->segs[i];
+
+	/* Without a port, look the segment up once.  Then take a port if one
+	 * is free, but queue for one only when there is not a frame left to
+	 * play.  swift_broker is asked once, without waiting, whether it has a
+	 * port free. */
+	dry = eager || swift_bytes_available(ps) < ps->framesize;
+	now = *pp || dry || (ast_strlen_zero(cfg_broker) ? swift_port_available() : i != ps->seg_probed);
+	if (!now && i == ps->seg_looked) {
+		return 0;
+	}
+	ps->seg_looked = i;
+	if ((seg->audio = swift_cache_lookup(ps->format, voice, seg->text)) ||
+		(seg->audio = swift_store_lookup(ps->format, voice, seg->text))) {
+		return 0;
+	}
+	if (!now) {
+		return 0;
+	}
+	if (!(ps->fill = swift_audio_new(ps->format, voice, seg->text))) {
+		return -1;
+	}
+	if ((seg->audio = swift_inflight_join(ps->fill))) {
+		ast_log(LOG_DEBUG, "Sharing synthesis of segment %d already under way\n", i);
+		swift_audio_release(ps->fill);
+		ps->fill = NULL;
+		return 0;
+	}
+	if (!*pp && swift_broker_request(ps, voice, seg->text, priority, dry ? max_wait : 0, &waited,
+		dry ? status : &probed) < 0) {
+		*total_wait += waited;
+		swift_audio_finish(ps->fill, 0);
+		swift_audio_release(ps->fill);
+		ps->fill = NULL;
+		if (!dry) {
+			/* Queue for one when the call runs dry */
+			ps->seg_probed = i;
+			return 0;
+		}
+		return -1;
+	}
+	*total_wait += waited;
+	if (!*pp && !ps->broker) {
+		*pp = swift_port_checkout(voice, ps->format, priority, max_wait, &waited, status);
+		*total_wait += waited;
+		swift_trace(ps, SWIFT_TRACE_PORT, waited);
+		if (!*pp) {
+			swift_audio_finish(ps->fill, 0);
+			swift_audio_release(ps->fill);
+			ps->fill = NULL;
+			return -1;
+		}
+		if (swift_port_attach(*pp, chan, ps)) {
+			swift_port_checkin(*pp);
+			*pp = NULL;
+			swift_audio_finish(ps->fill, 0);
+			swift_audio_release(ps->fill);
+			ps->fill = NULL;
+			*status = "ERROR";
+			return -1;
+		}
+	}
+
+	ps->generating_done = 0;
+	ps->seg_render = i;
+	swift_trim_start(ps, voice);
+	swift_render_start(ps, voice, seg->text);
+	swift_audio_ref(ps->fill);
+	seg->audio = ps->fill;
+	swift_trace(ps, SWIFT_TRACE_SPEAK, i + 1);
+	if (ps->broker ? swift_broker_start(ps) : SWIFT_FAILED(swift_speak(ps, *pp, seg->text, tts_stream))) {
+		ast_log(LOG_ERROR, "Failed to speak.\n");
+		*tts_stream = NULL;
+		ps->generating_done = 1;
+		ps->seg_render = -1;
+		swift_audio_finish(ps->fill, 0);
+		swift_audio_release(ps->fill);
+		ps->fill = NULL;
+		*status = "ERROR";
+		return -1;
+	}
+	return 0;
+}
+
+/*! \brief Copy the text of a prefetch handle (without its prefix) and set
+ * voice to the voice it was rendered in.  NULL if the handle is unknown or
+ * has been reused.
+ */
+static char *swift_prefetch_text(const char *handle, char *voice, size_t size)
+{
+	struct swift_prefetch *slot;
+	unsigned int id = strtoul(handle, NULL, 10);
+	char *text = NULL;
+
+	ast_mutex_lock(&prefetch_lock);
+	slot = &prefetch_handles[id % SWIFT_PREFETCH_HANDLES];
+	if (id && slot->id == id && (text = ast_strdup(slot->text))) {
+		ast_copy_string(voice, slot->voice, size);
+	}
+	ast_mutex_unlock(&prefetch_lock);
+	return text;
+}
+
+/*! \brief Render text into the cache (and prompt store) with no channel
+ * to play it to, split the way Swift() would split it so a call speaking
+ * the same text finds each piece cached or under way.
+ */
+static void swift_prefetch_render(struct swift_prefetch *job)
+{
+	struct swift_pooled_port *pp = NULL;
+	struct swift_segment whole = { .text = job->text };
+	struct swift_segment *segs = &whole;
+	swift_background_t tts_stream = NULL;
+	struct swift_audio *a;
+	const char *status;
+	struct stuff *ps;
+	int i, nsegs = 1, waited;
+
+	if (!(ps = ast_malloc(sizeof(*ps))) || swift_init_stuff(ps)) {
+		ast_free(ps);
+		return;
+	}
+	ps->fill_only = 1;
+	ps->format = job->format;
+	if (cfg_segment_text && (nsegs = swift_split_text(job->text, &ps->seg_buf, &ps->segs)) > 1) {
+		segs = ps->segs;
+	}
+
+	for (i = 0; i < nsegs; i++) {
+		ast_mutex_lock(&prefetch_lock);
+		if (prefetch_shutdown) {
+			ast_mutex_unlock(&prefetch_lock);
+			break;
+		}
+		ast_mutex_unlock(&prefetch_lock);
+
+		if ((a = swift_cache_lookup(job->format, job->voice, segs[i].text)) ||
+			(a = swift_store_lookup(job->format, job->voice, segs[i].text))) {
+			swift_audio_release(a);
+			continue;
+		}
+		if (!(ps->fill = swift_audio_new(job->format, job->voice, segs[i].text))) {
+			break;
+		}
+		if ((a = swift_inflight_join(ps->fill))) {
+			/* A call (or another prefetch) got there first */
+			swift_audio_release(a);
+			swift_audio_release(ps->fill);
+			ps->fill = NULL;
+			continue;
+		}
+		/* Queue behind calls that are waiting to play */
+		if (!pp && !(pp = swift_port_checkout(job->voice, job->format, job->priority - 1, cfg_queue_timeout, &waited, &status))) {
+			ast_log(LOG_NOTICE, "No Swift port to prefetch with (%s)\n", status);
+			break;
+		}
+		if (swift_port_attach(pp, NULL, ps)) {
+			break;
+		}
+		ps->generating_done = 0;
+		swift_trim_start(ps, job->voice);
+		swift_render_start(ps, job->voice, segs[i].text);
+		if (SWIFT_FAILED(swift_speak(ps, pp, segs[i].text, &tts_stream))) {
+			ast_log(LOG_ERROR, "Failed to speak.\n");
+			break;
+		}
+		swift_speak_wait(ps, pp, tts_stream);
+		if (ps->port_unavailable) {
+			/* Leave it to the call that wants it */
+			swift_port_refused(pp);
+			pp = NULL;
+			break;
+		}
+		if (ps->fill && ps->fill->done > 0) {
+			swift_store_add(ps->fill);
+		}
+		swift_audio_release(ps->fill);
+		ps->fill = NULL;
+	}
+
+	if (pp) {
+		swift_port_checkin(pp);
+	}
+	swift_destroy_stuff(ps);
+}
+
+static void swift_prefetch_free(struct swift_prefetch *job)
+{
+	ast_free(job->text);
+	ast_free(job);
+}
+
+static void *swift_prefetch_thread(void *data)
+{
+	struct swift_prefetch *job = data;
+
+	swift_prefetch_render(job);
+	swift_prefetch_free(job);
+
+	ast_mutex_lock(&prefetch_lock);
+	prefetch_threads--;
+	ast_cond_broadcast(&prefetch_cond);
+	ast_mutex_unlock(&prefetch_lock);
+	return NULL;
+}
+
+/*! \brief Warm up the cache with prompts from the preload queue until it
+ * is empty.  Several of these run side by side. */
+static void *swift_preload_thread(void *data)
+{
+	struct swift_prefetch *job;
+
+	for (;;) {
+		ast_mutex_lock(&prefetch_lock);
+		job = prefetch_shutdown ? NULL : AST_LIST_REMOVE_HEAD(&preload_queue, list);
+		if (!job) {
+			preload_workers--;
+			prefetch_threads--;
+			ast_cond_broadcast(&prefetch_cond);
+			ast_mutex_unlock(&prefetch_lock);
+			return NULL;
+		}
+		ast_mutex_unlock(&prefetch_lock);
+
+		swift_prefetch_render(job);
+		swift_prefetch_free(job);
+
+		ast_mutex_lock(&prefetch_lock);
+		preload_rendered++;
+		ast_mutex_unlock(&prefetch_lock);
+	}
+}
+
+/*! \brief Queue every [preload] prompt for warming up and start workers
+ * for them, up to preload_workers at a time.  Prompts already in the
+ * cache or prompt store are skipped quickly.  Returns how many were queued.
+ */
+static int swift_preload_start(void)
+{
+	struct swift_prefetch *entry, *job;
+	pthread_t thread;
+	int queued = 0;
+
+	ast_mutex_lock(&prefetch_lock);
+	if (prefetch_shutdown) {
+		ast_mutex_unlock(&prefetch_lock);
+		return 0;
+	}
+	AST_LIST_TRAVERSE(&preload_list, entry, list) {
+		if (!(job = ast_calloc(1, sizeof(*job))) || !(job->text = ast_strdup(entry->text))) {
+			ast_free(job);
+			break;
+		}
+		ast_copy_string(job->voice, strcasecmp(entry->voice, "default") ? entry->voice : cfg_voice,
+			sizeof(job->voice));
+		job->format = entry->format ? entry->format : swift_format_for_call(NULL);
+		/* Below any call, so live traffic gets the ports first */
+		job->priority = SWIFT_PRELOAD_PRIORITY;
+		AST_LIST_INSERT_TAIL(&preload_queue, job, list);
+		queued++;
+	}
+	while (!AST_LIST_EMPTY(&preload_queue) && preload_workers < cfg_preload_workers) {
+		if (ast_pthread_create_detached(&thread, NULL, swift_preload_thread, NULL)) {
+			ast_log(LOG_WARNING, "Unable to start Swift preload thread\n");
+			break;
+		}
+		preload_workers++;
+		prefetch_threads++;
+	}
+	ast_mutex_unlock(&prefetch_lock);
+
+	if (queued) {
+		ast_log(LOG_NOTICE, "Warming up the Swift cache with %d prompts\n", queued);
+	}
+	return queued;
+}
+
+/*! \brief Forget the [preload] prompts, and any not yet warmed up. */
+static void swift_preload_clear(void)
+{
+	struct swift_prefetch *job;
+
+	ast_mutex_lock(&prefetch_lock);
+	while ((job = AST_LIST_REMOVE_HEAD(&preload_list, list))) {
+		swift_prefetch_free(job);
+	}
+	while ((job = AST_LIST_REMOVE_HEAD(&preload_queue, list))) {
+		swift_prefetch_free(job);
+	}
+	ast_mutex_unlock(&prefetch_lock);
+}
+
+#if !defined _AST_VER_1_4
+/*! \brief Render text for a batch entry on a port of its own, queued
+ * behind every call.  Returns the audio, or NULL if it could not be had.
+ */
+static struct swift_audio *swift_batch_render(struct swift_batch_entry *entry)
+{
+	struct swift_pooled_port *pp;
+	swift_background_t tts_stream = NULL;
+	struct swift_audio *a = NULL;
+	const char *status;
+	struct stuff *ps;
+	int tries, waited;
+
+	if (!(ps = ast_malloc(sizeof(*ps))) || swift_init_stuff(ps)) {
+		ast_free(ps);
+		return NULL;
+	}
+	ps->fill_only = 1;
+	/* Leave the cache to what calls play */
+	ps->no_cache = 1;
+	ps->format = entry->format;
+
+	for (tries = 0; tries < SWIFT_BATCH_TRIES; tries++) {
+		if (!(ps->fill = swift_audio_new(entry->format, entry->voice, entry->text))) {
+			break;
+		}
+		if (!(pp = swift_port_checkout(entry->voice, entry->format, SWIFT_PRELOAD_PRIORITY, SWIFT_BATCH_WAIT, &waited, &status))) {
+			ast_log(LOG_NOTICE, "No Swift port to render with (%s)\n", status);
+			break;
+		}
+		if (swift_port_attach(pp, NULL, ps)) {
+			swift_port_checkin(pp);
+			break;
+		}
+		ps->generating_done = 0;
+		ps->port_unavailable = 0;
+		swift_trim_start(ps, entry->voice);
+		swift_render_start(ps, entry->voice, entry->text);
+		if (SWIFT_FAILED(swift_speak(ps, pp, entry->text, &tts_stream))) {
+			ast_log(LOG_ERROR, "Failed to speak.\n");
+			swift_port_checkin(pp);
+			break;
+		}
+		swift_speak_wait(ps, pp, tts_stream);
+		if (!ps->port_unavailable) {
+			swift_port_checkin(pp);
+			break;
+		}
+		/* The license went to a call; try again when a port comes back */
+		swift_port_refused(pp);
+		swift_audio_finish(ps->fill, 0);
+		swift_audio_release(ps->fill);
+		ps->fill = NULL;
+		swift_port_wait_release(250);
+	}
+
+	if (ps->fill && swift_atomic_load(&ps->fill->done) > 0) {
+		a = ps->fill;
+		ps->fill = NULL;
+	}
+	swift_destroy_stuff(ps);
+	return a;
+}
+
+/*! \brief Write audio out as entry's sound file.  It is written beside
+ * the file and renamed over it, so a call never plays half a prompt.
+ */
+static int swift_batch_write(struct swift_batch_entry *entry, struct swift_audio *a)
+{
+	struct swift_audio_cursor cur = { NULL, };
+	unsigned char buf[SWIFT_CHUNK_SIZE];
+	char tmp[PATH_MAX], *dir;
+	unsigned int n;
+	int fd, res = 0;
+
+	dir = ast_strdupa(entry->output);
+	if (strrchr(dir, '/')) {
+		*strrchr(dir, '/') = '\0';
+		ast_mkdir(dir, 0777);
+	}
+	snprintf(tmp, sizeof(tmp), "%s.tmp", entry->output);
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		ast_log(LOG_WARNING, "Unable to write %s: %s\n", tmp, strerror(errno));
+		return -1;
+	}
+	while (!res && (n = swift_audio_read(a, &cur, buf, sizeof(buf)))) {
+		if (write(fd, buf, n) != n) {
+			ast_log(LOG_WARNING, "Unable to write %s: %s\n", tmp, strerror(errno));
+			res = -1;
+		}
+	}
+	if (close(fd) || res || rename(tmp, entry->output)) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/*! \brief Render one entry of a batch.  Audio the cache or prompt store
+ * already has is used as it is. */
+static int swift_batch_do(struct swift_batch_entry *entry)
+{
+	struct swift_audio *a;
+	int res = 0;
+
+	if (!(a = swift_cache_lookup(entry->format, entry->voice, entry->text)) &&
+		!(a = swift_store_lookup(entry->format, entry->voice, entry->text)) &&
+		!(a = swift_batch_render(entry))) {
+		return -1;
+	}
+	if (entry->output) {
+		res = swift_batch_write(entry, a);
+	} else if ((res = swift_store_add(a))) {
+		ast_log(LOG_WARNING, "Prompt store did not take '%.40s'\n", entry->text);
+	}
+	swift_audio_release(a);
+	return res;
+}
+
+/*! \brief Log how the batch went and close its state file.  Must hold
+ * prefetch_lock, as the last worker out. */
+static void swift_batch_finish_locked(void)
+{
+	struct swift_batch_entry *entry;
+
+	while ((entry = AST_LIST_REMOVE_HEAD(&batch_queue, list))) {
+		ast_free(entry);
+	}
+	if (batch_state) {
+		fclose(batch_state);
+		batch_state = NULL;
+	}
+	batch_end = ast_tvnow();
+	batch_running = 0;
+	ast_log(LOG_NOTICE, "Rendered %u of %u prompts from %s in %ld s (%u unchanged, %u failed)\n",
+		batch_rendered, batch_total, batch_manifest, (long) ast_tvdiff_ms(batch_end, batch_start) / 1000,
+		batch_unchanged, batch_failed);
+}
+
+static void *swift_batch_thread(void *data)
+{
+	struct swift_batch_entry *entry;
+	int res;
+
+	for (;;) {
+		ast_mutex_lock(&prefetch_lock);
+		entry = prefetch_shutdown ? NULL : AST_LIST_REMOVE_HEAD(&batch_queue, list);
+		if (!entry) {
+			if (!--batch_workers) {
+				swift_batch_finish_locked();
+			}
+			prefetch_threads--;
+			ast_cond_broadcast(&prefetch_cond);
+			ast_mutex_unlock(&prefetch_lock);
+			return NULL;
+		}
+		ast_mutex_unlock(&prefetch_lock);
+
+		res = swift_batch_do(entry);
+
+		ast_mutex_lock(&prefetch_lock);
+		if (res) {
+			batch_failed++;
+		} else {
+			batch_rendered++;
+			if (entry->output && batch_state) {
+				fprintf(batch_state, "%08x %s\n", entry->hash, entry->output);
+				fflush(batch_state);
+			}
+		}
+		ast_mutex_unlock(&prefetch_lock);
+		ast_free(entry);
+	}
+}
+
+/*! \brief A sound file as of the last batch. */
+struct swift_batch_done {
+	unsigned int hash;
+	size_t line;
+	char *output;
+};
+
+static int swift_batch_done_cmp(const void *a, const void *b)
+{
+	const struct swift_batch_done *x = a, *y = b;
+	int res = strcmp(x->output, y->output);
+
+	return res ? res : (x->line > y->line) - (x->line < y->line);
+}
+
+static int swift_batch_output_cmp(const void *key, const void *b)
+{
+	return strcmp(key, ((const struct swift_batch_done *) b)->output);
+}
+
+/*! \brief Read the state file of the last batch into a sorted array. */
+static struct swift_batch_done *swift_batch_load_state(const char *path, size_t *count)
+{
+	struct swift_batch_done *done = NULL, *grown;
+	size_t size = 0;
+	char line[PATH_MAX + 16], *output;
+	unsigned int hash;
+	FILE *f;
+
+	*count = 0;
+	if (!(f = fopen(path, "r"))) {
+		return NULL;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%8x", &hash) != 1 || !(output = strchr(line, ' '))) {
+			continue;
+		}
+		output = ast_strip(output);
+		if (*count == size) {
+			size = size ? size * 2 : 256;
+			if (!(grown = ast_realloc(done, size * sizeof(*done)))) {
+				break;
+			}
+			done = grown;
+		}
+		if (!(done[*count].output = ast_strdup(output))) {
+			break;
+		}
+		done[*count].line = *count;
+		done[(*count)++].hash = hash;
+	}
+	fclose(f);
+	if (*count) {
+		/* A file rendered again later is listed again; the last one counts */
+		qsort(done, *count, sizeof(*done), swift_batch_done_cmp);
+	}
+	return done;
+}
+
+/*! \brief Whether output was last rendered from what hashes to hash. */
+static int swift_batch_unchanged(struct swift_batch_done *done, size_t count, const char *output, unsigned int hash)
+{
+	struct swift_batch_done *found;
+	struct stat st;
+
+	if (!done || !(found = bsearch(output, done, count, sizeof(*done), swift_batch_output_cmp))) {
+		return 0;
+	}
+	/* Duplicates sort together, in the order they were written */
+	while (found + 1 < done + count && !strcmp(found[1].output, output)) {
+		found++;
+	}
+	return found->hash == hash && !stat(output, &st);
+}
+
+/*! \brief Read a manifest and start rendering what has changed in it.
+ * Each line is output|voice[/format]|text.  Returns the number of
+ * prompts queued, or -1.
+ */
+static int swift_batch_start(int fd, const char *manifest, int workers)
+{
+	struct swift_batch_entry *entry;
+	struct swift_batch_done *done;
+	const struct swift_format *fmt;
+	char line[4096], path[PATH_MAX], state[PATH_MAX], tmp[PATH_MAX + 8];
+	char *output, *voice, *text, *p;
+	size_t ndone, i;
+	int lineno = 0, queued = 0;
+	pthread_t thread;
+	FILE *f, *out;
+
+	ast_mutex_lock(&prefetch_lock);
+	if (batch_running || prefetch_shutdown) {
+		ast_mutex_unlock(&prefetch_lock);
+		ast_cli(fd, "A batch is already rendering\n");
+		return -1;
+	}
+	batch_running = 1;
+	ast_mutex_unlock(&prefetch_lock);
+
+	if (!(f = fopen(manifest, "r"))) {
+		ast_cli(fd, "Unable to read %s: %s\n", manifest, strerror(errno));
+		ast_mutex_lock(&prefetch_lock);
+		batch_running = 0;
+		ast_mutex_unlock(&prefetch_lock);
+		return -1;
+	}
+	snprintf(state, sizeof(state), "%s%s", manifest, SWIFT_BATCH_STATE);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", state);
+	done = swift_batch_load_state(state, &ndone);
+	out = fopen(tmp, "w");
+
+	ast_mutex_lock(&prefetch_lock);
+	ast_copy_string(batch_manifest, manifest, sizeof(batch_manifest));
+	batch_start = ast_tvnow();
+	batch_total = batch_rendered = batch_unchanged = batch_failed = 0;
+	ast_mutex_unlock(&prefetch_lock);
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		p = ast_strip(line);
+		if (ast_strlen_zero(p) || *p == ';' || *p == '#') {
+			continue;
+		}
+		output = ast_strip(strsep(&p, "|"));
+		voice = p ? ast_strip(strsep(&p, "|")) : NULL;
+		text = p ? ast_strip(p) : NULL;
+		if (ast_strlen_zero(output) || ast_strlen_zero(voice) || ast_strlen_zero(text)) {
+			ast_log(LOG_WARNING, "Line %d of %s is not output|voice|text\n", lineno, manifest);
+			continue;
+		}
+		fmt = swift_format_for_call(NULL);
+		if ((p = strchr(voice, '/'))) {
+			*p++ = '\0';
+			if (!(fmt = swift_format_by_name(p))) {
+				ast_log(LOG_WARNING, "Unknown format '%s' on line %d of %s\n", p, lineno, manifest);
+				continue;
+			}
+		}
+		if (!strcasecmp(voice, "default")) {
+			voice = cfg_voice;
+		}
+		path[0] = '\0';
+		if (!strcmp(output, "-") && swift_atomic_load(&store_fd) < 0) {
+			ast_log(LOG_WARNING, "Line %d of %s is for the prompt store, but none is open\n", lineno, manifest);
+			continue;
+		}
+		if (strcmp(output, "-")) {
+			snprintf(path, sizeof(path), "%s%s%s.%s", *output == '/' ? "" : ast_config_AST_DATA_DIR,
+				*output == '/' ? "" : "/sounds/", output, fmt->ext);
+		}
+		if (!(entry = ast_calloc(1, sizeof(*entry) + strlen(text) + 1 + strlen(path) + 1))) {
+			break;
+		}
+		strcpy(entry->text, text);
+		ast_copy_string(entry->voice, voice, sizeof(entry->voice));
+		entry->format = fmt;
+		entry->hash = swift_audio_hash(fmt->params, entry->voice, text);
+		if (strcmp(output, "-")) {
+			entry->output = entry->text + strlen(text) + 1;
+			strcpy(entry->output, path);
+		}
+
+		ast_mutex_lock(&prefetch_lock);
+		batch_total++;
+		if (entry->output && swift_batch_unchanged(done, ndone, entry->output, entry->hash)) {
+			batch_unchanged++;
+			if (out) {
+				fprintf(out, "%08x %s\n", entry->hash, entry->output);
+			}
+			ast_free(entry);
+		} else {
+			AST_LIST_INSERT_TAIL(&batch_queue, entry, list);
+			queued++;
+		}
+		ast_mutex_unlock(&prefetch_lock);
+	}
+	fclose(f);
+	for (i = 0; i < ndone; i++) {
+		ast_free(done[i].output);
+	}
+	ast_free(done);
+
+	/* Start the state over with what is still current, and add to it as
+	 * prompts are rendered */
+	if (out && (fclose(out) || rename(tmp, state))) {
+		unlink(tmp);
+		out = NULL;
+	}
+	ast_mutex_lock(&prefetch_lock);
+	if (!(batch_state = fopen(state, "a"))) {
+		ast_log(LOG_WARNING, "Unable to write %s: %s; everything will be rendered again next time\n",
+			state, strerror(errno));
+	}
+	batch_workers = 0;
+	while (batch_workers < workers && batch_workers < queued && prefetch_threads < SWIFT_PREFETCH_THREADS) {
+		if (ast_pthread_create_detached(&thread, NULL, swift_batch_thread, NULL)) {
+			ast_log(LOG_WARNING, "Unable to start Swift render thread\n");
+			break;
+		}
+		batch_workers++;
+		prefetch_threads++;
+	}
+	if (!batch_workers) {
+		swift_batch_finish_locked();
+	}
+	ast_mutex_unlock(&prefetch_lock);
+	return queued;
+}
+#endif
+
+static void *swift_generator_alloc(struct ast_channel *chan, void *params)
+{
+	return params;
+}
+
+static void swift_generator_release(struct ast_channel *chan, void *data)
+{
+	/* The stuff belongs to app_exec() */
+}
+
+/*! \brief Count the time from Swift() to its first frame of audio. */
+static void swift_stats_ttfa(struct stuff *ps)
+{
+	unsigned int ms = ast_tvdiff_ms(ast_tvnow(), ps->start), i;
+
+	for (i = 0; i < ARRAY_LEN(swift_ttfa_bounds) && ms >= swift_ttfa_bounds[i]; i++) {
+	}
+	swift_stat_add(ps->cached ? &stats.ttfa_cached[i] : &stats.ttfa_rendered[i], 1);
+	swift_stat_add(&stats.ttfa_ms, ms);
+}
+
+/*! \brief Fill in the parts of the frame that stay the same for the
+ * whole of playback. */
+static void swift_frame_init(struct stuff *ps)
+{
+	memset(&ps->f, 0, sizeof(ps->f));
+	ps->f.frametype = AST_FRAME_VOICE;
+#if (defined _AST_VER_1_6 || defined _AST_VER_1_4)
+	ps->f.subclass = ps->format->format;
+#elif defined _AST_VER_1_8 
+	ps->f.subclass.codec = ps->format->format;
+#elif (defined _AST_VER_10 || defined _AST_VER_11 || defined _AST_VER_12)
+	ast_format_set(&ps->f.subclass.format, ps->format->format, 0);
+#elif (defined _AST_VER_13)
+	ps->f.subclass.format = *ps->format->format;
+#endif
+	ps->f.mallocd = 0;
+	ps->f.offset = AST_FRIENDLY_OFFSET;
+	ps->f.src = __PRETTY_FUNCTION__;
+}
+
+/*! \brief Work out how much playback of text in voice should buffer
+ * before it starts. */
+static void swift_prebuffer_start(struct stuff *ps, const char *voice, const char *text)
+{
+	struct swift_voice_stats *vs;
+	unsigned int per_ms = ps->format->samplerate / 1000 * ps->format->bytes;
+	double speed = 1, ms_per_char = 0, gap_ms = SWIFT_PREBUFFER_MS;
+
+	ast_mutex_lock(&voice_lock);
+	if ((vs = swift_voice_stats_locked(voice)) && vs->renders) {
+		speed = vs->speed;
+		ms_per_char = vs->ms_per_char;
+		gap_ms = vs->gap_ms;
+	}
+	ast_mutex_unlock(&voice_lock);
+
+	ps->buffering = 1;
+	ps->played = 0;
+	ps->pb_speed = speed;
+	ps->pb_gap = gap_ms * per_ms;
+	ps->pb_max = cfg_max_prebuffer * per_ms;
+	ps->expected = ms_per_char * strlen(text) * per_ms;
+}
+
+/*! \brief Whether avail bytes will play through without running dry.
+ * They have to last out the engine's longest pause between pieces of
+ * audio and, for a voice slower than realtime, the shortfall while it
+ * renders the rest: that takes left / speed to render and left to play.
+ */
+static int swift_prebuffered(struct stuff *ps, unsigned int avail)
+{
+	double need = ps->framesize + ps->pb_gap;
+	double left = (double) ps->expected - ps->played - avail;
+
+	if (swift_audio_complete(ps)) {
+		return 1;
+	}
+	if (left > 0 && ps->pb_speed < 1) {
+		need += left * (1 / ps->pb_speed - 1);
+	}
+	return avail >= need || avail >= ps->pb_max;
+}
+
+/*! \brief Called from the channel's frame clock for every samples it
+ * plays.  Sends the audio in frames of the configured duration, so the
+ * channel's own packetization does not dictate ours.
+ *
+ * Frames from our own queue point straight into its chunks, which are not
+ * given back until the write returns.  Only frames that straddle a chunk,
+ * or leave no room for a header in front, are copied into frdata.
+ */
+static int swift_generator_generate(struct ast_channel *chan, void *data, int len, int samples)
+{
+	struct stuff *ps = data;
+	unsigned int avail, n;
+	unsigned char *frame;
+	int in_place;
+
+	if (swift_atomic_load(&ps->immediate_exit)) {
+		return -1;
+	}
+	if (ps->buffering) {
+		if (!swift_prebuffered(ps, swift_bytes_available(ps))) {
+			return 0;
+		}
+		ps->buffering = 0;
+		if (!ast_tvzero(ps->starved_at)) {
+			swift_stat_add(&stats.starved_us, swift_tvdiff_us(ast_tvnow(), ps->starved_at));
+			ps->starved_at = ast_tv(0, 0);
+		}
+	}
+
+	ps->owed += samples * ps->format->bytes;
+	while (ps->owed >= ps->framesize) {
+		/* Send whole frames, unless this is the last of the audio */
+		avail = swift_bytes_available(ps);
+		if (avail < ps->framesize && !(avail > 0 && swift_audio_complete(ps))) {
+			/* Starved.  Rather than play each piece as it trickles in,
+			 * buffer up again, and do not catch up in a burst later. */
+			ps->owed = 0;
+			ps->buffering = 1;
+			ps->starved_at = ast_tvnow();
+			swift_trace(ps, SWIFT_TRACE_STARVED, avail);
+			swift_stat_add(&stats.starved, 1);
+			break;
+		}
+		n = avail < ps->framesize ? avail : ps->framesize;
+		if (!(in_place = swift_queue_peek(ps, n, &frame))) {
+			n = swift_queue_read(ps, ps->frdata, n);
+			frame = ps->frdata;
+		}
+
+		ps->f.datalen = n;
+		ps->f.samples = n / ps->format->bytes;
+#if defined _AST_VER_1_4
+		ps->f.data = frame;
+#else
+		ps->f.data.ptr = frame;
+#endif
+
+		if (ast_write(chan, &ps->f) < 0) {
+			swift_trace(ps, SWIFT_TRACE_WRITE_FAIL, n);
+		}
+		swift_trace(ps, in_place ? SWIFT_TRACE_FRAME : SWIFT_TRACE_FRAME_COPY, n);
+		swift_stat_add(&stats.frames_written, 1);
+		if (!ps->first_frame_sent) {
+			ps->first_frame_sent = 1;
+			swift_stats_ttfa(ps);
+		}
+		if (in_place) {
+			swift_queue_consume(ps, n);
+		}
+
+		ps->played += n;
+		ps->owed = ps->owed > n ? ps->owed - n : 0;
+	}
+	return 0;
+}
+
+static struct ast_generator swift_generator = {
+	.alloc = swift_generator_alloc,
+	.release = swift_generator_release,
+	.generate = swift_generator_generate,
+};
+
+static int dtmf_conv(int dtmf)
+{
+	char *res = (char *) malloc(100);
+	int dtmf_search_counter = 0, dtmf_search_match = 0;
+
+	memset(res, 0, 100);
+
+	while ((dtmf_search_counter < dtmf_codes) && (dtmf_search_match == 0)) {
+		if (dtmf == ast_dtmf_table[dtmf_search_counter].ast_res) {
+			dtmf_search_match += 1;
+			sprintf(res, "%s", ast_dtmf_table[dtmf_search_counter].dtmf_res);
+		}
+		dtmf_search_counter = dtmf_search_counter + 1;
+	}
+	return *res;
+}
+
+static char *listen_for_dtmf(struct ast_channel *chan, int timeout, int max_digits)
+{
+	char *dtmf_conversion = (char *) malloc(100);
+	char cnv[2];
+	int dtmf = 0, i = 0;
+
+	memset(dtmf_conversion, 0, 100);
+	memset(cnv, 0, 2);
+
+	while (i < max_digits) {
+		dtmf = ast_waitfordigit(chan, timeout);
+
+		if (!dtmf) {
+			break;
+		}
+
+		sprintf(cnv, "%c", dtmf_conv(dtmf));
+		strcat(dtmf_conversion, cnv);
+		i += 1;
+	}
+	return strdup(dtmf_conversion);
+}
+
+/*! \brief Speak text, or with template set a template whose fixed parts
+ * are rendered (and cached) apart from its [variable] slots.
+ */
+static int swift_exec(struct ast_channel *chan, const char *data, int template)
+{
+	int res = 0, max_digits = 0, timeout = 0, alreadyran = 0;
+	int ms;
+	int priority = 0, max_wait = cfg_queue_timeout, waited = 0, total_wait = 0, format_set = 0;
+	int ptime = cfg_ptime, framesize;
+	const char *status = "SUCCESS";
+	char waited_str[16];
+	struct timeval queue_start;
+	char *argv[3], *text = NULL, *rc = NULL, *template_buf = NULL, *handle_text = NULL;
+	char tmp_exten[2], results[20], voice_name[sizeof(cfg_voice)];
+	struct ast_module_user *u;
+	struct ast_frame *f;
+	struct timeval next;
+	struct stuff *ps;
+	char *parse;
+#if (defined _AST_VER_10 || defined _AST_VER_11 || defined _AST_VER_12)
+	struct ast_format old_writeformat;
+#elif (defined _AST_VER_13)
+	RAII_VAR(struct ast_format *, old_writeformat, NULL, ao2_cleanup);
+#else
+	int old_writeformat = 0;
+#endif
+	parse = ast_strdupa(data);
+
+	AST_DECLARE_APP_ARGS(args,
+		AST_APP_ARG(text);
+		AST_APP_ARG(timeout);
+		AST_APP_ARG(max_digits);
+	);
+
+	AST_STANDARD_APP_ARGS(args, parse);
+
+	struct swift_pooled_port *pp = NULL;
+	swift_background_t tts_stream = NULL;
+	const char *vvoice = NULL, *val;
+
+	memset(results, 0 ,20);
+	memset(tmp_exten, 0, 2);
+	memset(argv, 0, 3);
+
+	u = ast_module_user_add(chan);
+
+	if (!ast_strlen_zero(args.timeout)) {
+		timeout = strtol(args.timeout, NULL, 0);
+	}
+	if (!ast_strlen_zero(args.max_digits)) {
+		max_digits = strtol(args.max_digits, NULL, 0);
+	}
+	text = args.text;
+
+	if (ast_strlen_zero(text)) {
+		ast_log(LOG_WARNING, "%s requires text to speak!\n", template ? template_app : app);
+		return -1;
+	}else{
+		ast_log(LOG_DEBUG, "Text to Speak : %s\n", text);
+	}
+	if (timeout > 0) {
+		ast_log(LOG_DEBUG, "Timeout : %d\n", timeout);
+	}
+	if (max_digits > 0) {
+		ast_log(LOG_DEBUG, "Max Digits : %d\n", max_digits);
+	}
+
+	if (!(ps = ast_malloc(sizeof(*ps)))) {
+		ast_module_user_remove(u);
+		return -1;
+	}
+	if (swift_init_stuff(ps)) {
+		ast_free(ps);
+		ast_module_user_remove(u);
+		return -1;
+	}
+	ps->start = ast_tvnow();
+	swift_trace_begin(ps, chan);
+	ast_atomic_fetchadd_int(&stats.calls, 1);
+	swift_stat_add(&stats.calls_total, 1);
+
+	/* Setup synthesis */
+
+	ast_copy_string(voice_name, cfg_voice, sizeof(voice_name));
+	ast_log(LOG_DEBUG, "Config voice is %s via %s\n", voice_name, SWIFT_CONFIG_FILE);
+
+	/* allow exten => x,n,Set(SWIFT_VOICE=Callie) */
+	if ((vvoice = pbx_builtin_getvar_helper(chan, "SWIFT_VOICE"))) {
+		ast_copy_string(voice_name, vvoice, sizeof(voice_name));
+		ast_log(LOG_DEBUG, "Config voice override to %s via SWIFT_VOICE\n", voice_name);
+	}
+
+	if ((val = pbx_builtin_getvar_helper(chan, "SWIFT_PRIORITY"))) {
+		priority = atoi(val);
+	}
+	if ((val = pbx_builtin_getvar_helper(chan, "SWIFT_QUEUE_TIMEOUT"))) {
+		max_wait = atoi(val);
+	}
+	if ((val = pbx_builtin_getvar_helper(chan, "SWIFT_PTIME"))) {
+		ptime = atoi(val);
+	}
+	ps->format = swift_format_for_call(chan);
+	ast_log(LOG_DEBUG, "Rendering %s audio\n", ps->format->name);
+#if (defined _AST_VER_13)
+	if (!ptime) {
+		/* Match the packetization negotiated for the channel */
+		ptime = ast_format_cap_get_format_framing(ast_channel_nativeformats(chan), *ps->format->format);
+	}
+#endif
+	if (ptime < 10 || ptime > SWIFT_MAX_PTIME) {
+		if (ptime) {
+			ast_log(LOG_WARNING, "Frame duration of %dms is not supported, using 20ms\n", ptime);
+		}
+		ptime = 20;
+	}
+	framesize = ptime * ps->format->samplerate / 1000 * ps->format->bytes;
+	queue_start = ast_tvnow();
+
+	/* Swift(${handle}) speaks what SWIFT_PREFETCH() was given */
+	if (!strncmp(text, SWIFT_PREFETCH_PREFIX, strlen(SWIFT_PREFETCH_PREFIX))) {
+		if (!(handle_text = swift_prefetch_text(text + strlen(SWIFT_PREFETCH_PREFIX), voice_name, sizeof(voice_name)))) {
+			ast_log(LOG_WARNING, "Unknown or expired Swift prefetch handle '%s'\n", text);
+			status = "ERROR";
+			goto fallback;
+		}
+		text = handle_text;
+	}
+
+	if (template) {
+		if ((ps->nsegs = swift_split_template(text, &ps->seg_buf, &ps->segs)) < 1) {
+			ast_log(LOG_WARNING, "%s requires text to speak!\n", template_app);
+			ps->nsegs = 0;
+			status = "ERROR";
+			goto fallback;
+		}
+		if (ps->nsegs == 1) {
+			/* Nothing to stitch together; speak it like any other text */
+			text = (char *) ps->segs[0].text;
+			template_buf = ps->seg_buf;
+			ast_free(ps->segs);
+			ps->segs = NULL;
+			ps->seg_buf = NULL;
+			ps->nsegs = 0;
+		} else {
+			ast_log(LOG_DEBUG, "Speaking template in %d parts\n", ps->nsegs);
+		}
+	}
+
+	/* A prompt we have rendered before plays straight from memory */
+	if (!ps->nsegs && ((ps->audio = swift_cache_lookup(ps->format, voice_name, text)) ||
+		(ps->audio = swift_store_lookup(ps->format, voice_name, text)))) {
+		ast_log(LOG_DEBUG, "Playing %u cached bytes\n", ps->audio->len);
+		ps->generating_done = 1;
+		ps->cached = 1;
+		swift_trace(ps, SWIFT_TRACE_START, 1);
+		goto play;
+	}
+	swift_trace(ps, SWIFT_TRACE_START, 0);
+
+	/* Longer text is rendered a sentence at a time, so playback starts as
+	 * soon as the first one is ready and the rest follows behind it. */
+	if (ps->nsegs || (cfg_segment_text &&
+		(ps->nsegs = swift_split_text(text, &ps->seg_buf, &ps->segs)) > 1)) {
+		ast_log(LOG_DEBUG, "Speaking text in %d segments\n", ps->nsegs);
+		ps->fill_only = 1;
+		ps->generating_done = 1;
+		ps->seg_render = -1;
+		ps->seg_looked = -1;
+		ps->seg_probed = -1;
+		if (swift_segments_schedule(ps, chan, &pp, &tts_stream, voice_name, priority, max_wait, 1,
+			&total_wait, &status) < 0) {
+			ast_log(LOG_ERROR, "Failed to get a Swift Port.\n");
+			goto fallback;
+		}
+		goto play;
+	}
+	ps->nsegs = 0;
+
+speak:
+	/* A fresh rendering is shared with identical requests that come in
+	 * meanwhile, and cached once it completes.  If one is already under
+	 * way, play along with it instead of using a port of our own. */
+	if (!ps->fill && !ps->skip && (ps->fill = swift_audio_new(ps->format, voice_name, text)) &&
+		(ps->audio = swift_inflight_join(ps->fill))) {
+		ast_log(LOG_DEBUG, "Sharing synthesis already under way for the same text\n");
+		swift_audio_release(ps->fill);
+		ps->fill = NULL;
+		ps->generating_done = 1;
+		goto play;
+	}
+	/* swift_broker renders it if one is set and answering */
+	if (swift_broker_request(ps, voice_name, text, priority, max_wait, &waited, &status) < 0) {
+		total_wait += waited;
+		goto fallback;
+	}
+	total_wait += waited;
+	if (!ps->broker) {
+		pp = swift_port_checkout(voice_name, ps->format, priority, max_wait, &waited, &status);
+		total_wait += waited;
+		swift_trace(ps, SWIFT_TRACE_PORT, waited);
+		if (pp == NULL) {
+			ast_log(LOG_ERROR, "Failed to get a Swift Port.\n");
+			goto fallback;
+		}
+		if (waited) {
+			ast_log(LOG_NOTICE, "Waited %dms in queue for a Swift port\n", waited);
+		}
+		if (swift_port_attach(pp, chan, ps)) {
+			status = "ERROR";
+			goto fallback;
+		}
+	}
+
+	swift_trim_start(ps, voice_name);
+	swift_render_start(ps, voice_name, text);
+	swift_trace(ps, SWIFT_TRACE_SPEAK, 0);
+	if (ps->broker) {
+		if (swift_broker_start(ps)) {
+			status = "ERROR";
+			goto fallback;
+		}
+	} else if (SWIFT_FAILED(swift_speak(ps, pp, text, &tts_stream))) {
+		ast_log(LOG_ERROR, "Failed to speak.\n");
+		tts_stream = NULL;
+		status = "ERROR";
+		goto fallback;
+	}
+
+play:
+	/* Only the first attempt needs the channel set up */
+	if (!format_set) {
+#if (defined _AST_VER_11 || defined _AST_VER_12 || defined _AST_VER_13)
+		if (ast_channel_state(chan) != AST_STATE_UP) {
+#else
+		if (chan->_state != AST_STATE_UP) {
+#endif
+			ast_answer(chan);
+		}
+
+		ast_stopstream(chan);
+
+#if (defined _AST_VER_1_4 || defined _AST_VER_1_6 || defined _AST_VER_1_8)
+		old_writeformat = chan->writeformat;
+
+		if (ast_set_write_format(chan, ps->format->format) < 0) {
+#elif (defined _AST_VER_10)
+		ast_format_copy(&old_writeformat, &chan->writeformat);
+
+		if (ast_set_write_format_by_id(chan, ps->format->format) < 0) {
+#elif (defined _AST_VER_11 || defined _AST_VER_12)
+		ast_format_copy(&old_writeformat, ast_channel_writeformat(chan));
+
+		if (ast_set_write_format_by_id(chan, ps->format->format) < 0) {
+#elif (defined _AST_VER_13)
+		old_writeformat = ao2_bump(ast_channel_writeformat(chan));
+
+		if (ast_set_write_format(chan, *ps->format->format) < 0) {
+#endif
+			ast_log(LOG_WARNING, "Unable to set write format.\n");
+			status = "ERROR";
+			goto exception;
+		}
+		format_set = 1;
+	}
+
+	res = 0;
+
+	/* Buffer as much as this voice needs to play through without running
+	 * dry (cached audio can start right away), then let the channel's
+	 * frame clock pull audio through the generator while we handle hangup
+	 * and DTMF here.
+	 */
+	ps->framesize = framesize;
+	ps->owed = 0;
+	swift_frame_init(ps);
+	swift_prebuffer_start(ps, voice_name, text);
+	if (ast_activate_generator(chan, &swift_generator, ps) < 0) {
+		ast_log(LOG_WARNING, "Unable to start Swift playback generator\n");
+		status = "ERROR";
+		goto exception;
+	}
+
+	while (swift_generator_running(ps)) {
+		ms = ast_waitfor(chan, 100);
+
+		if (ms < 0) {
+			ast_log(LOG_DEBUG, "Hangup detected\n");
+			res = -1;
+			swift_cancel_stuff(ps);
+		} else if (ms) {
+			f = ast_read(chan);
+
+			if (!f) {
+				ast_log(LOG_DEBUG, "Null frame == hangup() detected\n");
+				res = -1;
+				swift_cancel_stuff(ps);
+			} else {
+				if (f->frametype == AST_FRAME_DTMF && timeout > 0 && max_digits > 0) {
+#if (defined _AST_VER_1_6 || defined _AST_VER_1_4)
+					char originalDTMF = f->subclass;
+#elif (defined _AST_VER_1_8 || defined _AST_VER_10 || defined _AST_VER_11 || defined _AST_VER_12 || defined _AST_VER_13)
+					char originalDTMF = f->subclass.integer;
+#endif
+					alreadyran = 1;
+					res = 0;
+					swift_cancel_stuff(ps);
+					if (pp) {
+						/* Free the port before anything else, and before
+						 * waiting on more digits */
+						swift_stop_synthesis(ps, pp, tts_stream);
+						pp = NULL;
+					} else if (ps->broker) {
+						swift_broker_stop(ps);
+					}
+					ast_deactivate_generator(chan);
+
+					if (max_digits > 1) {
+						rc = listen_for_dtmf(chan, timeout, max_digits - 1);
+					}
+
+					if (rc) {
+						sprintf(results, "%c%s", originalDTMF, rc);
+					} else {
+						sprintf(results, "%c", originalDTMF);
+					}
+
+					ast_log(LOG_NOTICE, "DTMF = %s\n", results);
+					pbx_builtin_setvar_helper(chan, "SWIFT_DTMF", results);
+				}
+
+				if (f!=NULL) {
+					ast_frfree(f);
+				}
+			}
+		}
+
+		if (ps->broker && ps->immediate_exit) {
+			swift_broker_stop(ps);
+		}
+		if (pp && ps->immediate_exit) {
+			swift_stop_synthesis(ps, pp, tts_stream);
+			pp = NULL;
+		} else if (ps->segs) {
+			/* Each starved segment may queue for up to max_wait again */
+			if (!ps->immediate_exit && swift_segments_schedule(ps, chan, &pp, &tts_stream, voice_name, priority,
+				max_wait, 0, &total_wait, &status) < 0) {
+				swift_cancel_stuff(ps);
+			}
+		} else if (pp && swift_atomic_load(&ps->generating_done) && !ps->port_unavailable) {
+			/* Synthesis is over and the rest plays from the queue, so
+			 * let the next call have the port (and its license) now. */
+			swift_speak_wait(ps, pp, tts_stream);
+			swift_trace(ps, SWIFT_TRACE_CHECKIN, 0);
+			swift_port_checkin(pp);
+			pp = NULL;
+		} else if (ps->broker && swift_atomic_load(&ps->generating_done)) {
+			/* Done; the broker has given its port to the next call */
+			swift_broker_stop(ps);
+		}
+	}
+	ast_deactivate_generator(chan);
+
+	if (ps->segs) {
+		if ((pp || ps->broker) && !ps->immediate_exit) {
+			swift_segments_collect(ps, &pp, tts_stream);
+		}
+		goto fallback;
+	}
+	if (ps->broker) {
+		swift_broker_stop(ps);
+	}
+
+	if (ps->audio && swift_atomic_load(&ps->audio->done) < 0 && !ps->immediate_exit) {
+		/* The call we shared a synthesis with gave up on it.  Render the
+		 * text ourselves, skipping the part already played. */
+		ast_log(LOG_DEBUG, "Shared synthesis abandoned after %u bytes, taking over\n", ps->cursor.pos);
+		ps->skip = ps->cursor.pos;
+		swift_audio_release(ps->audio);
+		ps->audio = NULL;
+		memset(&ps->cursor, 0, sizeof(ps->cursor));
+		ps->generating_done = 0;
+		goto speak;
+	}
+
+	if (ps->fill && swift_atomic_load(&ps->generating_done) && !ps->port_unavailable) {
+		swift_store_add(ps->fill);
+	}
+
+	if (ps->port_unavailable && !ps->immediate_exit) {
+		/* The engine refused the port (the license is in use elsewhere).
+		 * Give it back and queue again for whatever is left of max_wait.
+		 */
+		swift_speak_stop(ps, pp, tts_stream);
+		swift_port_refused(pp);
+		pp = NULL;
+		tts_stream = NULL;
+
+		ms = max_wait - ast_tvdiff_ms(ast_tvnow(), queue_start);
+		if (ms > 0) {
+			if (cfg_max_ports) {
+				/* More are allowed than licensed, so checkout would not
+				 * queue; wait for a port to come back first */
+				next = ast_tvnow();
+				swift_port_wait_release(ms < 250 ? ms : 250);
+				total_wait += ast_tvdiff_ms(ast_tvnow(), next);
+			}
+			/* Otherwise checkout queues, by priority, within what is left */
+			max_wait -= ast_tvdiff_ms(ast_tvnow(), queue_start);
+			queue_start = ast_tvnow();
+
+			/* Nothing else touches the queue now the port is back */
+			ps->generating_done = 0;
+			ps->port_unavailable = 0;
+			if (ps->fill && ps->fill->len) {
+				/* Anyone sharing it picks up from here */
+				swift_audio_finish(ps->fill, 0);
+				swift_audio_release(ps->fill);
+				ps->fill = NULL;
+			}
+			if (swift_queue_reset(ps)) {
+				status = "ERROR";
+				goto fallback;
+			}
+			goto speak;
+		}
+		ast_log(LOG_WARNING, "No Swift port became available in time\n");
+		status = "TIMEOUT";
+	}
+
+fallback:
+	snprintf(waited_str, sizeof(waited_str), "%d", total_wait);
+	pbx_builtin_setvar_helper(chan, "SWIFT_QUEUE_WAIT", waited_str);
+	pbx_builtin_setvar_helper(chan, "SWIFT_STATUS", status);
+
+	/* Without a port we still collect digits if asked to, so the
+	 * dialplan can carry on (or play a recording based on SWIFT_STATUS).
+	 */
+	if (!format_set && timeout > 0 && max_digits > 0) {
+#if (defined _AST_VER_11 || defined _AST_VER_12 || defined _AST_VER_13)
+		if (ast_channel_state(chan) != AST_STATE_UP) {
+#else
+		if (chan->_state != AST_STATE_UP) {
+#endif
+			ast_answer(chan);
+		}
+	}
+
+	if (alreadyran == 0 && timeout > 0 && max_digits > 0) {
+		rc = listen_for_dtmf(chan, timeout, max_digits);
+
+		if (rc != NULL) {
+			sprintf(results, "%s", rc);
+			ast_log(LOG_NOTICE, "DTMF = %s\n", results);
+			pbx_builtin_setvar_helper(chan, "SWIFT_DTMF", results);
+		}
+	}
+	if (max_digits >= 1 && results != NULL) {
+		if (cfg_goto_exten) {
+#if (defined _AST_VER_11 || defined _AST_VER_12 || defined _AST_VER_13)
+			ast_log(LOG_NOTICE, "GoTo(%s|%s|%d) : ", ast_channel_context(chan), results, 1);
+#else
+			ast_log(LOG_NOTICE, "GoTo(%s|%s|%d) : ", chan->context, results, 1);
+#endif
+
+#if (defined _AST_VER_1_6 || defined _AST_VER_1_4)
+			if (ast_exists_extension (chan, chan->context, results, 1, chan->cid.cid_num)) {
+#elif (defined _AST_VER_1_8 || defined _AST_VER_10)
+			 if (ast_exists_extension (chan, chan->context, results, 1, chan->caller.id.number.str)) {
+#elif (defined _AST_VER_11 || defined _AST_VER_12 || defined _AST_VER_13)
+			 if (ast_exists_extension (chan, ast_channel_context(chan), results, 1, ast_channel_caller(chan)->id.number.str)) {
+#endif
+				ast_log(LOG_NOTICE, "OK\n");
+#if (defined _AST_VER_11 || defined _AST_VER_12 || defined _AST_VER_13)
+				ast_channel_exten_set(chan, results);
+				ast_channel_priority_set(chan, 0);
+#else
+				ast_copy_string(chan->exten, results, sizeof(chan->exten) - 1);
+				chan->priority = 0;
+#endif
+			} else {
+				ast_log(LOG_NOTICE, "FAILED\n");
+			}
+		}
+	}
+
+	exception:
+
+	if (pp != NULL) {
+		swift_stop_synthesis(ps, pp, tts_stream);
+	}
+	if (ps->broker) {
+		swift_broker_stop(ps);
+	}
+	swift_trace_finish(ps);
+	swift_destroy_stuff(ps);
+	ast_atomic_fetchadd_int(&stats.calls, -1);
+	ast_free(template_buf);
+	ast_free(handle_text);
+#if (defined _AST_VER_1_6 || defined _AST_VER_1_4 || defined _AST_VER_1_8)
+	if (!res && format_set && old_writeformat) {
+		ast_set_write_format(chan, old_writeformat);
+	}
+#elif (defined _AST_VER_10 || defined _AST_VER_11 || defined _AST_VER_12)
+	if (!res && format_set) {
+		ast_set_write_format(chan, &old_writeformat);
+	}
+#elif (defined _AST_VER_13)
+	if (!res && format_set) {
+		ast_set_write_format(chan, old_writeformat);
+	}
+	ao2_cleanup(old_writeformat);
+#endif
+	ast_module_user_remove(u);
+	return res;
+}
+
+#if (defined _AST_VER_1_4 || defined _AST_VER_1_6)
+static int app_exec(struct ast_channel *chan, void *data)
+#elif (defined _AST_VER_1_8 || defined _AST_VER_10 || defined _AST_VER_11 || defined _AST_VER_12 || defined _AST_VER_13)
+static int app_exec(struct ast_channel *chan, const char *data)
+#endif
+{
+	return swift_exec(chan, data, 0);
+}
+
+#if (defined _AST_VER_1_4 || defined _AST_VER_1_6)
+static int template_exec(struct ast_channel *chan, void *data)
+#elif (defined _AST_VER_1_8 || defined _AST_VER_10 || defined _AST_VER_11 || defined _AST_VER_12 || defined _AST_VER_13)
+static int template_exec(struct ast_channel *chan, const char *data)
+#endif
+{
+	return swift_exec(chan, data, 1);
+}
+
+/*! \brief SWIFT_PREFETCH(text): start rendering text in the channel's
+ * voice and return a handle straight away.
+ */
+#if defined _AST_VER_1_4
+static int swift_prefetch_read(struct ast_channel *chan, char *cmd, char *data, char *buf, size_t len)
+#else
+static int swift_prefetch_read(struct ast_channel *chan, const char *cmd, char *data, char *buf, size_t len)
+#endif
+{
+	struct swift_prefetch *job, *slot;
+	const char *val;
+	pthread_t thread;
+	unsigned int id;
+
+	*buf = '\0';
+	if (ast_strlen_zero(data)) {
+		ast_log(LOG_WARNING, "SWIFT_PREFETCH requires text to render!\n");
+		return -1;
+	}
+	if (!(job = ast_calloc(1, sizeof(*job))) || !(job->text = ast_strdup(data))) {
+		ast_free(job);
+		return -1;
+	}
+	ast_copy_string(job->voice, cfg_voice, sizeof(job->voice));
+	if (chan && (val = pbx_builtin_getvar_helper(chan, "SWIFT_VOICE"))) {
+		ast_copy_string(job->voice, val, sizeof(job->voice));
+	}
+	if (chan && (val = pbx_builtin_getvar_helper(chan, "SWIFT_PRIORITY"))) {
+		job->priority = atoi(val);
+	}
+	job->format = swift_format_for_call(chan);
+
+	ast_mutex_lock(&prefetch_lock);
+	if (!(id = ++prefetch_next_id)) {
+		id = ++prefetch_next_id;
+	}
+	job->id = id;
+	slot = &prefetch_handles[id % SWIFT_PREFETCH_HANDLES];
+	ast_free(slot->text);
+	slot->id = id;
+	slot->text = ast_strdup(data);
+	ast_copy_string(slot->voice, job->voice, sizeof(slot->voice));
+
+	if (prefetch_shutdown || prefetch_threads >= SWIFT_PREFETCH_THREADS) {
+		/* The handle still works; Swift() renders the text itself */
+		prefetch_dropped++;
+		ast_mutex_unlock(&prefetch_lock);
+		ast_free(job->text);
+		ast_free(job);
+	} else {
+		prefetch_threads++;
+		prefetch_started++;
+		ast_mutex_unlock(&prefetch_lock);
+		if (ast_pthread_create_detached(&thread, NULL, swift_prefetch_thread, job)) {
+			ast_log(LOG_WARNING, "Unable to start Swift prefetch thread\n");
+			ast_mutex_lock(&prefetch_lock);
+			prefetch_threads--;
+			prefetch_started--;
+			prefetch_dropped++;
+			ast_mutex_unlock(&prefetch_lock);
+			ast_free(job->text);
+			ast_free(job);
+		}
+	}
+
+	snprintf(buf, len, SWIFT_PREFETCH_PREFIX "%u", id);
+	return 0;
+}
+
+static struct ast_custom_function swift_prefetch_function = {
+	.name = "SWIFT_PREFETCH",
+#if (defined _AST_VER_1_4 || defined _AST_VER_1_6)
+	.synopsis = "Start rendering text with Swift ahead of playback",
+	.syntax = "SWIFT_PREFETCH(text)",
+	.desc = "Starts rendering text in the channel's ${SWIFT_VOICE} in the background\n"
+		"and returns a handle at once.  A later Swift() of the same text, or of\n"
+		"the handle, plays what has been rendered so far.\n",
+#endif
+	.read = swift_prefetch_read,
+};
+
+/*! \brief Stop new prefetches and wait for the running ones to finish the
+ * piece they are on. */
+static void swift_prefetch_shutdown(void)
+{
+	struct swift_prefetch *job;
+	int i;
+
+	ast_mutex_lock(&prefetch_lock);
+	prefetch_shutdown = 1;
+	while ((job = AST_LIST_REMOVE_HEAD(&preload_queue, list))) {
+		swift_prefetch_free(job);
+	}
+	while (prefetch_threads) {
+		ast_cond_wait(&prefetch_cond, &prefetch_lock);
+	}
+	for (i = 0; i < SWIFT_PREFETCH_HANDLES; i++) {
+		ast_free(prefetch_handles[i].text);
+		prefetch_handles[i].text = NULL;
+		prefetch_handles[i].id = 0;
+	}
+	ast_mutex_unlock(&prefetch_lock);
+}
+
+
+/*! \brief A consistent enough copy of the counters, with the pool and
+ * cache figures that live under their own locks. */
+struct swift_stats_snapshot {
+	struct swift_stats s;
+	int ports_open;
+	int ports_busy;
+	int synth_workers;
+	int synth_busy;
+	int synth_queued;
+	unsigned int cache_hits;
+	unsigned int cache_misses;
+	unsigned int store_hits;
+	uint64_t ttfa_count;
+};
+
+static void swift_stats_snapshot(struct swift_stats_snapshot *snap)
+{
+	struct swift_pooled_port *pp;
+	unsigned int i;
+	int idle = 0;
+
+	memset(snap, 0, sizeof(*snap));
+	snap->s.calls = swift_atomic_load(&stats.calls);
+	snap->s.calls_total = swift_atomic_load(&stats.calls_total);
+	snap->s.engine_opens = swift_atomic_load(&stats.engine_opens);
+	snap->s.engine_open_us = swift_atomic_load(&stats.engine_open_us);
+	snap->s.port_opens = swift_atomic_load(&stats.port_opens);
+	snap->s.port_open_us = swift_atomic_load(&stats.port_open_us);
+	for (i = 0; i < SWIFT_TTFA_BUCKETS; i++) {
+		snap->s.ttfa_cached[i] = swift_atomic_load(&stats.ttfa_cached[i]);
+		snap->s.ttfa_rendered[i] = swift_atomic_load(&stats.ttfa_rendered[i]);
+		snap->ttfa_count += snap->s.ttfa_cached[i] + snap->s.ttfa_rendered[i];
 	}
-#if (defined _AST_VER_11 || defined _AST_VER_12 || defined _AST_VER_13)
-	if (ast_channel_state(chan) != AST_STATE_UP) {
-#else
-	if (chan->_state != AST_STATE_UP) {
-#endif
-		ast_answer(chan);
+	snap->s.ttfa_ms = swift_atomic_load(&stats.ttfa_ms);
+	snap->s.starved = swift_atomic_load(&stats.starved);
+	snap->s.starved_us = swift_atomic_load(&stats.starved_us);
+	snap->s.producer_sleeps = swift_atomic_load(&stats.producer_sleeps);
+	snap->s.producer_slept_us = swift_atomic_load(&stats.producer_slept_us);
+	snap->s.bytes_rendered = swift_atomic_load(&stats.bytes_rendered);
+	snap->s.frames_written = swift_atomic_load(&stats.frames_written);
+	snap->s.synth_jobs = swift_atomic_load(&stats.synth_jobs);
+	snap->s.synth_wait_us = swift_atomic_load(&stats.synth_wait_us);
+	snap->s.cancels = swift_atomic_load(&stats.cancels);
+	snap->s.cancel_us = swift_atomic_load(&stats.cancel_us);
+	snap->s.cancel_max_us = swift_atomic_load(&stats.cancel_max_us);
+	snap->s.broker_calls = swift_atomic_load(&stats.broker_calls);
+	snap->s.broker_fallbacks = swift_atomic_load(&stats.broker_fallbacks);
+
+	ast_mutex_lock(&port_lock);
+	AST_LIST_TRAVERSE(&port_pool, pp, list) {
+		idle++;
 	}
+	snap->ports_open = ports_open;
+	snap->ports_busy = ports_open - idle;
+	ast_mutex_unlock(&port_lock);
 
-	ast_stopstream(chan);
+	ast_mutex_lock(&synth_lock);
+	snap->synth_workers = synth_threads;
+	snap->synth_busy = synth_busy;
+	snap->synth_queued = synth_queued;
+	ast_mutex_unlock(&synth_lock);
 
-#if (defined _AST_VER_1_4 || defined _AST_VER_1_6 || defined _AST_VER_1_8)
-	old_writeformat = chan->writeformat;
+	ast_mutex_lock(&cache_lock);
+	snap->cache_hits = cache_hits;
+	snap->cache_misses = cache_misses;
+	ast_mutex_unlock(&cache_lock);
 
-	if (ast_set_write_format(chan, AST_FORMAT_ULAW) < 0) {
-#elif (defined _AST_VER_10)
-	ast_format_copy(&old_writeformat, &chan->writeformat);
+	ast_mutex_lock(&store_lock);
+	snap->store_hits = store_hits;
+	ast_mutex_unlock(&store_lock);
+}
 
-	if (ast_set_write_format_by_id(chan, AST_FORMAT_ULAW) < 0) {
-#elif (defined _AST_VER_11 || defined _AST_VER_12)
-	ast_format_copy(&old_writeformat, ast_channel_writeformat(chan));
+static unsigned long swift_stats_avg(uint64_t total, uint64_t count)
+{
+	return count ? total / count : 0;
+}
 
-	if (ast_set_write_format_by_id(chan, AST_FORMAT_ULAW) < 0) {
-#elif (defined _AST_VER_13)
-	old_writeformat = ao2_bump(ast_channel_writeformat(chan));
+#if !defined _AST_VER_1_4
+static char *handle_cli_swift_show_stats(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct swift_stats_snapshot snap;
+	unsigned int i, lookups;
+	char bound[16];
 
-	if (ast_set_write_format(chan, ast_format_ulaw) < 0) {
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "swift show stats";
+		e->usage =
+			"Usage: swift show stats\n"
+			"       Shows counters for synthesis and playback since the module was\n"
+			"       loaded, including a histogram of the time to first audio.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3) {
+		return CLI_SHOWUSAGE;
+	}
+
+	swift_stats_snapshot(&snap);
+	lookups = snap.cache_hits + snap.cache_misses;
+	ast_cli(a->fd, "Calls:           %d now, %llu in all\n", snap.s.calls, (unsigned long long) snap.s.calls_total);
+	ast_cli(a->fd, "Ports:           %d open, %d synthesizing\n", snap.ports_open, snap.ports_busy);
+	if (snap.synth_workers || snap.s.synth_jobs) {
+		ast_cli(a->fd, "Synth workers:   %d, %d busy, %d queued, %llu jobs, %lu ms average wait\n",
+			snap.synth_workers, snap.synth_busy, snap.synth_queued, (unsigned long long) snap.s.synth_jobs,
+			swift_stats_avg(snap.s.synth_wait_us, snap.s.synth_jobs * 1000));
+	}
+	ast_cli(a->fd, "Engine opens:    %llu, %lu ms average\n", (unsigned long long) snap.s.engine_opens,
+		swift_stats_avg(snap.s.engine_open_us, snap.s.engine_opens * 1000));
+	ast_cli(a->fd, "Port opens:      %llu, %lu ms average\n", (unsigned long long) snap.s.port_opens,
+		swift_stats_avg(snap.s.port_open_us, snap.s.port_opens * 1000));
+	ast_cli(a->fd, "Audio rendered:  %llu KB\n", (unsigned long long) snap.s.bytes_rendered / 1024);
+	ast_cli(a->fd, "Frames written:  %llu, starved %llu times for %llu ms in all\n",
+		(unsigned long long) snap.s.frames_written, (unsigned long long) snap.s.starved,
+		(unsigned long long) snap.s.starved_us / 1000);
+	ast_cli(a->fd, "Producer sleeps: %llu, %llu ms in all\n", (unsigned long long) snap.s.producer_sleeps,
+		(unsigned long long) snap.s.producer_slept_us / 1000);
+	ast_cli(a->fd, "Cancels:         %llu, port back in %lu us average, %llu us worst\n",
+		(unsigned long long) snap.s.cancels, swift_stats_avg(snap.s.cancel_us, snap.s.cancels),
+		(unsigned long long) snap.s.cancel_max_us);
+	if (!ast_strlen_zero(cfg_broker) || snap.s.broker_calls || snap.s.broker_fallbacks) {
+		ast_cli(a->fd, "Broker:          %llu calls, %llu rendered here instead\n",
+			(unsigned long long) snap.s.broker_calls, (unsigned long long) snap.s.broker_fallbacks);
+	}
+	ast_cli(a->fd, "Cache hit rate:  %u%% (%u hits, %u misses, %u from the prompt store)\n",
+		lookups ? snap.cache_hits * 100 / lookups : 0, snap.cache_hits, snap.cache_misses, snap.store_hits);
+	ast_cli(a->fd, "\nTime to first audio, %lu ms average:\n", swift_stats_avg(snap.s.ttfa_ms, snap.ttfa_count));
+	ast_cli(a->fd, "  %-10s %10s %10s\n", "Under", "Cached", "Rendered");
+	for (i = 0; i < SWIFT_TTFA_BUCKETS; i++) {
+		if (i < ARRAY_LEN(swift_ttfa_bounds)) {
+			snprintf(bound, sizeof(bound), "%u ms", swift_ttfa_bounds[i]);
+		} else {
+			ast_copy_string(bound, "slower", sizeof(bound));
+		}
+		ast_cli(a->fd, "  %-10s %10llu %10llu\n", bound, (unsigned long long) snap.s.ttfa_cached[i],
+			(unsigned long long) snap.s.ttfa_rendered[i]);
+	}
+
+	ast_cli(a->fd, "\n  %-20s %8s %10s %10s %10s\n", "Voice", "Renders", "Speed", "ms/char", "Gap ms");
+	ast_mutex_lock(&voice_lock);
+	for (i = 0; i < SWIFT_VOICE_STATS && voice_stats[i].voice[0]; i++) {
+		if (!voice_stats[i].renders) {
+			continue;
+		}
+		ast_cli(a->fd, "  %-20s %8u %9.1fx %10.1f %10.0f\n", voice_stats[i].voice, voice_stats[i].renders,
+			voice_stats[i].speed, voice_stats[i].ms_per_char, voice_stats[i].gap_ms);
+	}
+	ast_mutex_unlock(&voice_lock);
+
+	return CLI_SUCCESS;
+}
 #endif
-		ast_log(LOG_WARNING, "Unable to set write format.\n");
-		goto exception;
+
+static int manager_swift_stats(struct mansession *s, const struct message *m)
+{
+	struct swift_stats_snapshot snap;
+	const char *id = astman_get_header(m, "ActionID");
+	unsigned int i;
+
+	swift_stats_snapshot(&snap);
+	astman_append(s, "Response: Success\r\n");
+	if (!ast_strlen_zero(id)) {
+		astman_append(s, "ActionID: %s\r\n", id);
+	}
+	astman_append(s,
+		"Calls: %d\r\n"
+		"CallsTotal: %llu\r\n"
+		"PortsOpen: %d\r\n"
+		"PortsSynthesizing: %d\r\n"
+		"SynthWorkers: %d\r\n"
+		"SynthWorkersBusy: %d\r\n"
+		"SynthQueued: %d\r\n"
+		"SynthJobs: %llu\r\n"
+		"SynthWaitAvgMs: %lu\r\n"
+		"EngineOpens: %llu\r\n"
+		"EngineOpenAvgMs: %lu\r\n"
+		"PortOpens: %llu\r\n"
+		"PortOpenAvgMs: %lu\r\n"
+		"BytesRendered: %llu\r\n"
+		"FramesWritten: %llu\r\n"
+		"Starved: %llu\r\n"
+		"StarvedMs: %llu\r\n"
+		"ProducerSleeps: %llu\r\n"
+		"ProducerSleptMs: %llu\r\n"
+		"Cancels: %llu\r\n"
+		"CancelReleaseAvgUs: %lu\r\n"
+		"CancelReleaseMaxUs: %llu\r\n"
+		"BrokerCalls: %llu\r\n"
+		"BrokerFallbacks: %llu\r\n"
+		"CacheHits: %u\r\n"
+		"CacheMisses: %u\r\n"
+		"StoreHits: %u\r\n"
+		"TTFAAvgMs: %lu\r\n",
+		snap.s.calls, (unsigned long long) snap.s.calls_total, snap.ports_open, snap.ports_busy,
+		snap.synth_workers, snap.synth_busy, snap.synth_queued, (unsigned long long) snap.s.synth_jobs,
+		swift_stats_avg(snap.s.synth_wait_us, snap.s.synth_jobs * 1000),
+		(unsigned long long) snap.s.engine_opens, swift_stats_avg(snap.s.engine_open_us, snap.s.engine_opens * 1000),
+		(unsigned long long) snap.s.port_opens, swift_stats_avg(snap.s.port_open_us, snap.s.port_opens * 1000),
+		(unsigned long long) snap.s.bytes_rendered, (unsigned long long) snap.s.frames_written,
+		(unsigned long long) snap.s.starved, (unsigned long long) snap.s.starved_us / 1000,
+		(unsigned long long) snap.s.producer_sleeps,
+		(unsigned long long) snap.s.producer_slept_us / 1000,
+		(unsigned long long) snap.s.cancels, swift_stats_avg(snap.s.cancel_us, snap.s.cancels),
+		(unsigned long long) snap.s.cancel_max_us, (unsigned long long) snap.s.broker_calls,
+		(unsigned long long) snap.s.broker_fallbacks, snap.cache_hits, snap.cache_misses, snap.store_hits,
+		swift_stats_avg(snap.s.ttfa_ms, snap.ttfa_count));
+	for (i = 0; i < SWIFT_TTFA_BUCKETS; i++) {
+		if (i < ARRAY_LEN(swift_ttfa_bounds)) {
+			astman_append(s, "TTFACachedUnder%u: %llu\r\nTTFARenderedUnder%u: %llu\r\n",
+				swift_ttfa_bounds[i], (unsigned long long) snap.s.ttfa_cached[i],
+				swift_ttfa_bounds[i], (unsigned long long) snap.s.ttfa_rendered[i]);
+		} else {
+			astman_append(s, "TTFACachedSlower: %llu\r\nTTFARenderedSlower: %llu\r\n",
+				(unsigned long long) snap.s.ttfa_cached[i], (unsigned long long) snap.s.ttfa_rendered[i]);
+		}
 	}
+	astman_append(s, "\r\n");
+	return 0;
+}
 
-	res = 0;
+#if !defined _AST_VER_1_4
+static char *handle_cli_swift_show_ports(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct swift_pooled_port *pp;
+	int idle = 0;
 
-	/* Wait 100ms first for synthesis to start crankin'; if that's not
-	 * enough the
-	 */
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "swift show ports";
+		e->usage =
+			"Usage: swift show ports\n"
+			"       Shows the Swift port pool, the queue of calls waiting for a port\n"
+			"       and the memory used to buffer audio.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
 
-	next = ast_tvadd(ast_tvnow(), ast_tv(0, 100000));
+	if (a->argc != 3) {
+		return CLI_SHOWUSAGE;
+	}
 
-	while (swift_generator_running(ps)) {
-		ms = ast_tvdiff_ms(next, ast_tvnow());
-
-		if (ms <= 0) {
-			if (swift_bytes_available(ps) > 0) {
-				ASTOBJ_WRLOCK(ps);
-				len = fmin(framesize, ps->qc);
-				availatend = cfg_buffer_size - (ps->pq_r - ps->q);
-
-				if (len > availatend) {
-					/* read #1: to end of q buf */
-					memcpy(myf.frdata, ps->pq_r, availatend);
-					ps->qc -= availatend;
-
-					/* read #2: reset to start of q buf and get rest */
-					ps->pq_r = ps->q;
-					memcpy(myf.frdata + availatend, ps->pq_r, len - availatend);
-					ps->qc -= len - availatend;
-					ps->pq_r += len - availatend;
-				} else {
-					ast_log(LOG_DEBUG, "Easy read; %d bytes and %d at end, %d free\n", len, availatend, cfg_buffer_size - ps->qc);
-					memcpy(myf.frdata, ps->pq_r, len);
-					ps->qc -= len;
-					ps->pq_r += len;
-				}
+	ast_mutex_lock(&port_lock);
+	AST_LIST_TRAVERSE(&port_pool, pp, list) {
+		idle++;
+	}
+	ast_cli(a->fd, "Ports open:      %d (limit %d), %d idle, %d in use\n",
+		ports_open, swift_port_limit_locked(), idle, ports_open - idle);
+	if (!cfg_max_ports && ports_learned) {
+		ast_cli(a->fd, "Port limit:      %d, learned from the engine refusing ports (max_ports is not set)\n",
+			ports_learned);
+	}
+	ast_cli(a->fd, "Queue depth:     %d (limit %d, peak %d)\n", queue_depth, cfg_queue_size, queue_peak);
+	ast_cli(a->fd, "Queue results:   %u admitted, %u timed out, %u rejected\n",
+		queue_admitted, queue_timeouts, queue_rejected);
+	ast_cli(a->fd, "Queue wait:      %lu ms average, %u ms max\n",
+		(queue_admitted + queue_timeouts) ? queue_wait_total / (queue_admitted + queue_timeouts) : 0, queue_wait_max);
+	ast_mutex_unlock(&port_lock);
 
-				myf.f.frametype = AST_FRAME_VOICE;
-#if (defined _AST_VER_1_6 || defined _AST_VER_1_4)
-				myf.f.subclass = AST_FORMAT_ULAW;
-#elif defined _AST_VER_1_8 
-				myf.f.subclass.codec = AST_FORMAT_ULAW;
-#elif (defined _AST_VER_10 || defined _AST_VER_11 || defined _AST_VER_12)
-				ast_format_set(&myf.f.subclass.format, AST_FORMAT_ULAW, 0);
-#elif (defined _AST_VER_13)
-				myf.f.subclass.format = ast_format_ulaw;
-#endif
-				myf.f.datalen = len;
-				myf.f.samples = len;
-#if defined _AST_VER_1_4
-				myf.f.data = myf.frdata;
-#else
-				myf.f.data.ptr = myf.frdata;
-#endif
-				myf.f.mallocd = 0;
-				myf.f.offset = AST_FRIENDLY_OFFSET;
-				myf.f.src = __PRETTY_FUNCTION__;
-				myf.f.delivery.tv_sec = 0;
-				myf.f.delivery.tv_usec = 0;
+	ast_mutex_lock(&chunk_lock);
+	ast_cli(a->fd, "Audio buffers:   %d KB in use (limit %u KB), %d KB pooled\n",
+		chunks_in_use * SWIFT_CHUNK_SIZE / 1024, cfg_max_buffer_memory / 1024, chunks_free * SWIFT_CHUNK_SIZE / 1024);
+	ast_mutex_unlock(&chunk_lock);
 
-				if (ast_write(chan, &myf.f) < 0) {
-					ast_log(LOG_DEBUG, "ast_write failed\n");
-				}
+	return CLI_SUCCESS;
+}
 
-				ast_log(LOG_DEBUG, "wrote a frame of %d\n", len);
+static char *handle_cli_swift_show_cache(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	unsigned int lookups;
 
-				if (ps->qc < 0) {
-					ast_log(LOG_DEBUG, "queue claims to contain negative bytes. Huh? qc < 0\n");
-				}
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "swift show cache";
+		e->usage =
+			"Usage: swift show cache\n"
+			"       Shows how much rendered audio is cached and how often calls\n"
+			"       were served from it.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
 
-				ASTOBJ_UNLOCK(ps);
-				next = ast_tvadd(next, ast_samp2tv(myf.f.samples, samplerate));
-			} else {
-				next = ast_tvadd(next, ast_samp2tv(framesize / 2, samplerate));
-				ast_log(LOG_DEBUG, "Whoops, writer starved for audio\n");
-			}
-		} else {
-			ms = ast_waitfor(chan, ms);
+	if (a->argc != 3) {
+		return CLI_SHOWUSAGE;
+	}
 
-			if (ms < 0) {
-				ast_log(LOG_DEBUG, "Hangup detected\n");
-				res = -1;
-				ASTOBJ_WRLOCK(ps);
-				ps->immediate_exit = 1;
-				ASTOBJ_UNLOCK(ps);
-			} else if (ms) {
-				f = ast_read(chan);
-
-				if (!f) {
-					ast_log(LOG_DEBUG, "Null frame == hangup() detected\n");
-					res = -1;
-					ASTOBJ_WRLOCK(ps);
-					ps->immediate_exit = 1;
-					ASTOBJ_UNLOCK(ps);
-				} else {
-					if (f->frametype == AST_FRAME_DTMF && timeout > 0 && max_digits > 0) {
-#if (defined _AST_VER_1_6 || defined _AST_VER_1_4)
-						char originalDTMF = f->subclass;
-#elif (defined _AST_VER_1_8 || defined _AST_VER_10 || defined _AST_VER_11 || defined _AST_VER_12 || defined _AST_VER_13)
-						char originalDTMF = f->subclass.integer;
-#endif
-						alreadyran = 1;
-						res = 0;
-						ASTOBJ_WRLOCK(ps);
-						ps->immediate_exit = 1;
-						ASTOBJ_UNLOCK(ps);
-
-						if (max_digits > 1) {
-							rc = listen_for_dtmf(chan, timeout, max_digits - 1);
-						}
-
-						if (rc) {
-							sprintf(results, "%c%s", originalDTMF, rc);
-						} else {
-							sprintf(results, "%c", originalDTMF);
-						}
-
-						ast_log(LOG_NOTICE, "DTMF = %s\n", results);
-						pbx_builtin_setvar_helper(chan, "SWIFT_DTMF", results);
-					}
+	ast_mutex_lock(&cache_lock);
+	lookups = cache_hits + cache_misses;
+	ast_cli(a->fd, "Cached prompts:  %d\n", cache_entries);
+	ast_cli(a->fd, "Cache memory:    %u KB (limit %u KB)\n", cache_bytes / 1024, cfg_cache_size / 1024);
+	ast_cli(a->fd, "Lookups:         %u hits, %u misses (%u%% hit rate)\n",
+		cache_hits, cache_misses, lookups ? cache_hits * 100 / lookups : 0);
+	ast_cli(a->fd, "Evictions:       %u\n", cache_evictions);
+	ast_cli(a->fd, "Shared renders:  %u calls joined one under way, %d under way now\n",
+		inflight_joins, inflight_count);
+	ast_mutex_unlock(&cache_lock);
 
-					if (f!=NULL) {
-						ast_frfree(f);
-					}
-				}
-			}
-		}
+	ast_mutex_lock(&store_lock);
+	if (store_fd >= 0) {
+		ast_cli(a->fd, "Prompt store:    %s\n", store_path);
+		ast_cli(a->fd, "Stored prompts:  %d in %lu KB (limit %u KB)\n", store_entries,
+			(unsigned long) (store_map ? store_map->size / 1024 : 0), store_size / 1024);
+		ast_cli(a->fd, "Store activity:  %u hits, %u writes, %u compactions\n",
+			store_hits, store_writes, store_compactions);
+	} else {
+		ast_cli(a->fd, "Prompt store:    (none)\n");
+	}
+	ast_mutex_unlock(&store_lock);
 
-		ASTOBJ_RDLOCK(ps);
+	ast_mutex_lock(&prefetch_lock);
+	ast_cli(a->fd, "Prefetches:      %u started, %u dropped, %d running\n",
+		prefetch_started, prefetch_dropped, prefetch_threads - preload_workers - batch_workers);
+	ast_cli(a->fd, "Preloaded:       %u prompts, %d workers running\n",
+		preload_rendered, preload_workers);
+	ast_mutex_unlock(&prefetch_lock);
 
-		if (ps->immediate_exit && !ps->generating_done) {
-			if (SWIFT_FAILED(sresult = swift_port_stop(port, tts_stream, SWIFT_EVENT_NOW))) {
-				ast_log(LOG_NOTICE, "Early top of swift port failed\n");
-			}
-		}
+	return CLI_SUCCESS;
+}
+
+static char *handle_cli_swift_preload(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	int queued;
 
-		ASTOBJ_UNLOCK(ps);
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "swift preload";
+		e->usage =
+			"Usage: swift preload\n"
+			"       Renders the prompts listed in the [preload] section of swift.conf\n"
+			"       into the cache again, in the background.  Prompts still in the\n"
+			"       cache or prompt store are skipped.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
 	}
-	if (alreadyran == 0 && timeout > 0 && max_digits > 0) {
-		rc = listen_for_dtmf(chan, timeout, max_digits);
 
-		if (rc != NULL) {
-			sprintf(results, "%s", rc);
-			ast_log(LOG_NOTICE, "DTMF = %s\n", results);
-			pbx_builtin_setvar_helper(chan, "SWIFT_DTMF", results);
-		}
+	if (a->argc != 2) {
+		return CLI_SHOWUSAGE;
 	}
-	if (max_digits >= 1 && results != NULL) {
-		if (cfg_goto_exten) {
-#if (defined _AST_VER_11 || defined _AST_VER_12 || defined _AST_VER_13)
-			ast_log(LOG_NOTICE, "GoTo(%s|%s|%d) : ", ast_channel_context(chan), results, 1);
-#else
-			ast_log(LOG_NOTICE, "GoTo(%s|%s|%d) : ", chan->context, results, 1);
-#endif
 
-#if (defined _AST_VER_1_6 || defined _AST_VER_1_4)
-			if (ast_exists_extension (chan, chan->context, results, 1, chan->cid.cid_num)) {
-#elif (defined _AST_VER_1_8 || defined _AST_VER_10)
-			 if (ast_exists_extension (chan, chan->context, results, 1, chan->caller.id.number.str)) {
-#elif (defined _AST_VER_11 || defined _AST_VER_12 || defined _AST_VER_13)
-			 if (ast_exists_extension (chan, ast_channel_context(chan), results, 1, ast_channel_caller(chan)->id.number.str)) {
-#endif
-				ast_log(LOG_NOTICE, "OK\n");
-#if (defined _AST_VER_11 || defined _AST_VER_12 || defined _AST_VER_13)
-				ast_channel_exten_set(chan, results);
-				ast_channel_priority_set(chan, 0);
-#else
-				ast_copy_string(chan->exten, results, sizeof(chan->exten) - 1);
-				chan->priority = 0;
-#endif
-			} else {
-				ast_log(LOG_NOTICE, "FAILED\n");
-			}
+	queued = swift_preload_start();
+	ast_cli(a->fd, "Warming up %d prompts with up to %d workers\n", queued, cfg_preload_workers);
+
+	return CLI_SUCCESS;
+}
+
+static char *handle_cli_swift_render(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	int workers, queued;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "swift render";
+		e->usage =
+			"Usage: swift render [<manifest> [workers]]\n"
+			"       Renders the prompts listed in a manifest into sound files, or into\n"
+			"       the prompt store, in the background.  Each line of the manifest is\n"
+			"       output|voice[/format]|text, where output is a sound file name\n"
+			"       without its extension, relative to the sounds directory, or - for\n"
+			"       the prompt store.  Files whose voice and text are unchanged since\n"
+			"       they were last rendered are skipped.  Renders on as many ports as\n"
+			"       max_ports allows, behind any calls, unless told how many workers\n"
+			"       to use.  Without a manifest, shows how the last batch went.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc == 2) {
+		ast_mutex_lock(&prefetch_lock);
+		if (!batch_total && !batch_running) {
+			ast_cli(a->fd, "No batch rendered since the module was loaded\n");
+		} else {
+			ast_cli(a->fd, "Manifest:        %s\n", batch_manifest);
+			ast_cli(a->fd, "Status:          %s, %d workers\n", batch_running ? "rendering" : "done", batch_workers);
+			ast_cli(a->fd, "Prompts:         %u, %u rendered, %u unchanged, %u failed\n", batch_total,
+				batch_rendered, batch_unchanged, batch_failed);
+			ast_cli(a->fd, "Time:            %ld s\n",
+				(long) ast_tvdiff_ms(batch_running ? ast_tvnow() : batch_end, batch_start) / 1000);
 		}
+		ast_mutex_unlock(&prefetch_lock);
+		return CLI_SUCCESS;
+	}
+	if (a->argc > 4) {
+		return CLI_SHOWUSAGE;
+	}
+	ast_mutex_lock(&port_lock);
+	workers = swift_port_limit_locked() ? swift_port_limit_locked() : SWIFT_BATCH_WORKERS;
+	ast_mutex_unlock(&port_lock);
+	if (a->argc == 4 && (workers = atoi(a->argv[3])) < 1) {
+		return CLI_SHOWUSAGE;
 	}
 
-	exception:
+	if ((queued = swift_batch_start(a->fd, a->argv[2], workers)) >= 0) {
+		ast_cli(a->fd, "Rendering %d prompts with up to %d workers\n", queued, workers);
+	}
+	return CLI_SUCCESS;
+}
+
+#if !defined SWIFT_NO_TRACE
+static char *handle_cli_swift_show_trace(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct swift_trace *tr, *copy;
+	struct swift_trace_rec *rec;
+	unsigned int i, n, first;
+	int live = 0;
+	int64_t start;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "swift show trace";
+		e->usage =
+			"Usage: swift show trace <channel>\n"
+			"       Shows the recent synthesis and playback trace of the Swift call\n"
+			"       on a channel, or of the last one it finished.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return ast_complete_channels(a->line, a->word, a->pos, a->n, 3);
+	}
 
-	if (port != NULL) {
-		swift_port_close(port);
+	if (a->argc != 4) {
+		return CLI_SHOWUSAGE;
 	}
-	if (engine != NULL) {
-		swift_engine_close(engine);
+	if (!(copy = ast_malloc(sizeof(*copy)))) {
+		return CLI_FAILURE;
 	}
-	if (ps && ps->q) {
-		ast_free(ps->q);
-		ps->q = NULL;
+
+	ast_mutex_lock(&trace_lock);
+	AST_LIST_TRAVERSE(&trace_calls, tr, list) {
+		if (!strcasecmp(tr->name, a->argv[3])) {
+			live = 1;
+			break;
+		}
 	}
-	if (ps) {
-		ast_free(ps);
-		ps = NULL;
+	for (i = 1; !tr && i <= SWIFT_TRACE_KEEP; i++) {
+		tr = trace_done[(trace_done_next + SWIFT_TRACE_KEEP - i) % SWIFT_TRACE_KEEP];
+		if (tr && strcasecmp(tr->name, a->argv[3])) {
+			tr = NULL;
+		}
 	}
-#if (defined _AST_VER_1_6 || defined _AST_VER_1_4 || defined _AST_VER_1_8)
-	if (!res && old_writeformat) {
-		ast_set_write_format(chan, old_writeformat);
+	if (tr) {
+		*copy = *tr;
 	}
-#elif (defined _AST_VER_10 || defined _AST_VER_11 || defined _AST_VER_12)
-	if (!res) {
-		ast_set_write_format(chan, &old_writeformat);
+	ast_mutex_unlock(&trace_lock);
+
+	if (!tr) {
+		ast_cli(a->fd, "No Swift trace for channel %s\n", a->argv[3]);
+		ast_free(copy);
+		return CLI_SUCCESS;
 	}
-#elif (defined _AST_VER_13)
-	if (!res) {
-		ast_set_write_format(chan, old_writeformat);
+
+	n = copy->next < SWIFT_TRACE_SIZE ? copy->next : SWIFT_TRACE_SIZE;
+	first = copy->next - n;
+	start = copy->recs[first & (SWIFT_TRACE_SIZE - 1)].us;
+	ast_cli(a->fd, "Swift trace of %s (%s), last %u of %u records\n", copy->name,
+		live ? "in progress" : "finished", n, copy->next);
+	ast_cli(a->fd, "%10s  %-10s %10s %10s\n", "ms", "Event", "Queued", "Value");
+	for (i = first; i != copy->next; i++) {
+		rec = &copy->recs[i & (SWIFT_TRACE_SIZE - 1)];
+		ast_cli(a->fd, "%10.1f  %-10s %10u %10u\n", (rec->us - start) / 1000.0,
+			rec->event < ARRAY_LEN(swift_trace_names) ? swift_trace_names[rec->event] : "?",
+			rec->depth, rec->value);
 	}
-	ao2_cleanup(old_writeformat);
-#endif
-	ast_module_user_remove(u);
-	return res;
+	ast_free(copy);
+
+	return CLI_SUCCESS;
 }
+#endif
+
+static struct ast_cli_entry cli_swift[] = {
+	AST_CLI_DEFINE(handle_cli_swift_show_ports, "Show Swift port pool and queue"),
+	AST_CLI_DEFINE(handle_cli_swift_show_cache, "Show Swift rendered audio cache"),
+	AST_CLI_DEFINE(handle_cli_swift_render, "Render a manifest of Swift prompts to sound files"),
+	AST_CLI_DEFINE(handle_cli_swift_show_stats, "Show Swift synthesis and playback statistics"),
+#if !defined SWIFT_NO_TRACE
+	AST_CLI_DEFINE(handle_cli_swift_show_trace, "Show the Swift trace of a channel"),
+#endif
+	AST_CLI_DEFINE(handle_cli_swift_preload, "Warm up the Swift cache with the preload prompts"),
+};
+#endif
 
 
 static int unload_module(void)
 {
 	int res;
 	res = ast_unregister_application(app);
+	res |= ast_unregister_application(template_app);
+	res |= ast_custom_function_unregister(&swift_prefetch_function);
+	ast_manager_unregister("SwiftStats");
+#if !defined _AST_VER_1_4
+	ast_cli_unregister_multiple(cli_swift, ARRAY_LEN(cli_swift));
+#endif
 	ast_module_user_hangup_all();
+	swift_prefetch_shutdown();
+	swift_preload_clear();
+	swift_synth_shutdown();
+	swift_engine_replace(NULL);
+	swift_port_pool_flush();
+	swift_chunk_pool_flush();
+	swift_cache_trim(1);
+	swift_store_close();
+	swift_trace_clear();
+	ast_cond_destroy(&port_released);
+	ast_cond_destroy(&chunk_cond);
+	ast_cond_destroy(&prefetch_cond);
+	ast_cond_destroy(&synth_cond);
+	ast_cond_destroy(&synth_done);
 	return res;
 }
 
 
-static int load_module(void)
+static void swift_set_defaults(void)
 {
-	int res = 0;
-	const char *val = NULL;
-	struct ast_config *cfg;
-#if  (defined _AST_VER_1_6 || defined _AST_VER_1_8 || defined _AST_VER_10 || defined _AST_VER_11 || defined _AST_VER_12 || defined _AST_VER_13)
-	struct ast_flags config_flags = { CONFIG_FLAG_NOCACHE };
-#endif
-
-	/* Set some defaults */
-	cfg_buffer_size = 65535;
+	cfg_buffer_size = 1048576;
+	cfg_max_buffer_memory = 67108864;
+	cfg_cache_size = 16777216;
+	cfg_cache_max_prompt = 262144;
+	cfg_prompt_store[0] = '\0';
+	cfg_prompt_store_size = 268435456;
 	cfg_goto_exten = 0;
-	samplerate = 8000; /* G711a/G711u  */
+	cfg_format = NULL;
+	cfg_ptime = 20;
+	cfg_segment_text = 1;
+	cfg_trim_silence = 1;
+	cfg_silence_threshold = -50;
+	cfg_trim_tail = 150;
+	cfg_normalize = 0;
+	cfg_max_prebuffer = 2000;
+	cfg_broker[0] = '\0';
 
 	ast_copy_string(cfg_voice, "Allison-8kHz", sizeof(cfg_voice));
+	cfg_voices[0] = '\0';
+	cfg_port_pool_size = 1;
+	cfg_max_ports = 0;
+	cfg_queue_size = 100;
+	cfg_queue_timeout = 3000;
+	cfg_preload_workers = 2;
+	cfg_synth_workers = 0;
+	cfg_synth_cpus[0] = '\0';
+}
 
 
-#if (defined _AST_VER_1_6 || defined _AST_VER_1_4)
-	res = ast_register_application(app, app_exec, synopsis, descrip) ?
-#elif (defined _AST_VER_1_8 || defined _AST_VER_10 || defined _AST_VER_11 || defined _AST_VER_12 || defined _AST_VER_13)
-	res = ast_register_application_xml(app, app_exec) ?
+/*! \brief Read swift.conf.  Returns 1 if the file was (re)loaded, 0 if
+ * it was unchanged since the last load, or -1 if it could not be read.
+ */
+static int swift_load_config(int reload)
+{
+	const char *val = NULL;
+	struct ast_variable *var;
+	struct ast_config *cfg;
+#if  (defined _AST_VER_1_6 || defined _AST_VER_1_8 || defined _AST_VER_10 || defined _AST_VER_11 || defined _AST_VER_12 || defined _AST_VER_13)
+	struct ast_flags config_flags = { reload ? CONFIG_FLAG_FILEUNCHANGED : CONFIG_FLAG_NOCACHE };
 #endif
-		AST_MODULE_LOAD_DECLINE : AST_MODULE_LOAD_SUCCESS;
 
 #if defined _AST_VER_1_4
 	cfg = ast_config_load(SWIFT_CONFIG_FILE);
 #elif (defined _AST_VER_1_6 || defined _AST_VER_1_8 || defined _AST_VER_10 || defined _AST_VER_11 || defined _AST_VER_12 || defined _AST_VER_13)
 	cfg = ast_config_load(SWIFT_CONFIG_FILE, config_flags);
+
+	if (cfg == CONFIG_STATUS_FILEUNCHANGED) {
+		ast_log(LOG_DEBUG, "Config %s is unchanged\n", SWIFT_CONFIG_FILE);
+		return 0;
+	} else if (cfg == CONFIG_STATUS_FILEINVALID) {
+		ast_log(LOG_ERROR, "Config file %s is in an invalid format\n", SWIFT_CONFIG_FILE);
+		return -1;
+	}
 #endif
 
-	if (cfg) {
-		if ((val = ast_variable_retrieve(cfg, "general", "buffer_size"))) {
-			cfg_buffer_size = atoi(val);
-			ast_log(LOG_DEBUG, "Config buffer_size is %d\n", cfg_buffer_size);
+	if (!cfg) {
+		ast_log(LOG_NOTICE, "Failed to load config\n");
+		return -1;
+	}
+
+	swift_set_defaults();
+
+	if ((val = ast_variable_retrieve(cfg, "general", "buffer_size"))) {
+		cfg_buffer_size = atoi(val);
+		ast_log(LOG_DEBUG, "Config buffer_size is %d\n", cfg_buffer_size);
+	}
+	if ((val = ast_variable_retrieve(cfg, "general", "max_buffer_memory"))) {
+		cfg_max_buffer_memory = strtoul(val, NULL, 10);
+		ast_log(LOG_DEBUG, "Config max_buffer_memory is %u\n", cfg_max_buffer_memory);
+	}
+	if ((val = ast_variable_retrieve(cfg, "general", "cache_size"))) {
+		cfg_cache_size = strtoul(val, NULL, 10);
+		ast_log(LOG_DEBUG, "Config cache_size is %u\n", cfg_cache_size);
+	}
+	if ((val = ast_variable_retrieve(cfg, "general", "cache_max_prompt"))) {
+		cfg_cache_max_prompt = strtoul(val, NULL, 10);
+		ast_log(LOG_DEBUG, "Config cache_max_prompt is %u\n", cfg_cache_max_prompt);
+	}
+	if ((val = ast_variable_retrieve(cfg, "general", "prompt_store"))) {
+		ast_copy_string(cfg_prompt_store, val, sizeof(cfg_prompt_store));
+		ast_log(LOG_DEBUG, "Config prompt_store is %s\n", cfg_prompt_store);
+	}
+	if ((val = ast_variable_retrieve(cfg, "general", "prompt_store_size"))) {
+		cfg_prompt_store_size = strtoul(val, NULL, 10);
+		ast_log(LOG_DEBUG, "Config prompt_store_size is %u\n", cfg_prompt_store_size);
+	}
+	if ((val = ast_variable_retrieve(cfg, "general", "ptime"))) {
+		cfg_ptime = strcasecmp(val, "auto") ? atoi(val) : 0;
+		ast_log(LOG_DEBUG, "Config ptime is %d\n", cfg_ptime);
+	}
+	if ((val = ast_variable_retrieve(cfg, "general", "format"))) {
+		if (strcasecmp(val, "auto") && !(cfg_format = swift_format_by_name(val))) {
+			ast_log(LOG_WARNING, "Unknown Swift format '%s', matching the channel\n", val);
 		}
-		if ((val = ast_variable_retrieve(cfg, "general", "goto_exten"))) {
-			if (!strcmp(val, "yes")) {
-				cfg_goto_exten = 1;
-			} else {
-				cfg_goto_exten = 0;
-				ast_log(LOG_DEBUG, "Config goto_exten is %d\n", cfg_goto_exten);
-			}
+		ast_log(LOG_DEBUG, "Config format is %s\n", cfg_format ? cfg_format->name : "auto");
+	}
+	if ((val = ast_variable_retrieve(cfg, "general", "segment_text"))) {
+		cfg_segment_text = ast_true(val);
+		ast_log(LOG_DEBUG, "Config segment_text is %d\n", cfg_segment_text);
+	}
+	if ((val = ast_variable_retrieve(cfg, "general", "trim_silence"))) {
+		cfg_trim_silence = ast_true(val);
+		ast_log(LOG_DEBUG, "Config trim_silence is %d\n", cfg_trim_silence);
+	}
+	if ((val = ast_variable_retrieve(cfg, "general", "silence_threshold"))) {
+		cfg_silence_threshold = atoi(val);
+		if (cfg_silence_threshold > 0) {
+			cfg_silence_threshold = -cfg_silence_threshold;
+		}
+		ast_log(LOG_DEBUG, "Config silence_threshold is %d\n", cfg_silence_threshold);
+	}
+	if ((val = ast_variable_retrieve(cfg, "general", "trim_tail"))) {
+		cfg_trim_tail = atoi(val);
+		if (cfg_trim_tail < 0) {
+			cfg_trim_tail = 0;
+		}
+		ast_log(LOG_DEBUG, "Config trim_tail is %d\n", cfg_trim_tail);
+	}
+	if ((val = ast_variable_retrieve(cfg, "general", "normalize"))) {
+		cfg_normalize = ast_false(val) ? 0 : atoi(val);
+		if (cfg_normalize > 0) {
+			cfg_normalize = -cfg_normalize;
+		}
+		ast_log(LOG_DEBUG, "Config normalize is %d\n", cfg_normalize);
+	}
+	if ((val = ast_variable_retrieve(cfg, "general", "max_prebuffer"))) {
+		cfg_max_prebuffer = atoi(val);
+		if (cfg_max_prebuffer < 0) {
+			cfg_max_prebuffer = 0;
+		}
+		ast_log(LOG_DEBUG, "Config max_prebuffer is %d\n", cfg_max_prebuffer);
+	}
+	if ((val = ast_variable_retrieve(cfg, "general", "goto_exten"))) {
+		if (!strcmp(val, "yes")) {
+			cfg_goto_exten = 1;
+		} else {
+			cfg_goto_exten = 0;
+			ast_log(LOG_DEBUG, "Config goto_exten is %d\n", cfg_goto_exten);
+		}
+	}
+	if ((val = ast_variable_retrieve(cfg, "general", "voice"))) {
+		ast_copy_string(cfg_voice, val, sizeof(cfg_voice));
+		ast_log(LOG_DEBUG, "Config voice is %s\n", cfg_voice);
+	}
+	if ((val = ast_variable_retrieve(cfg, "general", "voices"))) {
+		ast_copy_string(cfg_voices, val, sizeof(cfg_voices));
+		ast_log(LOG_DEBUG, "Config voices are %s\n", cfg_voices);
+	}
+	if ((val = ast_variable_retrieve(cfg, "general", "port_pool_size"))) {
+		cfg_port_pool_size = atoi(val);
+		if (cfg_port_pool_size < 0) {
+			cfg_port_pool_size = 0;
+		}
+		ast_log(LOG_DEBUG, "Config port_pool_size is %d\n", cfg_port_pool_size);
+	}
+	if ((val = ast_variable_retrieve(cfg, "general", "max_ports"))) {
+		cfg_max_ports = atoi(val);
+		if (cfg_max_ports < 0) {
+			cfg_max_ports = 0;
+		}
+		ast_log(LOG_DEBUG, "Config max_ports is %d\n", cfg_max_ports);
+	}
+	if ((val = ast_variable_retrieve(cfg, "general", "queue_size"))) {
+		cfg_queue_size = atoi(val);
+		ast_log(LOG_DEBUG, "Config queue_size is %d\n", cfg_queue_size);
+	}
+	if ((val = ast_variable_retrieve(cfg, "general", "queue_timeout"))) {
+		cfg_queue_timeout = atoi(val);
+		ast_log(LOG_DEBUG, "Config queue_timeout is %d\n", cfg_queue_timeout);
+	}
+	if ((val = ast_variable_retrieve(cfg, "general", "preload_workers"))) {
+		cfg_preload_workers = atoi(val);
+		ast_log(LOG_DEBUG, "Config preload_workers is %d\n", cfg_preload_workers);
+	}
+	if ((val = ast_variable_retrieve(cfg, "general", "synth_workers"))) {
+		cfg_synth_workers = atoi(val);
+		if (cfg_synth_workers < 0) {
+			cfg_synth_workers = 0;
+		} else if (cfg_synth_workers > SWIFT_SYNTH_MAX) {
+			ast_log(LOG_WARNING, "synth_workers of %d is more than %d, using %d\n", cfg_synth_workers,
+				SWIFT_SYNTH_MAX, SWIFT_SYNTH_MAX);
+			cfg_synth_workers = SWIFT_SYNTH_MAX;
+		}
+		ast_log(LOG_DEBUG, "Config synth_workers is %d\n", cfg_synth_workers);
+	}
+	if ((val = ast_variable_retrieve(cfg, "general", "synth_cpus"))) {
+		ast_copy_string(cfg_synth_cpus, val, sizeof(cfg_synth_cpus));
+		ast_log(LOG_DEBUG, "Config synth_cpus is %s\n", cfg_synth_cpus);
+	}
+	if ((val = ast_variable_retrieve(cfg, "general", "broker"))) {
+		ast_copy_string(cfg_broker, val, sizeof(cfg_broker));
+		ast_log(LOG_DEBUG, "Config broker is %s\n", cfg_broker);
+	}
+
+	/* voice[/format] => text, with "default" for the configured voice */
+	swift_preload_clear();
+	for (var = ast_variable_browse(cfg, "preload"); var; var = var->next) {
+		struct swift_prefetch *entry = NULL;
+		char *fmt;
+
+		if (ast_strlen_zero(var->value) || !(entry = ast_calloc(1, sizeof(*entry))) ||
+			!(entry->text = ast_strdup(var->value))) {
+			ast_free(entry);
+			continue;
 		}
-		if ((val = ast_variable_retrieve(cfg, "general", "voice"))) {
-			ast_copy_string(cfg_voice, val, sizeof(cfg_voice));
-			ast_log(LOG_DEBUG, "Config voice is %s\n", cfg_voice);
+		ast_copy_string(entry->voice, var->name, sizeof(entry->voice));
+		if ((fmt = strchr(entry->voice, '/'))) {
+			*fmt++ = '\0';
+			if (!(entry->format = swift_format_by_name(fmt))) {
+				ast_log(LOG_WARNING, "Unknown format '%s' for Swift preload, using the default\n", fmt);
+			}
 		}
+		ast_mutex_lock(&prefetch_lock);
+		AST_LIST_INSERT_TAIL(&preload_list, entry, list);
+		ast_mutex_unlock(&prefetch_lock);
+	}
 
-		ast_config_destroy(cfg);
-	} else {
-		ast_log(LOG_NOTICE, "Failed to load config\n");
+	ast_config_destroy(cfg);
+	return 1;
+}
+
+
+static int load_module(void)
+{
+	int res = 0;
+	struct swift_engine_ref *engine;
+
+	swift_set_defaults();
+	swift_load_config(0);
+	swift_pcm_init();
+	ast_cond_init(&port_released, NULL);
+	ast_cond_init(&chunk_cond, NULL);
+	ast_cond_init(&prefetch_cond, NULL);
+	ast_cond_init(&synth_cond, NULL);
+	ast_cond_init(&synth_done, NULL);
+	prefetch_shutdown = 0;
+
+	/* Open the engine once here rather than on every call; loading the
+	 * voice index and lexicons is the expensive part of getting started.
+	 */
+	if ((engine = swift_engine_ref_open()) == NULL) {
+		ast_cond_destroy(&port_released);
+		ast_cond_destroy(&chunk_cond);
+		ast_cond_destroy(&prefetch_cond);
+		ast_cond_destroy(&synth_cond);
+		ast_cond_destroy(&synth_done);
+		swift_preload_clear();
+		return AST_MODULE_LOAD_DECLINE;
+	}
+	swift_engine_replace(engine);
+	swift_port_pool_prewarm();
+	swift_store_open();
+	swift_synth_resize();
+
+#if (defined _AST_VER_1_6 || defined _AST_VER_1_4)
+	res = ast_register_application(app, app_exec, synopsis, descrip) ||
+		ast_register_application(template_app, template_exec, template_synopsis, template_descrip) ?
+#elif (defined _AST_VER_1_8 || defined _AST_VER_10 || defined _AST_VER_11 || defined _AST_VER_12 || defined _AST_VER_13)
+	res = ast_register_application_xml(app, app_exec) ||
+		ast_register_application_xml(template_app, template_exec) ?
+#endif
+		AST_MODULE_LOAD_DECLINE : AST_MODULE_LOAD_SUCCESS;
+	if (!res && ast_custom_function_register(&swift_prefetch_function)) {
+		res = AST_MODULE_LOAD_DECLINE;
+	}
+
+	if (res) {
+		ast_unregister_application(app);
+		ast_unregister_application(template_app);
+		swift_synth_shutdown();
+		swift_engine_replace(NULL);
+		swift_port_pool_flush();
+		swift_store_close();
+		ast_cond_destroy(&port_released);
+		ast_cond_destroy(&chunk_cond);
+		ast_cond_destroy(&prefetch_cond);
+		ast_cond_destroy(&synth_cond);
+		ast_cond_destroy(&synth_done);
+		swift_preload_clear();
+		return res;
 	}
 
+#if !defined _AST_VER_1_4
+	ast_cli_register_multiple(cli_swift, ARRAY_LEN(cli_swift));
+#endif
+#if (defined _AST_VER_1_4 || defined _AST_VER_1_6)
+	ast_manager_register2("SwiftStats", EVENT_FLAG_SYSTEM, manager_swift_stats,
+		"Show Swift statistics", "Reports the counters shown by 'swift show stats'.\n");
+#else
+	ast_manager_register_xml("SwiftStats", EVENT_FLAG_SYSTEM | EVENT_FLAG_REPORTING, manager_swift_stats);
+#endif
+
+	/* Render the greetings before the first calls need them */
+	swift_preload_start();
+
 	return res;
 }
 
-AST_MODULE_INFO_STANDARD(ASTERISK_GPL_KEY, "Cepstral Swift TTS Application");
+
+static int reload_module(void)
+{
+	struct swift_engine_ref *engine;
+
+	if (swift_load_config(1) <= 0) {
+		return 0;
+	}
+
+	/* max_ports may be set now, or the license changed */
+	ast_mutex_lock(&port_lock);
+	ports_learned = 0;
+	ast_mutex_unlock(&port_lock);
+
+	/* Stored prompts outlive the reload; the file may have been renamed */
+	swift_store_close();
+	swift_store_open();
+	swift_synth_resize();
+
+	/* Pick up any voices or lexicons installed since the engine was opened.
+	 * If the new engine will not open, keep running on the old one.
+	 */
+	if ((engine = swift_engine_ref_open()) == NULL) {
+		ast_log(LOG_WARNING, "Keeping the current Swift engine after failed reopen\n");
+		return 0;
+	}
+	swift_engine_replace(engine);
+
+	/* Ports on the old engine are closed as they come back in */
+	swift_port_pool_flush();
+	swift_port_pool_prewarm();
+
+	/* The new engine may render differently (new lexicons or voices) */
+	swift_cache_trim(1);
+	swift_preload_start();
+
+	return 0;
+}
+
+AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_DEFAULT, "Cepstral Swift TTS Application",
+	.load = load_module,
+	.unload = unload_module,
+	.reload = reload_module,
+);
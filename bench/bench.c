@@ -0,0 +1,412 @@
+/*
+ * app_swift benchmark harness -- simulated calls
+ *
+ * This program is free software, distributed under the terms of the GNU
+ * General Public License Version 2. See the LICENSE file at the top of the
+ * source tree for more information.
+ *
+ * Loads app_swift against the fake engine, runs callers concurrent calls
+ * to Swift() and reports what they saw: time to first audio, frame pacing,
+ * starvation, and the CPU and memory each call cost.  With -m it runs
+ * "swift render" on a manifest instead and reports how long that took.
+ */
+
+#include "bench.h"
+
+#include <getopt.h>
+#include <limits.h>
+#include <malloc.h>
+#include <sys/resource.h>
+
+#define BENCH_TTFA_MAX 10000     /* ms kept in the TTFA histogram */
+
+static int callers = 10;
+static int rounds = 1;
+static int stagger_ms = 20;
+static int ptime = 20;
+static int hangup_ms;
+static int dtmf_ms;
+static int same_text;
+static const char *manifest;
+static const char *text = "Thank you for calling.  Your account balance is one hundred and twelve dollars "
+	"and forty cents.  Your next payment is due on the fifteenth of the month.";
+static struct ast_format *format;
+static int (*swift_app)(struct ast_channel *chan, const char *data);
+
+/* Totals over all calls, under totals_lock */
+static pthread_mutex_t totals_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+	unsigned int calls;
+	unsigned int audio;           /* calls that played something */
+	unsigned int success, error, timeout, hangup;
+	unsigned int gaps;
+	unsigned int starved_calls;
+	unsigned int frames;
+	int64_t jitter_max_us;
+	int64_t thread_cpu_us;
+	int64_t ttfa_sum;
+	unsigned int ttfa_max;
+	unsigned int ttfa[BENCH_TTFA_MAX + 1];
+	unsigned int jitter[BENCH_JITTER_BUCKETS];
+} totals;
+
+/* Heap in use, sampled while the calls run */
+static volatile int sampling;
+static size_t heap_peak;
+
+static size_t heap_in_use(void)
+{
+#if defined __GLIBC__ && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+	struct mallinfo2 mi = mallinfo2();
+#else
+	struct mallinfo mi = mallinfo();
+#endif
+
+	return mi.uordblks + mi.hblkhd;
+}
+
+static void *heap_sampler(void *unused)
+{
+	size_t used;
+
+	while (sampling) {
+		if ((used = heap_in_use()) > heap_peak) {
+			heap_peak = used;
+		}
+		usleep(5000);
+	}
+	return NULL;
+}
+
+static int64_t cpu_us(int who)
+{
+	struct rusage ru;
+
+	getrusage(who, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * (int64_t) 1000000 +
+		ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static void bench_call(int caller, int round)
+{
+	const struct bench_chan_stats *stats;
+	struct ast_channel *chan;
+	char name[64], data[1024];
+	const char *status;
+	int64_t cpu = cpu_us(RUSAGE_THREAD), ttfa;
+	unsigned int i;
+	int res;
+
+	snprintf(name, sizeof(name), "Bench/%d-%d", caller, round);
+	if (!(chan = bench_channel_new(name, format, ptime))) {
+		return;
+	}
+	if (hangup_ms) {
+		bench_channel_hangup_after(chan, hangup_ms);
+	}
+	if (dtmf_ms) {
+		bench_channel_dtmf_after(chan, "1", dtmf_ms);
+	}
+
+	/* Unique text, so the prompt cache does not do all the work.  Commas
+	 * would split the arguments, as they do in the dialplan. */
+	if (same_text) {
+		snprintf(data, sizeof(data), "%s,%d,%d", text, dtmf_ms ? 1000 : 0, dtmf_ms ? 1 : 0);
+	} else {
+		snprintf(data, sizeof(data), "%s  Reference %d %d.,%d,%d", text, caller, round,
+			dtmf_ms ? 1000 : 0, dtmf_ms ? 1 : 0);
+	}
+	res = swift_app(chan, data);
+	cpu = cpu_us(RUSAGE_THREAD) - cpu;
+
+	stats = bench_channel_stats(chan);
+	status = pbx_builtin_getvar_helper(chan, "SWIFT_STATUS");
+	ttfa = stats->frames ? ast_tvdiff_ms(stats->first_write, stats->start) : -1;
+
+	pthread_mutex_lock(&totals_lock);
+	totals.calls++;
+	if (res < 0) {
+		totals.hangup++;
+	} else if (status && !strcmp(status, "SUCCESS")) {
+		totals.success++;
+	} else if (status && !strcmp(status, "TIMEOUT")) {
+		totals.timeout++;
+	} else {
+		totals.error++;
+	}
+	if (ttfa >= 0) {
+		totals.audio++;
+		totals.ttfa_sum += ttfa;
+		totals.ttfa[ttfa < BENCH_TTFA_MAX ? ttfa : BENCH_TTFA_MAX]++;
+		if (ttfa > totals.ttfa_max) {
+			totals.ttfa_max = ttfa;
+		}
+	}
+	totals.gaps += stats->gaps;
+	totals.starved_calls += stats->gaps ? 1 : 0;
+	totals.frames += stats->frames;
+	totals.thread_cpu_us += cpu;
+	if (stats->jitter_max_us > totals.jitter_max_us) {
+		totals.jitter_max_us = stats->jitter_max_us;
+	}
+	for (i = 0; i < BENCH_JITTER_BUCKETS; i++) {
+		totals.jitter[i] += stats->jitter[i];
+	}
+	pthread_mutex_unlock(&totals_lock);
+
+	if (bench_verbose) {
+		fprintf(stderr, "%s: %s, ttfa %lldms, %u frames, %u gaps, max jitter %.1fms\n", name,
+			res < 0 ? "HANGUP" : status ? status : "?", (long long) ttfa, stats->frames, stats->gaps,
+			stats->jitter_max_us / 1000.0);
+	}
+	bench_channel_free(chan);
+}
+
+static void *bench_caller(void *data)
+{
+	int caller = (intptr_t) data, round;
+
+	usleep(caller * stagger_ms * 1000);
+	for (round = 0; round < rounds; round++) {
+		bench_call(caller, round);
+	}
+	return NULL;
+}
+
+static unsigned int percentile(const unsigned int *hist, unsigned int buckets, unsigned int count, double p)
+{
+	unsigned int i, seen = 0, want = count * p;
+
+	for (i = 0; i < buckets; i++) {
+		if ((seen += hist[i]) > want) {
+			return i;
+		}
+	}
+	return buckets - 1;
+}
+
+/*! \brief Run "swift render" on the manifest and wait for it to finish. */
+static int bench_render(void)
+{
+	char line[PATH_MAX + 16], status[256];
+	struct timeval start = ast_tvnow();
+	int64_t cpu = cpu_us(RUSAGE_SELF);
+	int running;
+	FILE *f;
+
+	snprintf(line, sizeof(line), "swift render %s", manifest);
+	if (bench_cli(STDOUT_FILENO, line)) {
+		return 1;
+	}
+	do {
+		usleep(100000);
+		if (!(f = tmpfile())) {
+			return 1;
+		}
+		bench_cli(fileno(f), "swift render");
+		rewind(f);
+		running = 0;
+		while (fgets(status, sizeof(status), f)) {
+			running |= strstr(status, "rendering") != NULL;
+		}
+		fclose(f);
+	} while (running);
+
+	printf("\n");
+	bench_cli(STDOUT_FILENO, "swift render");
+	printf("Elapsed:        %.1fs, %.1fs of CPU\n", ast_tvdiff_ms(ast_tvnow(), start) / 1000.0,
+		(cpu_us(RUSAGE_SELF) - cpu) / 1000000.0);
+	printf("Engine:         %d requests, %d refused, peak %d at once, %d ports opened\n",
+		fake_swift_counters.speaks, fake_swift_counters.unavailable, fake_swift_counters.active_peak,
+		fake_swift_counters.ports_opened);
+	fflush(stdout);
+	bench_module->unload();
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  Calls\n"
+		"    -n callers      concurrent callers (%d)\n"
+		"    -r rounds       calls each caller makes, one after another (%d)\n"
+		"    -a ms           between callers starting (%d)\n"
+		"    -t text         text to speak, without commas\n"
+		"    -S              every call speaks the same text (exercises the cache)\n"
+		"    -f format       channel format: ulaw, alaw, slin or slin16 (ulaw)\n"
+		"    -p ms           channel frame size (%d)\n"
+		"    -k ms           hang up this long into each call\n"
+		"    -d ms           press a digit this long into each call\n"
+		"    -c file         swift.conf to load (defaults otherwise)\n"
+		"    -m manifest     run \"swift render\" on it instead of calls; relative\n"
+		"                    outputs go under %s/sounds\n"
+		"  Engine\n"
+		"    -x factor       time to render a second of audio, in seconds (%.2f)\n"
+		"    -w ms           extra latency to the first audio (%d)\n"
+		"    -b ms           audio per callback (%d)\n"
+		"    -s ms/n         stall for ms every n callbacks\n"
+		"    -e rate         share of requests refused with SWIFT_PORT_UNAVAILABLE (0)\n"
+		"    -L n            licensed ports, refusing requests beyond them (unlimited)\n"
+		"    -o ms           time to open a port (%d)\n"
+		"    -R cps          speaking rate in characters per second (%d)\n"
+		"  -v               log more (repeat for debug)\n",
+		prog, callers, rounds, stagger_ms, ptime, ast_config_AST_DATA_DIR, fake_swift.rtf, fake_swift.first_ms, fake_swift.burst_ms,
+		fake_swift.open_ms, fake_swift.chars_per_sec);
+}
+
+int main(int argc, char *argv[])
+{
+	struct timeval start;
+	pthread_t *threads, sampler;
+	size_t heap_base;
+	int64_t cpu, elapsed;
+	unsigned int jitter_count = 0;
+	int c, i;
+
+	format = ast_format_ulaw;
+	while ((c = getopt(argc, argv, "n:r:a:t:Sf:p:k:d:c:m:x:w:b:s:e:L:o:R:vh")) != -1) {
+		switch (c) {
+		case 'n':
+			callers = atoi(optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 'a':
+			stagger_ms = atoi(optarg);
+			break;
+		case 't':
+			text = optarg;
+			break;
+		case 'S':
+			same_text = 1;
+			break;
+		case 'f':
+			if (!(format = bench_format_by_name(optarg))) {
+				fprintf(stderr, "Unknown format %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'p':
+			ptime = atoi(optarg);
+			break;
+		case 'k':
+			hangup_ms = atoi(optarg);
+			break;
+		case 'd':
+			dtmf_ms = atoi(optarg);
+			break;
+		case 'c':
+			bench_config_file = optarg;
+			break;
+		case 'm':
+			manifest = optarg;
+			break;
+		case 'x':
+			fake_swift.rtf = atof(optarg);
+			break;
+		case 'w':
+			fake_swift.first_ms = atoi(optarg);
+			break;
+		case 'b':
+			fake_swift.burst_ms = atoi(optarg);
+			break;
+		case 's':
+			if (sscanf(optarg, "%d/%d", &fake_swift.stall_ms, &fake_swift.stall_every) != 2) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'e':
+			fake_swift.error_rate = atof(optarg);
+			break;
+		case 'L':
+			fake_swift.licenses = atoi(optarg);
+			break;
+		case 'o':
+			fake_swift.open_ms = atoi(optarg);
+			break;
+		case 'R':
+			fake_swift.chars_per_sec = atoi(optarg);
+			break;
+		case 'v':
+			bench_verbose++;
+			break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+	if (callers < 1 || rounds < 1 || ptime < 10 || fake_swift.chars_per_sec < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (bench_module->load() != AST_MODULE_LOAD_SUCCESS || !(swift_app = bench_find_app("Swift"))) {
+		fprintf(stderr, "app_swift failed to load\n");
+		return 1;
+	}
+	/* Let the port pool and any preloading settle first */
+	usleep(200000);
+	if (manifest) {
+		return bench_render();
+	}
+
+	if (!(threads = ast_calloc(callers, sizeof(*threads)))) {
+		return 1;
+	}
+	heap_base = heap_peak = heap_in_use();
+	sampling = 1;
+	pthread_create(&sampler, NULL, heap_sampler, NULL);
+	cpu = cpu_us(RUSAGE_SELF);
+	start = ast_tvnow();
+	for (i = 0; i < callers; i++) {
+		pthread_create(&threads[i], NULL, bench_caller, (void *) (intptr_t) i);
+	}
+	for (i = 0; i < callers; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	elapsed = ast_tvdiff_ms(ast_tvnow(), start);
+	cpu = cpu_us(RUSAGE_SELF) - cpu;
+	sampling = 0;
+	pthread_join(sampler, NULL);
+	ast_free(threads);
+
+	for (i = 0; i < BENCH_JITTER_BUCKETS; i++) {
+		jitter_count += totals.jitter[i];
+	}
+
+	printf("Calls:          %u in %.1fs (%d callers x %d), %u SUCCESS, %u ERROR, %u TIMEOUT, %u hung up\n",
+		totals.calls, elapsed / 1000.0, callers, rounds, totals.success, totals.error, totals.timeout,
+		totals.hangup);
+	if (totals.audio) {
+		printf("TTFA:           avg %lldms, p50 %ums, p90 %ums, p99 %ums, max %ums\n",
+			(long long) totals.ttfa_sum / totals.audio,
+			percentile(totals.ttfa, BENCH_TTFA_MAX + 1, totals.audio, 0.5),
+			percentile(totals.ttfa, BENCH_TTFA_MAX + 1, totals.audio, 0.9),
+			percentile(totals.ttfa, BENCH_TTFA_MAX + 1, totals.audio, 0.99), totals.ttfa_max);
+	}
+	if (jitter_count) {
+		printf("Frame jitter:   p50 %.1fms, p99 %.1fms, max %.1fms over %u frames\n",
+			percentile(totals.jitter, BENCH_JITTER_BUCKETS, jitter_count, 0.5) * BENCH_JITTER_US / 1000.0,
+			percentile(totals.jitter, BENCH_JITTER_BUCKETS, jitter_count, 0.99) * BENCH_JITTER_US / 1000.0,
+			totals.jitter_max_us / 1000.0, totals.frames);
+	}
+	printf("Starvation:     %u empty frame ticks, in %u of %u calls\n", totals.gaps, totals.starved_calls,
+		totals.calls);
+	printf("CPU per call:   %.2fms in the call's thread, %.2fms in all\n",
+		totals.thread_cpu_us / 1000.0 / totals.calls, cpu / 1000.0 / totals.calls);
+	printf("Memory:         %zuKB peak heap per concurrent call\n",
+		(heap_peak > heap_base ? heap_peak - heap_base : 0) / 1024 / callers);
+	printf("Engine:         %d requests, %d refused, %d stopped early, peak %d at once, %d ports opened\n",
+		fake_swift_counters.speaks, fake_swift_counters.unavailable, fake_swift_counters.stopped,
+		fake_swift_counters.active_peak, fake_swift_counters.ports_opened);
+	printf("Engine threads: %d started for background requests\n", fake_swift_counters.threads);
+	printf("\n");
+	fflush(stdout);
+	bench_cli(STDOUT_FILENO, "swift show stats");
+
+	bench_module->unload();
+	return 0;
+}
@@ -0,0 +1,78 @@
+/*
+ * app_swift benchmark harness
+ *
+ * This program is free software, distributed under the terms of the GNU
+ * General Public License Version 2. See the LICENSE file at the top of the
+ * source tree for more information.
+ *
+ * The harness builds app_swift.c unchanged against a fake channel layer
+ * (fake_asterisk.c) and a fake Swift engine (fake_swift.c), and drives it
+ * with simulated calls (bench.c).
+ */
+
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include "asterisk.h"
+#include <swift.h>
+
+/* Frame pacing is kept in a histogram of 100us buckets */
+#define BENCH_JITTER_US 100
+#define BENCH_JITTER_BUCKETS 512
+
+/*! \brief What a simulated channel saw of the audio written to it. */
+struct bench_chan_stats {
+	struct timeval start;          /* channel was created */
+	struct timeval first_write;    /* first frame of audio */
+	struct timeval last_write;
+	unsigned int frames;
+	unsigned int bytes;
+	unsigned int gaps;             /* frame ticks that sent nothing once audio started */
+	int64_t jitter_max_us;         /* worst gap between frames against their length */
+	unsigned int jitter[BENCH_JITTER_BUCKETS];
+};
+
+/*! \brief How the fake engine behaves. */
+struct fake_swift_opts {
+	double rtf;                    /* seconds of work per second of audio */
+	int first_ms;                  /* extra delay before the first audio */
+	int burst_ms;                  /* audio per callback */
+	int stall_ms;                  /* engine stalls for this long... */
+	int stall_every;               /* ...every so many bursts */
+	double error_rate;             /* share of requests refused with SWIFT_PORT_UNAVAILABLE */
+	int licenses;                  /* concurrent syntheses allowed, 0 for no limit */
+	int chars_per_sec;             /* speaking rate */
+	int open_ms;                   /* time to open a port */
+};
+
+/*! \brief What the fake engine did. */
+struct fake_swift_counters {
+	int ports_open;
+	int ports_opened;
+	int active;
+	int active_peak;
+	int speaks;
+	int threads;                   /* started for background requests */
+	int unavailable;
+	int stopped;
+	int64_t audio_bytes;
+};
+
+extern struct fake_swift_opts fake_swift;
+extern struct fake_swift_counters fake_swift_counters;
+
+/* fake_asterisk.c */
+extern int bench_verbose;
+extern const char *bench_config_file;
+extern const struct ast_module_info *bench_module;
+
+struct ast_format *bench_format_by_name(const char *name);
+struct ast_channel *bench_channel_new(const char *name, struct ast_format *format, int ptime);
+void bench_channel_hangup_after(struct ast_channel *chan, int ms);
+void bench_channel_dtmf_after(struct ast_channel *chan, const char *digits, int ms);
+const struct bench_chan_stats *bench_channel_stats(const struct ast_channel *chan);
+void bench_channel_free(struct ast_channel *chan);
+int (*bench_find_app(const char *name))(struct ast_channel *chan, const char *data);
+int bench_cli(int fd, const char *line);
+
+#endif /* _BENCH_H */
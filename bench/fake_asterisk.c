@@ -0,0 +1,1031 @@
+/*
+ * app_swift benchmark harness -- a fake Asterisk
+ *
+ * This program is free software, distributed under the terms of the GNU
+ * General Public License Version 2. See the LICENSE file at the top of the
+ * source tree for more information.
+ *
+ * Channels here have no media of their own.  A channel's frame clock ticks
+ * every ptime in ast_waitfor()/ast_read(), which drive its generator the
+ * way a timing source would in Asterisk, and ast_write() only keeps count
+ * of what arrives and when.
+ */
+
+#include "bench.h"
+
+#include <ctype.h>
+#include <sys/stat.h>
+#include <time.h>
+
+int bench_verbose;
+const char *bench_config_file;
+
+/* Logging */
+
+static const char * const log_levels[] = { "DEBUG", "", "NOTICE", "WARNING", "ERROR" };
+
+void ast_log(int level, const char *file, int line, const char *function, const char *fmt, ...)
+{
+	va_list ap;
+
+	if ((level == __LOG_DEBUG && bench_verbose < 2) || (level < __LOG_ERROR && bench_verbose < 1)) {
+		return;
+	}
+	flockfile(stderr);
+	fprintf(stderr, "%s[%lu]: %s:%d %s: ", log_levels[level], (unsigned long) pthread_self() % 100000,
+		file, line, function);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	funlockfile(stderr);
+}
+
+int ast_pthread_create_detached(pthread_t *thread, pthread_attr_t *attr, void *(*start_routine)(void *), void *data)
+{
+	pthread_attr_t detached;
+	int res;
+
+	pthread_attr_init(&detached);
+	pthread_attr_setdetachstate(&detached, PTHREAD_CREATE_DETACHED);
+	res = pthread_create(thread, &detached, start_routine, data);
+	pthread_attr_destroy(&detached);
+	return res;
+}
+
+/* Strings */
+
+void ast_copy_string(char *dst, const char *src, size_t size)
+{
+	while (*src && size > 1) {
+		*dst++ = *src++;
+		size--;
+	}
+	if (size) {
+		*dst = '\0';
+	}
+}
+
+char *ast_skip_blanks(const char *str)
+{
+	while (*str && ((unsigned char) *str) < 33) {
+		str++;
+	}
+	return (char *) str;
+}
+
+const char *ast_config_AST_DATA_DIR = "/tmp/swift_bench_data";
+
+int ast_mkdir(const char *path, int mode)
+{
+	char *copy = ast_strdupa(path), *p;
+
+	for (p = copy + 1; *p; p++) {
+		if (*p == '/') {
+			*p = '\0';
+			if (mkdir(copy, mode) && errno != EEXIST) {
+				return errno;
+			}
+			*p = '/';
+		}
+	}
+	if (mkdir(copy, mode) && errno != EEXIST) {
+		return errno;
+	}
+	return 0;
+}
+
+char *ast_strip(char *s)
+{
+	char *end;
+
+	if (!s) {
+		return s;
+	}
+	s = ast_skip_blanks(s);
+	end = s + strlen(s) - 1;
+	while (end >= s && ((unsigned char) *end) < 33) {
+		*end-- = '\0';
+	}
+	return s;
+}
+
+int ast_true(const char *s)
+{
+	return !ast_strlen_zero(s) && (!strcasecmp(s, "yes") || !strcasecmp(s, "true") ||
+		!strcasecmp(s, "y") || !strcasecmp(s, "t") || !strcasecmp(s, "1") || !strcasecmp(s, "on"));
+}
+
+int ast_false(const char *s)
+{
+	return !ast_strlen_zero(s) && (!strcasecmp(s, "no") || !strcasecmp(s, "false") ||
+		!strcasecmp(s, "n") || !strcasecmp(s, "f") || !strcasecmp(s, "0") || !strcasecmp(s, "off"));
+}
+
+/* Time */
+
+struct timeval ast_tvnow(void)
+{
+	struct timeval t;
+
+	gettimeofday(&t, NULL);
+	return t;
+}
+
+struct timeval ast_tv(time_t sec, suseconds_t usec)
+{
+	struct timeval t = { sec, usec };
+
+	return t;
+}
+
+static struct timeval tvfix(struct timeval a)
+{
+	while (a.tv_usec >= 1000000) {
+		a.tv_sec++;
+		a.tv_usec -= 1000000;
+	}
+	while (a.tv_usec < 0) {
+		a.tv_sec--;
+		a.tv_usec += 1000000;
+	}
+	return a;
+}
+
+struct timeval ast_tvadd(struct timeval a, struct timeval b)
+{
+	a.tv_sec += b.tv_sec;
+	a.tv_usec += b.tv_usec;
+	return tvfix(a);
+}
+
+struct timeval ast_tvsub(struct timeval a, struct timeval b)
+{
+	a.tv_sec -= b.tv_sec;
+	a.tv_usec -= b.tv_usec;
+	return tvfix(a);
+}
+
+struct timeval ast_samp2tv(unsigned int samples, unsigned int rate)
+{
+	return ast_tv(samples / rate, (samples % rate) * (1000000 / rate));
+}
+
+int ast_tvcmp(struct timeval a, struct timeval b)
+{
+	if (a.tv_sec != b.tv_sec) {
+		return a.tv_sec < b.tv_sec ? -1 : 1;
+	}
+	if (a.tv_usec != b.tv_usec) {
+		return a.tv_usec < b.tv_usec ? -1 : 1;
+	}
+	return 0;
+}
+
+int ast_tvzero(const struct timeval t)
+{
+	return t.tv_sec == 0 && t.tv_usec == 0;
+}
+
+int64_t ast_tvdiff_us(struct timeval end, struct timeval start)
+{
+	return (end.tv_sec - start.tv_sec) * (int64_t) 1000000 + end.tv_usec - start.tv_usec;
+}
+
+int64_t ast_tvdiff_ms(struct timeval end, struct timeval start)
+{
+	return ast_tvdiff_us(end, start) / 1000;
+}
+
+static void sleep_until(struct timeval t)
+{
+	struct timespec ts = { t.tv_sec, t.tv_usec * 1000 };
+
+	while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+	}
+}
+
+/* G.711, as in Asterisk's ulaw.c and alaw.c */
+
+unsigned char __ast_lin2mu[16384];
+short __ast_mulaw[256];
+unsigned char __ast_lin2a[8192];
+short __ast_alaw[256];
+
+static unsigned char linear2ulaw(int sample)
+{
+	int sign = (sample >> 8) & 0x80, exponent = 7, mask;
+
+	if (sign) {
+		sample = -sample;
+	}
+	if (sample > 32635) {
+		sample = 32635;
+	}
+	sample += 0x84;
+	for (mask = 0x4000; !(sample & mask) && exponent > 0; exponent--, mask >>= 1) {
+	}
+	return ~(sign | (exponent << 4) | ((sample >> (exponent + 3)) & 0x0f));
+}
+
+static short ulaw2linear(unsigned char u)
+{
+	int exponent, sample;
+
+	u = ~u;
+	exponent = (u >> 4) & 0x07;
+	sample = ((((u & 0x0f) << 3) + 0x84) << exponent) - 0x84;
+	return (u & 0x80) ? -sample : sample;
+}
+
+static unsigned char linear2alaw(int sample)
+{
+	static const int seg_end[8] = { 0xff, 0x1ff, 0x3ff, 0x7ff, 0xfff, 0x1fff, 0x3fff, 0x7fff };
+	int mask, seg, aval;
+
+	if (sample >= 0) {
+		mask = 0xd5;
+	} else {
+		mask = 0x55;
+		sample = -sample - 1;
+	}
+	for (seg = 0; seg < 8 && sample > seg_end[seg]; seg++) {
+	}
+	if (seg >= 8) {
+		return 0x7f ^ mask;
+	}
+	aval = seg << 4;
+	aval |= seg < 2 ? (sample >> 4) & 0x0f : (sample >> (seg + 3)) & 0x0f;
+	return aval ^ mask;
+}
+
+static short alaw2linear(unsigned char a)
+{
+	int t, seg;
+
+	a ^= 0x55;
+	t = (a & 0x0f) << 4;
+	seg = (a & 0x70) >> 4;
+	if (seg == 0) {
+		t += 8;
+	} else {
+		t = (t + 0x108) << (seg - 1);
+	}
+	return (a & 0x80) ? t : -t;
+}
+
+static void __attribute__((constructor)) bench_g711_init(void)
+{
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		__ast_mulaw[i] = ulaw2linear(i);
+		__ast_alaw[i] = alaw2linear(i);
+	}
+	for (i = 0; i < 16384; i++) {
+		__ast_lin2mu[i] = linear2ulaw((short) (i << 2));
+	}
+	for (i = 0; i < 8192; i++) {
+		__ast_lin2a[i] = linear2alaw((short) (i << 3));
+	}
+}
+
+/* Formats */
+
+struct ast_format {
+	const char *name;
+	unsigned int rate;
+};
+
+struct ast_format_cap {
+	struct ast_format *format;
+	unsigned int framing;
+};
+
+static struct ast_format formats[] = {
+	{ "ulaw", 8000 },
+	{ "alaw", 8000 },
+	{ "slin", 8000 },
+	{ "slin16", 16000 },
+};
+
+struct ast_format *ast_format_ulaw = &formats[0];
+struct ast_format *ast_format_alaw = &formats[1];
+struct ast_format *ast_format_slin = &formats[2];
+struct ast_format *ast_format_slin16 = &formats[3];
+
+struct ast_format *bench_format_by_name(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_LEN(formats); i++) {
+		if (!strcasecmp(formats[i].name, name)) {
+			return &formats[i];
+		}
+	}
+	return NULL;
+}
+
+enum ast_format_cmp_res ast_format_cmp(const struct ast_format *format1, const struct ast_format *format2)
+{
+	return format1 == format2 ? AST_FORMAT_CMP_EQUAL : AST_FORMAT_CMP_NOT_EQUAL;
+}
+
+unsigned int ast_format_get_sample_rate(const struct ast_format *format)
+{
+	return format->rate;
+}
+
+const char *ast_format_get_name(const struct ast_format *format)
+{
+	return format->name;
+}
+
+unsigned int ast_format_cap_get_format_framing(const struct ast_format_cap *cap, const struct ast_format *format)
+{
+	return cap->framing;
+}
+
+void ao2_cleanup(void *obj)
+{
+}
+
+void ast_frfree(struct ast_frame *fr)
+{
+}
+
+/* Channels */
+
+struct bench_var {
+	char *name;
+	char *value;
+	struct bench_var *next;
+};
+
+struct ast_channel {
+	char name[80];
+	char context[80];
+	char exten[80];
+	int priority;
+	enum ast_channel_state state;
+	struct ast_party_caller caller;
+	struct ast_format *writeformat;
+	struct ast_format_cap nativeformats;
+	struct bench_var *vars;
+	/* Frame clock */
+	struct timeval next_tick;
+	struct timeval hangup_at;
+	struct timeval dtmf_at;
+	const char *dtmf;
+	int hungup;
+	struct ast_generator *generator;
+	void *generatordata;
+	struct ast_frame fr;
+	/* What was written */
+	int gap;
+	unsigned int last_samples;
+	struct bench_chan_stats stats;
+};
+
+struct ast_channel *bench_channel_new(const char *name, struct ast_format *format, int ptime)
+{
+	struct ast_channel *chan;
+
+	if (!(chan = ast_calloc(1, sizeof(*chan)))) {
+		return NULL;
+	}
+	ast_copy_string(chan->name, name, sizeof(chan->name));
+	ast_copy_string(chan->context, "default", sizeof(chan->context));
+	ast_copy_string(chan->exten, "s", sizeof(chan->exten));
+	chan->priority = 1;
+	chan->state = AST_STATE_RING;
+	chan->writeformat = format;
+	chan->nativeformats.format = format;
+	chan->nativeformats.framing = ptime;
+	chan->stats.start = ast_tvnow();
+	chan->next_tick = ast_tvadd(chan->stats.start, ast_tv(0, ptime * 1000));
+	return chan;
+}
+
+void bench_channel_hangup_after(struct ast_channel *chan, int ms)
+{
+	chan->hangup_at = ast_tvadd(chan->stats.start, ast_tv(ms / 1000, (ms % 1000) * 1000));
+}
+
+void bench_channel_dtmf_after(struct ast_channel *chan, const char *digits, int ms)
+{
+	chan->dtmf = digits;
+	chan->dtmf_at = ast_tvadd(chan->stats.start, ast_tv(ms / 1000, (ms % 1000) * 1000));
+}
+
+const struct bench_chan_stats *bench_channel_stats(const struct ast_channel *chan)
+{
+	return &chan->stats;
+}
+
+void bench_channel_free(struct ast_channel *chan)
+{
+	struct bench_var *var;
+
+	while ((var = chan->vars)) {
+		chan->vars = var->next;
+		ast_free(var->name);
+		ast_free(var->value);
+		ast_free(var);
+	}
+	ast_free(chan);
+}
+
+const char *ast_channel_name(const struct ast_channel *chan)
+{
+	return chan->name;
+}
+
+const char *ast_channel_context(const struct ast_channel *chan)
+{
+	return chan->context;
+}
+
+void ast_channel_exten_set(struct ast_channel *chan, const char *value)
+{
+	ast_copy_string(chan->exten, value, sizeof(chan->exten));
+}
+
+void ast_channel_priority_set(struct ast_channel *chan, int value)
+{
+	chan->priority = value;
+}
+
+enum ast_channel_state ast_channel_state(const struct ast_channel *chan)
+{
+	return chan->state;
+}
+
+struct ast_party_caller *ast_channel_caller(struct ast_channel *chan)
+{
+	return &chan->caller;
+}
+
+struct ast_format *ast_channel_writeformat(struct ast_channel *chan)
+{
+	return chan->writeformat;
+}
+
+struct ast_format *ast_channel_rawwriteformat(struct ast_channel *chan)
+{
+	return chan->nativeformats.format;
+}
+
+struct ast_format_cap *ast_channel_nativeformats(const struct ast_channel *chan)
+{
+	return (struct ast_format_cap *) &chan->nativeformats;
+}
+
+int ast_answer(struct ast_channel *chan)
+{
+	chan->state = AST_STATE_UP;
+	return 0;
+}
+
+int ast_stopstream(struct ast_channel *chan)
+{
+	return 0;
+}
+
+int ast_set_write_format(struct ast_channel *chan, struct ast_format *format)
+{
+	chan->writeformat = format;
+	return 0;
+}
+
+static int channel_hungup(struct ast_channel *chan, struct timeval now)
+{
+	if (!chan->hungup && !ast_tvzero(chan->hangup_at) && ast_tvcmp(now, chan->hangup_at) >= 0) {
+		chan->hungup = 1;
+	}
+	return chan->hungup;
+}
+
+static int channel_digit_due(struct ast_channel *chan, struct timeval now)
+{
+	return !ast_strlen_zero(chan->dtmf) && ast_tvcmp(now, chan->dtmf_at) >= 0;
+}
+
+static char channel_take_digit(struct ast_channel *chan)
+{
+	char digit = *chan->dtmf++;
+
+	/* Any further digits follow at a typical dialling pace */
+	chan->dtmf_at = ast_tvadd(chan->dtmf_at, ast_tv(0, 150000));
+	return digit;
+}
+
+/*! \brief Wait for the next tick of the frame clock, a digit or hangup. */
+int ast_waitfor(struct ast_channel *chan, int ms)
+{
+	struct timeval start = ast_tvnow(), now = start, until = chan->next_tick, limit;
+
+	if (channel_hungup(chan, now)) {
+		return -1;
+	}
+	if (!ast_tvzero(chan->hangup_at) && ast_tvcmp(chan->hangup_at, until) < 0) {
+		until = chan->hangup_at;
+	}
+	if (!ast_strlen_zero(chan->dtmf) && ast_tvcmp(chan->dtmf_at, until) < 0) {
+		until = chan->dtmf_at;
+	}
+	if (ms >= 0) {
+		limit = ast_tvadd(now, ast_tv(ms / 1000, (ms % 1000) * 1000));
+		if (ast_tvcmp(limit, until) < 0) {
+			sleep_until(limit);
+			return channel_hungup(chan, ast_tvnow()) ? -1 : 0;
+		}
+	}
+	sleep_until(until);
+	now = ast_tvnow();
+	if (channel_hungup(chan, now)) {
+		return -1;
+	}
+	if (ms < 0) {
+		return 1;
+	}
+	ms -= ast_tvdiff_ms(now, start);
+	return ms > 0 ? ms : 1;
+}
+
+/*! \brief Run the generator for a tick of the frame clock, or hand back
+ * a digit that is due. */
+struct ast_frame *ast_read(struct ast_channel *chan)
+{
+	struct timeval now = ast_tvnow();
+	unsigned int frames;
+
+	memset(&chan->fr, 0, sizeof(chan->fr));
+	if (channel_hungup(chan, now)) {
+		return NULL;
+	}
+	if (channel_digit_due(chan, now)) {
+		chan->fr.frametype = AST_FRAME_DTMF;
+		chan->fr.subclass.integer = channel_take_digit(chan);
+		return &chan->fr;
+	}
+
+	chan->fr.frametype = AST_FRAME_NULL;
+	if (ast_tvcmp(now, chan->next_tick) < 0) {
+		return &chan->fr;
+	}
+	chan->next_tick = ast_tvadd(chan->next_tick, ast_tv(0, chan->nativeformats.framing * 1000));
+	if (chan->generator) {
+		frames = chan->stats.frames;
+		if (chan->generator->generate(chan, chan->generatordata, 0,
+			chan->nativeformats.framing * chan->writeformat->rate / 1000) < 0) {
+			ast_deactivate_generator(chan);
+		} else if (frames == chan->stats.frames && chan->stats.frames) {
+			chan->stats.gaps++;
+			chan->gap = 1;
+		}
+	}
+	return &chan->fr;
+}
+
+int ast_waitfordigit(struct ast_channel *chan, int ms)
+{
+	struct timeval now = ast_tvnow(), until = ast_tvadd(now, ast_tv(ms / 1000, (ms % 1000) * 1000));
+
+	if (!ast_strlen_zero(chan->dtmf) && ast_tvcmp(chan->dtmf_at, until) < 0) {
+		until = chan->dtmf_at;
+	}
+	if (!ast_tvzero(chan->hangup_at) && ast_tvcmp(chan->hangup_at, until) < 0) {
+		until = chan->hangup_at;
+	}
+	sleep_until(until);
+	now = ast_tvnow();
+	if (channel_hungup(chan, now)) {
+		return -1;
+	}
+	return channel_digit_due(chan, now) ? channel_take_digit(chan) : 0;
+}
+
+/*! \brief Count a frame and how far its arrival strays from the length
+ * of the one before it.  Intervals spanning a starved tick are left to
+ * the gap count instead. */
+int ast_write(struct ast_channel *chan, struct ast_frame *frame)
+{
+	struct bench_chan_stats *stats = &chan->stats;
+	struct timeval now = ast_tvnow();
+	int64_t jitter;
+	unsigned int bucket;
+
+	if (chan->hungup) {
+		return -1;
+	}
+	if (!stats->frames) {
+		stats->first_write = now;
+	} else if (!chan->gap) {
+		jitter = ast_tvdiff_us(now, stats->last_write) -
+			(int64_t) chan->last_samples * 1000000 / chan->writeformat->rate;
+		if (jitter < 0) {
+			jitter = -jitter;
+		}
+		if (jitter > stats->jitter_max_us) {
+			stats->jitter_max_us = jitter;
+		}
+		bucket = jitter / BENCH_JITTER_US;
+		stats->jitter[bucket < BENCH_JITTER_BUCKETS ? bucket : BENCH_JITTER_BUCKETS - 1]++;
+	}
+	chan->gap = 0;
+	chan->last_samples = frame->samples;
+	stats->last_write = now;
+	stats->frames++;
+	stats->bytes += frame->datalen;
+	return 0;
+}
+
+int ast_activate_generator(struct ast_channel *chan, struct ast_generator *gen, void *params)
+{
+	void *data;
+
+	if (chan->generator) {
+		ast_deactivate_generator(chan);
+	}
+	if (gen->alloc && !(data = gen->alloc(chan, params))) {
+		return -1;
+	}
+	chan->generator = gen;
+	chan->generatordata = gen->alloc ? data : params;
+	return 0;
+}
+
+void ast_deactivate_generator(struct ast_channel *chan)
+{
+	if (chan->generator && chan->generator->release) {
+		chan->generator->release(chan, chan->generatordata);
+	}
+	chan->generator = NULL;
+	chan->generatordata = NULL;
+}
+
+/* PBX */
+
+int ast_exists_extension(struct ast_channel *c, const char *context, const char *exten, int priority, const char *callerid)
+{
+	return 0;
+}
+
+const char *pbx_builtin_getvar_helper(struct ast_channel *chan, const char *name)
+{
+	struct bench_var *var;
+
+	for (var = chan ? chan->vars : NULL; var; var = var->next) {
+		if (!strcmp(var->name, name)) {
+			return var->value;
+		}
+	}
+	return NULL;
+}
+
+int pbx_builtin_setvar_helper(struct ast_channel *chan, const char *name, const char *value)
+{
+	struct bench_var *var;
+
+	if (!chan) {
+		return 0;
+	}
+	for (var = chan->vars; var; var = var->next) {
+		if (!strcmp(var->name, name)) {
+			ast_free(var->value);
+			var->value = ast_strdup(value ? value : "");
+			return 0;
+		}
+	}
+	if (!(var = ast_calloc(1, sizeof(*var)))) {
+		return -1;
+	}
+	var->name = ast_strdup(name);
+	var->value = ast_strdup(value ? value : "");
+	var->next = chan->vars;
+	chan->vars = var;
+	return 0;
+}
+
+int ast_custom_function_register(struct ast_custom_function *acf)
+{
+	return 0;
+}
+
+int ast_custom_function_unregister(struct ast_custom_function *acf)
+{
+	return 0;
+}
+
+/* Applications */
+
+unsigned int __ast_app_separate_args(char *buf, char delim, int remove_chars, char **array, int arraylen)
+{
+	int argc = 0;
+
+	if (!buf || !arraylen) {
+		return 0;
+	}
+	memset(array, 0, arraylen * sizeof(*array));
+	while (argc < arraylen - 1 && buf) {
+		array[argc++] = buf;
+		if ((buf = strchr(buf, delim))) {
+			*buf++ = '\0';
+		}
+	}
+	if (buf) {
+		array[argc++] = buf;
+	}
+	return argc;
+}
+
+#define BENCH_MAX_APPS 8
+
+static struct {
+	const char *name;
+	int (*execute)(struct ast_channel *, const char *);
+} apps[BENCH_MAX_APPS];
+
+int ast_register_application_xml(const char *app, int (*execute)(struct ast_channel *, const char *))
+{
+	unsigned int i;
+
+	for (i = 0; i < BENCH_MAX_APPS; i++) {
+		if (!apps[i].name) {
+			apps[i].name = app;
+			apps[i].execute = execute;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+int ast_unregister_application(const char *app)
+{
+	unsigned int i;
+
+	for (i = 0; i < BENCH_MAX_APPS; i++) {
+		if (apps[i].name && !strcasecmp(apps[i].name, app)) {
+			apps[i].name = NULL;
+			apps[i].execute = NULL;
+		}
+	}
+	return 0;
+}
+
+int (*bench_find_app(const char *name))(struct ast_channel *chan, const char *data)
+{
+	unsigned int i;
+
+	for (i = 0; i < BENCH_MAX_APPS; i++) {
+		if (apps[i].name && !strcasecmp(apps[i].name, name)) {
+			return apps[i].execute;
+		}
+	}
+	return NULL;
+}
+
+/* Modules */
+
+static int module_users;
+
+struct ast_module_user *ast_module_user_add(struct ast_channel *chan)
+{
+	ast_atomic_fetchadd_int(&module_users, 1);
+	return (struct ast_module_user *) chan;
+}
+
+void ast_module_user_remove(struct ast_module_user *user)
+{
+	ast_atomic_fetchadd_int(&module_users, -1);
+}
+
+void ast_module_user_hangup_all(void)
+{
+}
+
+/* Configuration: the ini format of the real thing, without templates or
+ * #include, read from bench_config_file whatever file is asked for. */
+
+struct bench_category {
+	char *name;
+	struct ast_variable *vars;
+	struct ast_variable *last;
+	struct bench_category *next;
+};
+
+struct ast_config {
+	struct bench_category *categories;
+	struct bench_category *last;
+};
+
+struct ast_config *ast_config_load(const char *filename, struct ast_flags flags)
+{
+	struct ast_config *cfg;
+	struct bench_category *cat = NULL;
+	struct ast_variable *var;
+	char line[1024], *s, *value;
+	FILE *f;
+
+	if (!bench_config_file || !(f = fopen(bench_config_file, "r"))) {
+		return CONFIG_STATUS_FILEMISSING;
+	}
+	if (!(cfg = ast_calloc(1, sizeof(*cfg)))) {
+		fclose(f);
+		return NULL;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if ((s = strchr(line, ';'))) {
+			*s = '\0';
+		}
+		s = ast_strip(line);
+		if (*s == '[') {
+			if (!(value = strchr(s, ']')) || !(cat = ast_calloc(1, sizeof(*cat)))) {
+				continue;
+			}
+			*value = '\0';
+			cat->name = ast_strdup(s + 1);
+			if (cfg->last) {
+				cfg->last->next = cat;
+			} else {
+				cfg->categories = cat;
+			}
+			cfg->last = cat;
+		} else if (cat && (value = strchr(s, '='))) {
+			*value++ = '\0';
+			if (*value == '>') {
+				value++;
+			}
+			if (!(var = ast_calloc(1, sizeof(*var)))) {
+				continue;
+			}
+			var->name = ast_strdup(ast_strip(s));
+			var->value = ast_strdup(ast_strip(value));
+			if (cat->last) {
+				cat->last->next = var;
+			} else {
+				cat->vars = var;
+			}
+			cat->last = var;
+		}
+	}
+	fclose(f);
+	return cfg;
+}
+
+void ast_config_destroy(struct ast_config *cfg)
+{
+	struct bench_category *cat;
+	struct ast_variable *var;
+
+	if (!cfg) {
+		return;
+	}
+	while ((cat = cfg->categories)) {
+		cfg->categories = cat->next;
+		while ((var = cat->vars)) {
+			cat->vars = var->next;
+			ast_free((char *) var->name);
+			ast_free((char *) var->value);
+			ast_free(var);
+		}
+		ast_free(cat->name);
+		ast_free(cat);
+	}
+	ast_free(cfg);
+}
+
+struct ast_variable *ast_variable_browse(const struct ast_config *cfg, const char *category)
+{
+	struct bench_category *cat;
+
+	for (cat = cfg->categories; cat; cat = cat->next) {
+		if (!strcasecmp(cat->name, category)) {
+			return cat->vars;
+		}
+	}
+	return NULL;
+}
+
+const char *ast_variable_retrieve(struct ast_config *cfg, const char *category, const char *variable)
+{
+	struct ast_variable *var;
+
+	for (var = ast_variable_browse(cfg, category); var; var = var->next) {
+		if (!strcasecmp(var->name, variable)) {
+			return var->value;
+		}
+	}
+	return NULL;
+}
+
+/* CLI */
+
+#define BENCH_MAX_CLI 32
+
+static struct ast_cli_entry *cli_entries[BENCH_MAX_CLI];
+
+void ast_cli(int fd, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vdprintf(fd, fmt, ap);
+	va_end(ap);
+}
+
+int ast_cli_register_multiple(struct ast_cli_entry *e, int len)
+{
+	int i, j;
+
+	for (i = 0; i < len; i++) {
+		e[i].handler(&e[i], CLI_INIT, NULL);
+		for (j = 0; j < BENCH_MAX_CLI && cli_entries[j]; j++) {
+		}
+		if (j == BENCH_MAX_CLI) {
+			return -1;
+		}
+		cli_entries[j] = &e[i];
+	}
+	return 0;
+}
+
+int ast_cli_unregister_multiple(struct ast_cli_entry *e, int len)
+{
+	int i, j;
+
+	for (i = 0; i < len; i++) {
+		for (j = 0; j < BENCH_MAX_CLI; j++) {
+			if (cli_entries[j] == &e[i]) {
+				cli_entries[j] = NULL;
+			}
+		}
+	}
+	return 0;
+}
+
+char *ast_complete_channels(const char *line, const char *word, int pos, int state, int rpos)
+{
+	return NULL;
+}
+
+/*! \brief Run a CLI command of the module, writing its output to fd. */
+int bench_cli(int fd, const char *line)
+{
+	char *buf = ast_strdupa(line), *argv[16], *words, *word;
+	int argc = 0, i, n;
+
+	while (argc < (int) ARRAY_LEN(argv) && (word = strsep(&buf, " \t"))) {
+		if (*word) {
+			argv[argc++] = word;
+		}
+	}
+	for (i = 0; i < BENCH_MAX_CLI; i++) {
+		if (!cli_entries[i]) {
+			continue;
+		}
+		words = ast_strdupa(cli_entries[i]->command);
+		for (n = 0; (word = strsep(&words, " ")); n++) {
+			if (n >= argc || strcasecmp(word, argv[n])) {
+				break;
+			}
+		}
+		if (!word) {
+			struct ast_cli_args a = { .fd = fd, .argc = argc, .argv = (const char * const *) argv,
+				.line = line, .word = "", .pos = argc };
+
+			return cli_entries[i]->handler(cli_entries[i], 0, &a) == CLI_SUCCESS ? 0 : -1;
+		}
+	}
+	dprintf(fd, "No such command '%s'\n", line);
+	return -1;
+}
+
+/* Manager: actions are accepted and never called */
+
+int ast_manager_register_xml(const char *action, int authority, int (*func)(struct mansession *s, const struct message *m))
+{
+	return 0;
+}
+
+int ast_manager_unregister(const char *action)
+{
+	return 0;
+}
+
+const char *astman_get_header(const struct message *m, char *var)
+{
+	return "";
+}
+
+void astman_append(struct mansession *s, const char *fmt, ...)
+{
+}
+
+void astman_send_ack(struct mansession *s, const struct message *m, char *msg)
+{
+}
+
+void astman_send_error(struct mansession *s, const struct message *m, char *error)
+{
+}
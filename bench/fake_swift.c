@@ -0,0 +1,413 @@
+/*
+ * app_swift benchmark harness -- a fake Swift engine
+ *
+ * This program is free software, distributed under the terms of the GNU
+ * General Public License Version 2. See the LICENSE file at the top of the
+ * source tree for more information.
+ *
+ * A background swift_port_speak_text() renders in a thread of its own, as
+ * the real engine does; without one it renders in the caller's thread,
+ * and a callback can stop it by returning SWIFT_INTERRUPTED.  Either kind
+ * stops at once on swift_port_stop(), from any thread.  It produces
+ * speech-like
+ * audio (bursts of tone between short pauses, with silence at either end)
+ * of a length that follows the text, at fake_swift.rtf of realtime, handed
+ * over burst_ms at a time.  Requests can be refused with
+ * SWIFT_PORT_UNAVAILABLE at random, or when more than licenses are busy.
+ */
+
+#include "bench.h"
+#include <swift_asterisk_interface.h>
+
+#include <time.h>
+
+struct fake_swift_opts fake_swift = {
+	.rtf = 0.1,
+	.first_ms = 20,
+	.burst_ms = 100,
+	.chars_per_sec = 14,
+};
+
+struct fake_swift_counters fake_swift_counters;
+
+#define FAKE_LEAD_MS 200        /* silence before the speech */
+#define FAKE_TAIL_MS 300        /* and after it */
+#define FAKE_WORD_MS 240
+#define FAKE_PAUSE_MS 60
+
+struct swift_params {
+	char encoding[16];
+	char rate[8];
+};
+
+struct swift_engine {
+	int unused;
+};
+
+struct swift_voice {
+	char name[64];
+};
+
+struct swift_port {
+	char encoding[16];
+	unsigned int rate;
+	struct swift_voice voice;
+	swift_callback_t callback;
+	unsigned int mask;
+	void *udata;
+	pthread_mutex_t lock;           /* protects stream and its stop */
+	struct swift_stream *stream;
+};
+
+struct swift_stream {
+	pthread_t thread;
+	swift_port *port;
+	char *text;
+	volatile int stop;
+	pthread_cond_t cond;            /* signalled on stop */
+	int joined;
+};
+
+struct swift_event {
+	swift_event_t type;
+	void *buf;
+	int len;
+	swift_result_t error;
+};
+
+static void fake_sleep_until(struct timeval t)
+{
+	struct timespec ts = { t.tv_sec, t.tv_usec * 1000 };
+
+	while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+	}
+}
+
+static void fake_sleep_ms(int ms)
+{
+	if (ms > 0) {
+		fake_sleep_until(ast_tvadd(ast_tvnow(), ast_tv(ms / 1000, (ms % 1000) * 1000)));
+	}
+}
+
+swift_params *swift_params_new(const char *unused)
+{
+	swift_params *params = ast_calloc(1, sizeof(*params));
+
+	if (params) {
+		ast_copy_string(params->encoding, "pcm16", sizeof(params->encoding));
+		ast_copy_string(params->rate, "8000", sizeof(params->rate));
+	}
+	return params;
+}
+
+swift_result_t swift_params_set_string(swift_params *params, const char *name, const char *val)
+{
+	if (!strcmp(name, "audio/encoding")) {
+		ast_copy_string(params->encoding, val, sizeof(params->encoding));
+	} else if (!strcmp(name, "audio/sampling-rate")) {
+		ast_copy_string(params->rate, val, sizeof(params->rate));
+	}
+	return SWIFT_SUCCESS;
+}
+
+swift_result_t swift_params_set_int(swift_params *params, const char *name, int val)
+{
+	return SWIFT_SUCCESS;
+}
+
+swift_result_t swift_params_set_float(swift_params *params, const char *name, float val)
+{
+	return SWIFT_SUCCESS;
+}
+
+swift_engine *swift_engine_open(swift_params *params)
+{
+	ast_free(params);
+	return ast_calloc(1, sizeof(swift_engine));
+}
+
+swift_result_t swift_engine_close(swift_engine *engine)
+{
+	ast_free(engine);
+	return SWIFT_SUCCESS;
+}
+
+swift_port *swift_port_open(swift_engine *engine, swift_params *params)
+{
+	swift_port *port;
+
+	fake_sleep_ms(fake_swift.open_ms);
+	if (!(port = ast_calloc(1, sizeof(*port)))) {
+		ast_free(params);
+		return NULL;
+	}
+	if (params) {
+		ast_copy_string(port->encoding, params->encoding, sizeof(port->encoding));
+		port->rate = atoi(params->rate);
+		ast_free(params);
+	} else {
+		ast_copy_string(port->encoding, "pcm16", sizeof(port->encoding));
+		port->rate = 8000;
+	}
+	pthread_mutex_init(&port->lock, NULL);
+	ast_atomic_fetchadd_int(&fake_swift_counters.ports_open, 1);
+	ast_atomic_fetchadd_int(&fake_swift_counters.ports_opened, 1);
+	return port;
+}
+
+static void fake_stream_free(struct swift_stream *stream)
+{
+	if (stream) {
+		pthread_cond_destroy(&stream->cond);
+		ast_free(stream->text);
+		ast_free(stream);
+	}
+}
+
+/*! \brief Wait for the port's stream (if async matches it) to finish,
+ * stopping it first if asked.  Only its owner joins a background stream,
+ * but anyone may stop one, or a rendering in another thread's speak. */
+static void fake_stream_reap(swift_port *port, swift_background_t async, int stop)
+{
+	struct swift_stream *stream;
+	int join = 0;
+
+	pthread_mutex_lock(&port->lock);
+	if ((stream = port->stream) && (!async || async == SWIFT_ASYNC_ANY || async == stream)) {
+		if (stop) {
+			stream->stop = 1;
+			pthread_cond_signal(&stream->cond);
+		}
+		join = !stream->joined;
+	}
+	pthread_mutex_unlock(&port->lock);
+	if (join) {
+		pthread_join(stream->thread, NULL);
+		stream->joined = 1;
+	}
+}
+
+swift_result_t swift_port_close(swift_port *port)
+{
+	fake_stream_reap(port, SWIFT_ASYNC_NONE, 1);
+	fake_stream_free(port->stream);
+	pthread_mutex_destroy(&port->lock);
+	ast_free(port);
+	ast_atomic_fetchadd_int(&fake_swift_counters.ports_open, -1);
+	return SWIFT_SUCCESS;
+}
+
+swift_voice *swift_port_set_voice_by_name(swift_port *port, const char *name)
+{
+	ast_copy_string(port->voice.name, name, sizeof(port->voice.name));
+	return &port->voice;
+}
+
+swift_result_t swift_port_set_param_string(swift_port *port, const char *name, const char *val, int async)
+{
+	if (!strcmp(name, "audio/encoding")) {
+		ast_copy_string(port->encoding, val, sizeof(port->encoding));
+	} else if (!strcmp(name, "audio/sampling-rate")) {
+		port->rate = atoi(val);
+	}
+	return SWIFT_SUCCESS;
+}
+
+swift_callback_t swift_port_set_callback(swift_port *port, swift_callback_t callback, unsigned int mask, void *udata)
+{
+	swift_callback_t old = port->callback;
+
+	port->callback = callback;
+	port->mask = mask;
+	port->udata = udata;
+	return old;
+}
+
+void swift_register_ast_chan(swift_port *port, void *chan)
+{
+}
+
+swift_result_t swift_event_get_audio(swift_event *event, void **buf, int *nbytes)
+{
+	if (event->type != SWIFT_EVENT_AUDIO) {
+		return SWIFT_INVALID_PARAM;
+	}
+	*buf = event->buf;
+	*nbytes = event->len;
+	return SWIFT_SUCCESS;
+}
+
+swift_result_t swift_event_get_error(swift_event *event, swift_result_t *rv, const char **errmsg)
+{
+	if (event->type != SWIFT_EVENT_ERROR) {
+		return SWIFT_INVALID_PARAM;
+	}
+	*rv = event->error;
+	if (errmsg) {
+		*errmsg = "port unavailable";
+	}
+	return SWIFT_SUCCESS;
+}
+
+static swift_result_t fake_event(swift_port *port, swift_event *event, swift_event_t type)
+{
+	event->type = type;
+	if (port->callback && (port->mask & type)) {
+		return port->callback(event, type, port->udata);
+	}
+	return SWIFT_SUCCESS;
+}
+
+/*! \brief Sample n of the speech, as linear audio. */
+static int fake_sample(unsigned int n, unsigned int rate, unsigned int total)
+{
+	unsigned int ms = n * 1000ULL / rate;
+
+	if (ms < FAKE_LEAD_MS || ms >= total - FAKE_TAIL_MS ||
+		(ms - FAKE_LEAD_MS) % (FAKE_WORD_MS + FAKE_PAUSE_MS) >= FAKE_WORD_MS) {
+		return 0;
+	}
+	/* A 250Hz square-ish wave at about -12dBFS */
+	return (n * 250 / (rate / 2)) % 2 ? 8000 : -8000;
+}
+
+static void fake_render(swift_port *port, unsigned char *buf, unsigned int first, unsigned int samples, unsigned int total)
+{
+	unsigned int i;
+	short *out = (short *) buf;
+
+	if (!strcmp(port->encoding, "ulaw")) {
+		for (i = 0; i < samples; i++) {
+			buf[i] = AST_LIN2MU(fake_sample(first + i, port->rate, total));
+		}
+	} else if (!strcmp(port->encoding, "alaw")) {
+		for (i = 0; i < samples; i++) {
+			buf[i] = AST_LIN2A(fake_sample(first + i, port->rate, total));
+		}
+	} else {
+		for (i = 0; i < samples; i++) {
+			out[i] = fake_sample(first + i, port->rate, total);
+		}
+	}
+}
+
+static void *fake_stream_thread(void *data)
+{
+	struct swift_stream *stream = data;
+	swift_port *port = stream->port;
+	swift_event event = { 0, };
+	unsigned int bps = strcmp(port->encoding, "pcm16") ? 1 : 2;
+	unsigned int total_ms, done_ms = 0, burst, bursts = 0, n;
+	unsigned char *buf;
+	struct timeval start = ast_tvnow(), due;
+	int active, peak;
+
+	ast_atomic_fetchadd_int(&fake_swift_counters.speaks, 1);
+	active = ast_atomic_fetchadd_int(&fake_swift_counters.active, 1) + 1;
+	if ((fake_swift.licenses && active > fake_swift.licenses) ||
+		(fake_swift.error_rate > 0 && (double) random() / RAND_MAX < fake_swift.error_rate)) {
+		ast_atomic_fetchadd_int(&fake_swift_counters.active, -1);
+		ast_atomic_fetchadd_int(&fake_swift_counters.unavailable, 1);
+		event.error = SWIFT_PORT_UNAVAILABLE;
+		fake_event(port, &event, SWIFT_EVENT_ERROR);
+		return NULL;
+	}
+	while ((peak = fake_swift_counters.active_peak) < active &&
+		!__sync_bool_compare_and_swap(&fake_swift_counters.active_peak, peak, active)) {
+	}
+
+	total_ms = FAKE_LEAD_MS + FAKE_TAIL_MS + strlen(stream->text) * 1000 / fake_swift.chars_per_sec;
+	burst = fake_swift.burst_ms > 0 ? fake_swift.burst_ms : 100;
+	if (!(buf = ast_malloc(burst * port->rate / 1000 * bps))) {
+		ast_atomic_fetchadd_int(&fake_swift_counters.active, -1);
+		return NULL;
+	}
+
+	due = ast_tvadd(start, ast_tv(0, fake_swift.first_ms * 1000));
+	while (done_ms < total_ms && !stream->stop) {
+		n = total_ms - done_ms < burst ? total_ms - done_ms : burst;
+		/* The engine runs at rtf of realtime, give or take its stalls */
+		due = ast_tvadd(due, ast_tv(0, (suseconds_t) (n * 1000 * fake_swift.rtf)));
+		if (fake_swift.stall_every && ++bursts % fake_swift.stall_every == 0) {
+			due = ast_tvadd(due, ast_tv(fake_swift.stall_ms / 1000, (fake_swift.stall_ms % 1000) * 1000));
+		}
+		/* A stop wakes the engine at once, not at the next burst */
+		pthread_mutex_lock(&port->lock);
+		while (!stream->stop && ast_tvcmp(ast_tvnow(), due) < 0) {
+			struct timespec ts = { due.tv_sec, due.tv_usec * 1000 };
+
+			pthread_cond_timedwait(&stream->cond, &port->lock, &ts);
+		}
+		pthread_mutex_unlock(&port->lock);
+		if (stream->stop) {
+			break;
+		}
+		fake_render(port, buf, done_ms * port->rate / 1000, n * port->rate / 1000, total_ms);
+		event.buf = buf;
+		event.len = n * port->rate / 1000 * bps;
+		if (fake_event(port, &event, SWIFT_EVENT_AUDIO) == SWIFT_INTERRUPTED) {
+			stream->stop = 1;
+		}
+		__sync_fetch_and_add(&fake_swift_counters.audio_bytes, event.len);
+		done_ms += n;
+	}
+	if (stream->stop) {
+		ast_atomic_fetchadd_int(&fake_swift_counters.stopped, 1);
+	} else {
+		fake_event(port, &event, SWIFT_EVENT_END);
+	}
+	ast_free(buf);
+	ast_atomic_fetchadd_int(&fake_swift_counters.active, -1);
+	return NULL;
+}
+
+swift_result_t swift_port_speak_text(swift_port *port, const void *text, int nbytes, const char *encoding,
+	swift_background_t *async, swift_params *params)
+{
+	struct swift_stream *stream, *old;
+
+	fake_stream_reap(port, SWIFT_ASYNC_NONE, 1);
+	if (!(stream = ast_calloc(1, sizeof(*stream)))) {
+		return SWIFT_UNKNOWN_ERROR;
+	}
+	stream->port = port;
+	stream->joined = !async;
+	pthread_cond_init(&stream->cond, NULL);
+	if (!(stream->text = nbytes > 0 ? strndup(text, nbytes) : ast_strdup(text))) {
+		fake_stream_free(stream);
+		return SWIFT_UNKNOWN_ERROR;
+	}
+	/* Published before it renders, so it can be stopped meanwhile */
+	pthread_mutex_lock(&port->lock);
+	old = port->stream;
+	port->stream = stream;
+	pthread_mutex_unlock(&port->lock);
+	fake_stream_free(old);
+	if (async && pthread_create(&stream->thread, NULL, fake_stream_thread, stream)) {
+		pthread_mutex_lock(&port->lock);
+		port->stream = NULL;
+		pthread_mutex_unlock(&port->lock);
+		fake_stream_free(stream);
+		return SWIFT_UNKNOWN_ERROR;
+	}
+	if (async) {
+		ast_atomic_fetchadd_int(&fake_swift_counters.threads, 1);
+		*async = stream;
+	} else {
+		fake_stream_thread(stream);
+	}
+	return SWIFT_SUCCESS;
+}
+
+swift_result_t swift_port_stop(swift_port *port, swift_background_t async, swift_event_t place)
+{
+	fake_stream_reap(port, async, 1);
+	return SWIFT_SUCCESS;
+}
+
+swift_result_t swift_port_wait(swift_port *port, swift_background_t async)
+{
+	fake_stream_reap(port, async, 0);
+	return SWIFT_SUCCESS;
+}
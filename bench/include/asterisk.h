@@ -0,0 +1,494 @@
+/*
+ * app_swift benchmark harness -- just enough of the Asterisk 13 API for
+ * app_swift.c to build and run outside of Asterisk.
+ *
+ * This program is free software, distributed under the terms of the GNU
+ * General Public License Version 2. See the LICENSE file at the top of the
+ * source tree for more information.
+ *
+ * Only what app_swift.c uses is declared here, with the same names and
+ * calling conventions as the real thing.  The implementations are in
+ * bench/fake_asterisk.c.
+ */
+
+#ifndef _BENCH_ASTERISK_H
+#define _BENCH_ASTERISK_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <alloca.h>
+#include <sys/time.h>
+
+#define ASTERISK_FILE_VERSION(file, version)
+
+/* Logging */
+#define __LOG_DEBUG    0
+#define __LOG_NOTICE   2
+#define __LOG_WARNING  3
+#define __LOG_ERROR    4
+#define _A_ __FILE__, __LINE__, __PRETTY_FUNCTION__
+#define LOG_DEBUG   __LOG_DEBUG, _A_
+#define LOG_NOTICE  __LOG_NOTICE, _A_
+#define LOG_WARNING __LOG_WARNING, _A_
+#define LOG_ERROR   __LOG_ERROR, _A_
+
+void ast_log(int level, const char *file, int line, const char *function, const char *fmt, ...)
+	__attribute__((format(printf, 5, 6)));
+
+/* Locking */
+typedef pthread_mutex_t ast_mutex_t;
+typedef pthread_cond_t ast_cond_t;
+
+#define AST_MUTEX_DEFINE_STATIC(mutex) static ast_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER
+#define ast_mutex_init(m) pthread_mutex_init(m, NULL)
+#define ast_mutex_destroy pthread_mutex_destroy
+#define ast_mutex_lock pthread_mutex_lock
+#define ast_mutex_trylock pthread_mutex_trylock
+#define ast_mutex_unlock pthread_mutex_unlock
+#define ast_cond_init pthread_cond_init
+#define ast_cond_destroy pthread_cond_destroy
+#define ast_cond_signal pthread_cond_signal
+#define ast_cond_broadcast pthread_cond_broadcast
+#define ast_cond_wait pthread_cond_wait
+#define ast_cond_timedwait pthread_cond_timedwait
+
+#define ast_pthread_create pthread_create
+int ast_pthread_create_detached(pthread_t *thread, pthread_attr_t *attr, void *(*start_routine)(void *), void *data);
+
+static inline int ast_atomic_fetchadd_int(volatile int *p, int v)
+{
+	return __sync_fetch_and_add(p, v);
+}
+
+static inline int ast_atomic_dec_and_test(volatile int *p)
+{
+	return __sync_sub_and_fetch(p, 1) == 0;
+}
+
+/* Memory */
+#define ast_malloc malloc
+#define ast_calloc calloc
+#define ast_realloc realloc
+#define ast_free free
+#define ast_strdup strdup
+#define ast_strdupa strdupa
+#define ast_alloca alloca
+
+/* Strings */
+static inline int ast_strlen_zero(const char *s)
+{
+	return !s || !*s;
+}
+
+void ast_copy_string(char *dst, const char *src, size_t size);
+char *ast_skip_blanks(const char *str);
+char *ast_strip(char *s);
+int ast_mkdir(const char *path, int mode);
+
+/* Where relative sound file names are rendered to, under sounds/ */
+extern const char *ast_config_AST_DATA_DIR;
+int ast_true(const char *val);
+int ast_false(const char *val);
+
+#define ARRAY_LEN(a) (size_t) (sizeof(a) / sizeof(0[a]))
+
+/* Time */
+struct timeval ast_tvnow(void);
+struct timeval ast_tv(time_t sec, suseconds_t usec);
+struct timeval ast_tvadd(struct timeval a, struct timeval b);
+struct timeval ast_tvsub(struct timeval a, struct timeval b);
+struct timeval ast_samp2tv(unsigned int samples, unsigned int rate);
+int ast_tvcmp(struct timeval a, struct timeval b);
+int ast_tvzero(const struct timeval t);
+int64_t ast_tvdiff_ms(struct timeval end, struct timeval start);
+int64_t ast_tvdiff_us(struct timeval end, struct timeval start);
+
+/* Lists */
+#define AST_LIST_HEAD_NOLOCK(name, type) \
+struct name { \
+	struct type *first; \
+	struct type *last; \
+}
+#define AST_LIST_HEAD_NOLOCK_STATIC(name, type) \
+struct name { \
+	struct type *first; \
+	struct type *last; \
+} name = { NULL, NULL }
+#define AST_LIST_HEAD_NOLOCK_INIT_VALUE { NULL, NULL }
+#define AST_LIST_HEAD_INIT_NOLOCK(head) do { (head)->first = NULL; (head)->last = NULL; } while (0)
+#define AST_LIST_ENTRY(type) struct { struct type *next; }
+#define AST_LIST_FIRST(head) ((head)->first)
+#define AST_LIST_LAST(head) ((head)->last)
+#define AST_LIST_NEXT(elm, field) ((elm)->field.next)
+#define AST_LIST_EMPTY(head) (AST_LIST_FIRST(head) == NULL)
+
+#define AST_LIST_TRAVERSE(head, var, field) \
+	for ((var) = (head)->first; (var); (var) = (var)->field.next)
+
+#define AST_LIST_TRAVERSE_SAFE_BEGIN(head, var, field) { \
+	typeof((head)) __list_head = head; \
+	typeof(__list_head->first) __list_next; \
+	typeof(__list_head->first) __list_prev = NULL; \
+	typeof(__list_head->first) __list_current; \
+	for ((var) = __list_head->first, \
+		__list_current = (var), \
+		__list_next = (var) ? (var)->field.next : NULL; \
+		(var); \
+		__list_prev = __list_current, \
+		(var) = __list_next, \
+		__list_current = (var), \
+		__list_next = (var) ? (var)->field.next : NULL)
+
+#define AST_LIST_REMOVE_CURRENT(field) do { \
+	__list_current->field.next = NULL; \
+	__list_current = __list_prev; \
+	if (__list_prev) { \
+		__list_prev->field.next = __list_next; \
+	} else { \
+		__list_head->first = __list_next; \
+	} \
+	if (!__list_next) { \
+		__list_head->last = __list_prev; \
+	} \
+} while (0)
+
+#define AST_LIST_TRAVERSE_SAFE_END }
+
+#define AST_LIST_INSERT_HEAD(head, elm, field) do { \
+	(elm)->field.next = (head)->first; \
+	(head)->first = (elm); \
+	if (!(head)->last) { \
+		(head)->last = (elm); \
+	} \
+} while (0)
+
+#define AST_LIST_INSERT_TAIL(head, elm, field) do { \
+	if (!(head)->first) { \
+		(head)->first = (elm); \
+		(head)->last = (elm); \
+	} else { \
+		(head)->last->field.next = (elm); \
+		(head)->last = (elm); \
+	} \
+} while (0)
+
+#define AST_LIST_INSERT_AFTER(head, listelm, elm, field) do { \
+	(elm)->field.next = (listelm)->field.next; \
+	(listelm)->field.next = (elm); \
+	if ((head)->last == (listelm)) { \
+		(head)->last = (elm); \
+	} \
+} while (0)
+
+#define AST_LIST_REMOVE_HEAD(head, field) ({ \
+	typeof((head)->first) __cur = (head)->first; \
+	if (__cur) { \
+		(head)->first = __cur->field.next; \
+		__cur->field.next = NULL; \
+		if ((head)->last == __cur) { \
+			(head)->last = NULL; \
+		} \
+	} \
+	__cur; \
+})
+
+#define AST_LIST_REMOVE(head, elm, field) ({ \
+	typeof(elm) __elm = (elm); \
+	typeof(elm) __prev = NULL; \
+	typeof(elm) __cur = (head)->first; \
+	while (__cur && __cur != __elm) { \
+		__prev = __cur; \
+		__cur = __cur->field.next; \
+	} \
+	if (__cur) { \
+		if (__prev) { \
+			__prev->field.next = __cur->field.next; \
+		} else { \
+			(head)->first = __cur->field.next; \
+		} \
+		if ((head)->last == __cur) { \
+			(head)->last = __prev; \
+		} \
+		__cur->field.next = NULL; \
+	} \
+	__cur; \
+})
+
+/* Formats */
+struct ast_format;
+struct ast_format_cap;
+
+enum ast_format_cmp_res {
+	AST_FORMAT_CMP_EQUAL = 0,
+	AST_FORMAT_CMP_NOT_EQUAL,
+	AST_FORMAT_CMP_SUBSET,
+};
+
+enum ast_format_cmp_res ast_format_cmp(const struct ast_format *format1, const struct ast_format *format2);
+unsigned int ast_format_get_sample_rate(const struct ast_format *format);
+const char *ast_format_get_name(const struct ast_format *format);
+unsigned int ast_format_cap_get_format_framing(const struct ast_format_cap *cap, const struct ast_format *format);
+
+/* ao2 objects are never freed here */
+#define ao2_bump(obj) (obj)
+void ao2_cleanup(void *obj);
+#define RAII_VAR(vartype, varname, initval, dtor) vartype varname = (initval)
+
+/* Frames */
+#define AST_FRIENDLY_OFFSET 64
+
+enum ast_frame_type {
+	AST_FRAME_DTMF = 1,
+	AST_FRAME_VOICE,
+	AST_FRAME_VIDEO,
+	AST_FRAME_CONTROL,
+	AST_FRAME_NULL,
+};
+
+struct ast_frame_subclass {
+	int integer;
+	struct ast_format *format;
+};
+
+struct ast_frame {
+	enum ast_frame_type frametype;
+	struct ast_frame_subclass subclass;
+	int datalen;
+	int samples;
+	int mallocd;
+	size_t mallocd_hdr_len;
+	int offset;
+	const char *src;
+	union {
+		void *ptr;
+		uint32_t uint32;
+		char pad[8];
+	} data;
+	struct timeval delivery;
+};
+
+void ast_frfree(struct ast_frame *fr);
+
+/* Channels */
+struct ast_channel;
+
+struct ast_party_caller {
+	struct {
+		struct {
+			char *str;
+		} number;
+	} id;
+};
+
+enum ast_channel_state {
+	AST_STATE_DOWN,
+	AST_STATE_RESERVED,
+	AST_STATE_OFFHOOK,
+	AST_STATE_DIALING,
+	AST_STATE_RING,
+	AST_STATE_RINGING,
+	AST_STATE_UP,
+};
+
+struct ast_generator {
+	void *(*alloc)(struct ast_channel *chan, void *params);
+	void (*release)(struct ast_channel *chan, void *data);
+	int (*generate)(struct ast_channel *chan, void *data, int len, int samples);
+	void (*digit)(struct ast_channel *chan, char digit);
+};
+
+const char *ast_channel_name(const struct ast_channel *chan);
+const char *ast_channel_context(const struct ast_channel *chan);
+void ast_channel_exten_set(struct ast_channel *chan, const char *value);
+void ast_channel_priority_set(struct ast_channel *chan, int value);
+enum ast_channel_state ast_channel_state(const struct ast_channel *chan);
+struct ast_party_caller *ast_channel_caller(struct ast_channel *chan);
+struct ast_format *ast_channel_writeformat(struct ast_channel *chan);
+struct ast_format *ast_channel_rawwriteformat(struct ast_channel *chan);
+struct ast_format_cap *ast_channel_nativeformats(const struct ast_channel *chan);
+int ast_answer(struct ast_channel *chan);
+int ast_stopstream(struct ast_channel *chan);
+int ast_set_write_format(struct ast_channel *chan, struct ast_format *format);
+int ast_waitfor(struct ast_channel *chan, int ms);
+int ast_waitfordigit(struct ast_channel *chan, int ms);
+struct ast_frame *ast_read(struct ast_channel *chan);
+int ast_write(struct ast_channel *chan, struct ast_frame *frame);
+int ast_activate_generator(struct ast_channel *chan, struct ast_generator *gen, void *params);
+void ast_deactivate_generator(struct ast_channel *chan);
+
+/* PBX */
+int ast_exists_extension(struct ast_channel *c, const char *context, const char *exten, int priority, const char *callerid);
+const char *pbx_builtin_getvar_helper(struct ast_channel *chan, const char *name);
+int pbx_builtin_setvar_helper(struct ast_channel *chan, const char *name, const char *value);
+
+struct ast_custom_function {
+	const char *name;
+	int (*read)(struct ast_channel *chan, const char *cmd, char *data, char *buf, size_t len);
+	int (*write)(struct ast_channel *chan, const char *cmd, char *data, const char *value);
+};
+
+int ast_custom_function_register(struct ast_custom_function *acf);
+int ast_custom_function_unregister(struct ast_custom_function *acf);
+
+/* Applications */
+#define AST_APP_ARG(name) char *name
+
+#define AST_DECLARE_APP_ARGS(name, arglist) \
+	struct { \
+		unsigned int argc; \
+		char *argv[0]; \
+		arglist \
+	} name = { 0, }
+
+unsigned int __ast_app_separate_args(char *buf, char delim, int remove_chars, char **array, int arraylen);
+
+#define AST_STANDARD_APP_ARGS(args, parse) \
+	args.argc = __ast_app_separate_args(parse, ',', 1, args.argv, \
+		((sizeof(args) - offsetof(typeof(args), argv)) / sizeof(args.argv[0])))
+
+int ast_register_application_xml(const char *app, int (*execute)(struct ast_channel *, const char *));
+int ast_unregister_application(const char *app);
+
+/* Modules */
+struct ast_module_user;
+
+struct ast_module_user *ast_module_user_add(struct ast_channel *chan);
+void ast_module_user_remove(struct ast_module_user *user);
+void ast_module_user_hangup_all(void);
+
+enum ast_module_load_result {
+	AST_MODULE_LOAD_SUCCESS = 0,
+	AST_MODULE_LOAD_DECLINE = 1,
+	AST_MODULE_LOAD_SKIP = 2,
+	AST_MODULE_LOAD_PRIORITY = 3,
+	AST_MODULE_LOAD_FAILURE = -1,
+};
+
+#define ASTERISK_GPL_KEY "This paragraph is copyright (c) 2006 by Digium, Inc."
+#define AST_MODFLAG_DEFAULT 0
+
+struct ast_module_info {
+	const char *description;
+	int (*load)(void);
+	int (*unload)(void);
+	int (*reload)(void);
+};
+
+/* The harness finds the module through bench_module */
+#define AST_MODULE_INFO(keystr, flags_to_set, desc, fields...) \
+	static const struct ast_module_info __mod_info = { \
+		.description = desc, \
+		fields \
+	}; \
+	const struct ast_module_info *bench_module = &__mod_info
+
+/* Configuration */
+struct ast_config;
+
+struct ast_variable {
+	const char *name;
+	const char *value;
+	struct ast_variable *next;
+};
+
+struct ast_flags {
+	unsigned int flags;
+};
+
+enum {
+	CONFIG_FLAG_WITHCOMMENTS = (1 << 0),
+	CONFIG_FLAG_FILEUNCHANGED = (1 << 1),
+	CONFIG_FLAG_NOCACHE = (1 << 2),
+};
+
+#define CONFIG_STATUS_FILEMISSING (void *) 0
+#define CONFIG_STATUS_FILEUNCHANGED (void *) -1
+#define CONFIG_STATUS_FILEINVALID (void *) -2
+
+struct ast_config *ast_config_load(const char *filename, struct ast_flags flags);
+void ast_config_destroy(struct ast_config *cfg);
+struct ast_variable *ast_variable_browse(const struct ast_config *config, const char *category);
+const char *ast_variable_retrieve(struct ast_config *config, const char *category, const char *variable);
+
+/* CLI */
+enum ast_cli_command {
+	CLI_INIT = -2,
+	CLI_GENERATE = -3,
+};
+
+#define CLI_SUCCESS (char *) RESULT_SUCCESS
+#define CLI_SHOWUSAGE (char *) RESULT_SHOWUSAGE
+#define CLI_FAILURE (char *) RESULT_FAILURE
+#define RESULT_SUCCESS 0
+#define RESULT_SHOWUSAGE 1
+#define RESULT_FAILURE 2
+
+struct ast_cli_args {
+	const int fd;
+	const int argc;
+	const char * const *argv;
+	const char *line;
+	const char *word;
+	const int pos;
+	int n;
+};
+
+struct ast_cli_entry {
+	const char * const cmda[16];
+	const char *summary;
+	const char *usage;
+	char *(*handler)(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a);
+	const char *command;
+};
+
+#define AST_CLI_DEFINE(fn, txt , ... ) { .handler = fn, .summary = txt, ## __VA_ARGS__ }
+
+void ast_cli(int fd, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int ast_cli_register_multiple(struct ast_cli_entry *e, int len);
+int ast_cli_unregister_multiple(struct ast_cli_entry *e, int len);
+char *ast_complete_channels(const char *line, const char *word, int pos, int state, int rpos);
+
+/* Manager */
+struct mansession;
+struct message;
+
+#define EVENT_FLAG_SYSTEM (1 << 0)
+#define EVENT_FLAG_REPORTING (1 << 9)
+
+int ast_manager_register_xml(const char *action, int authority, int (*func)(struct mansession *s, const struct message *m));
+int ast_manager_unregister(const char *action);
+const char *astman_get_header(const struct message *m, char *var);
+void astman_append(struct mansession *s, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void astman_send_ack(struct mansession *s, const struct message *m, char *msg);
+void astman_send_error(struct mansession *s, const struct message *m, char *error);
+
+/* G.711 */
+extern unsigned char __ast_lin2mu[16384];
+extern short __ast_mulaw[256];
+extern unsigned char __ast_lin2a[8192];
+extern short __ast_alaw[256];
+
+#define AST_LIN2MU(a) (__ast_lin2mu[((unsigned short) (a)) >> 2])
+#define AST_MULAW(a) (__ast_mulaw[(a)])
+#define AST_LIN2A(a) (__ast_lin2a[((unsigned short) (a)) >> 3])
+#define AST_ALAW(a) (__ast_alaw[(int) (a)])
+
+/* Formats as found in format_cache.h */
+extern struct ast_format *ast_format_ulaw;
+extern struct ast_format *ast_format_alaw;
+extern struct ast_format *ast_format_slin;
+extern struct ast_format *ast_format_slin16;
+
+#endif /* _BENCH_ASTERISK_H */
@@ -0,0 +1,2 @@
+/* Everything the harness provides is declared in asterisk.h */
+#include "../asterisk.h"
@@ -0,0 +1,73 @@
+/*
+ * app_swift benchmark harness -- the parts of the Cepstral Swift API that
+ * app_swift.c uses, implemented by the fake engine in bench/fake_swift.c.
+ *
+ * This program is free software, distributed under the terms of the GNU
+ * General Public License Version 2. See the LICENSE file at the top of the
+ * source tree for more information.
+ */
+
+#ifndef _BENCH_SWIFT_H
+#define _BENCH_SWIFT_H
+
+typedef struct swift_engine swift_engine;
+typedef struct swift_port swift_port;
+typedef struct swift_params swift_params;
+typedef struct swift_voice swift_voice;
+typedef struct swift_event swift_event;
+typedef struct swift_stream *swift_background_t;
+
+typedef enum {
+	SWIFT_SUCCESS = 0,
+	SWIFT_UNKNOWN_ERROR = -1,
+	SWIFT_INTERRUPTED = -2,
+	SWIFT_INVALID_PARAM = -3,
+	SWIFT_UNIMPLEMENTED = -4,
+	SWIFT_PORT_UNAVAILABLE = -5,
+} swift_result_t;
+
+#define SWIFT_FAILED(r) ((r) < 0)
+
+typedef enum {
+	SWIFT_EVENT_NONE = 0,
+	SWIFT_EVENT_ERROR = (1 << 0),
+	SWIFT_EVENT_SENTENCE = (1 << 1),
+	SWIFT_EVENT_PHRASE = (1 << 2),
+	SWIFT_EVENT_TOKEN = (1 << 3),
+	SWIFT_EVENT_WORD = (1 << 4),
+	SWIFT_EVENT_BOOKMARK = (1 << 5),
+	SWIFT_EVENT_SYLLABLE = (1 << 6),
+	SWIFT_EVENT_PHONEME = (1 << 7),
+	SWIFT_EVENT_AUDIO = (1 << 8),
+	SWIFT_EVENT_END = (1 << 9),
+	SWIFT_EVENT_START = (1 << 10),
+	SWIFT_EVENT_NOW = SWIFT_EVENT_NONE,
+} swift_event_t;
+
+#define SWIFT_ASYNC_NONE 0
+#define SWIFT_ASYNC_ANY ((swift_background_t) -1)
+
+typedef swift_result_t (*swift_callback_t)(swift_event *event, swift_event_t type, void *udata);
+
+swift_params *swift_params_new(const char *unused);
+swift_result_t swift_params_set_string(swift_params *params, const char *name, const char *val);
+swift_result_t swift_params_set_int(swift_params *params, const char *name, int val);
+swift_result_t swift_params_set_float(swift_params *params, const char *name, float val);
+
+swift_engine *swift_engine_open(swift_params *params);
+swift_result_t swift_engine_close(swift_engine *engine);
+
+swift_port *swift_port_open(swift_engine *engine, swift_params *params);
+swift_result_t swift_port_close(swift_port *port);
+swift_voice *swift_port_set_voice_by_name(swift_port *port, const char *name);
+swift_result_t swift_port_set_param_string(swift_port *port, const char *name, const char *val, int async);
+swift_callback_t swift_port_set_callback(swift_port *port, swift_callback_t callback, unsigned int mask, void *udata);
+swift_result_t swift_port_speak_text(swift_port *port, const void *text, int nbytes, const char *encoding,
+	swift_background_t *async, swift_params *params);
+swift_result_t swift_port_stop(swift_port *port, swift_background_t async, swift_event_t place);
+swift_result_t swift_port_wait(swift_port *port, swift_background_t async);
+
+swift_result_t swift_event_get_audio(swift_event *event, void **buf, int *nbytes);
+swift_result_t swift_event_get_error(swift_event *event, swift_result_t *rv, const char **errmsg);
+
+#endif /* _BENCH_SWIFT_H */
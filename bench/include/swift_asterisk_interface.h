@@ -0,0 +1,10 @@
+/*
+ * app_swift benchmark harness -- Swift 6's per-channel port accounting.
+ */
+
+#ifndef _BENCH_SWIFT_ASTERISK_INTERFACE_H
+#define _BENCH_SWIFT_ASTERISK_INTERFACE_H
+
+void swift_register_ast_chan(swift_port *port, void *chan);
+
+#endif /* _BENCH_SWIFT_ASTERISK_INTERFACE_H */
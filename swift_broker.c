@@ -0,0 +1,934 @@
+/*
+ * swift_broker -- One Cepstral Swift engine for every Asterisk on a host
+ *
+ * This program is free software, distributed under the
+ * terms of the GNU General Public License Version 2. See
+ * the LICENSE file at the top of the source tree for more
+ * information.
+ *
+ */
+
+/*!
+ * \file
+ * \brief Renders speech for app_swift running in other processes
+ *
+ * The broker owns the Swift engine and the licensed ports.  Calls from
+ * every Asterisk on the host queue for the same ports, instead of each
+ * Asterisk getting a fixed share of the licenses, and an engine that
+ * crashes takes the broker down rather than Asterisk.  Audio is rendered
+ * into a memory file that the client maps, so none of it is copied over
+ * the socket, and rendered prompts are kept for whoever asks for them
+ * next.  app_swift renders in-process whenever the broker cannot be
+ * reached.  See swift_broker.h for the protocol.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <swift.h>
+
+#include "swift_broker.h"
+
+#define BROKER_HASH_SIZE 1021
+#define BROKER_RETRY_MS 20      /* to send to a client whose socket was full */
+
+enum broker_state {
+	BROKER_QUEUED,
+	BROKER_RUNNING,
+	BROKER_DONE,
+	BROKER_FAILED,
+};
+
+/*! \brief One rendering, shared by every client asking for the same audio. */
+struct broker_job {
+	char encoding[16];
+	char rate[8];
+	char voice[64];
+	char *text;
+	unsigned int hash;
+	int priority;
+	enum broker_state state;
+	int stop;                       /* no one is listening any more */
+	int failed;                     /* the engine refused, or the audio ran over */
+	int fd;                         /* memory file holding the audio */
+	unsigned char *map;
+	size_t capacity;
+	size_t len;                     /* bytes rendered, published without the lock */
+	int listeners;                  /* clients */
+	int held;                       /* by the queue, a worker or the cache */
+	int hashed;                     /* new requests can still join it */
+	swift_port *port;               /* rendering it */
+	struct broker_job *hnext;
+	struct broker_job *prev, *next; /* in the queue, then in the cache */
+};
+
+struct broker_list {
+	struct broker_job *head, *tail;
+	int count;
+};
+
+/*! \brief A connection from app_swift. */
+struct broker_client {
+	int fd;
+	struct broker_job *job;
+	struct timeval since;           /* asked */
+	struct timeval until;           /* gives up waiting for a port, if set */
+	int answered;
+	int behind;                     /* a line could not be sent yet */
+	size_t sent;                    /* audio reported so far */
+	size_t have;
+	char buf[SWIFT_BROKER_REQUEST_MAX];
+	struct broker_client *next;
+};
+
+/* Jobs, the queue and the cache are protected by lock.  Clients belong
+ * to the main thread. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static struct broker_job *jobs[BROKER_HASH_SIZE];
+static struct broker_list queue;        /* highest priority first */
+static struct broker_list cache;        /* least recently used first */
+static size_t cache_bytes;
+static int workers;
+static int busy;
+static int running = 1;
+
+static int wake_pipe[2];
+static volatile sig_atomic_t quit;
+
+static struct {
+	unsigned long requests;
+	unsigned long hits;             /* played from the cache */
+	unsigned long joined;           /* shared a rendering under way */
+	unsigned long rendered;
+	unsigned long stopped;          /* everyone hung up */
+	unsigned long failed;
+	unsigned long refused;          /* no port in time */
+} counts;
+
+static const char *opt_socket = SWIFT_BROKER_SOCKET;
+static int opt_ports = 1;
+static int opt_queue_size = 100;
+static size_t opt_cache_size = 64 * 1024 * 1024;
+static int opt_foreground;
+static int opt_verbose;
+static int use_syslog;
+
+static void broker_log(int priority, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (priority == LOG_DEBUG && !opt_verbose) {
+		return;
+	}
+	va_start(ap, fmt);
+	if (use_syslog) {
+		vsyslog(priority, fmt, ap);
+	} else {
+		vfprintf(stderr, fmt, ap);
+	}
+	va_end(ap);
+}
+
+static struct timeval broker_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv;
+}
+
+static int broker_ms(struct timeval end, struct timeval start)
+{
+	return (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000;
+}
+
+/*! \brief Have the main loop look at every client again. */
+static void broker_wake(void)
+{
+	char c = 0;
+	ssize_t res;
+
+	/* A full pipe has its attention already */
+	res = write(wake_pipe[1], &c, 1);
+	(void) res;
+}
+
+static void broker_signal(int sig)
+{
+	quit = 1;
+	broker_wake();
+}
+
+static void broker_list_insert(struct broker_list *list, struct broker_job *before, struct broker_job *job)
+{
+	job->next = before;
+	job->prev = before ? before->prev : list->tail;
+	if (job->prev) {
+		job->prev->next = job;
+	} else {
+		list->head = job;
+	}
+	if (before) {
+		before->prev = job;
+	} else {
+		list->tail = job;
+	}
+	list->count++;
+}
+
+static void broker_list_remove(struct broker_list *list, struct broker_job *job)
+{
+	if (job->prev) {
+		job->prev->next = job->next;
+	} else {
+		list->head = job->next;
+	}
+	if (job->next) {
+		job->next->prev = job->prev;
+	} else {
+		list->tail = job->prev;
+	}
+	job->prev = job->next = NULL;
+	list->count--;
+}
+
+static unsigned int broker_hash(const char *encoding, const char *rate, const char *voice, const char *text)
+{
+	const char *parts[] = { encoding, rate, voice, text };
+	unsigned int h = 2166136261u, i;
+	const char *s;
+
+	for (i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+		for (s = parts[i]; *s; s++) {
+			h = (h ^ (unsigned char) *s) * 16777619u;
+		}
+		h = (h ^ 0xff) * 16777619u;
+	}
+	return h;
+}
+
+static struct broker_job *broker_job_find_locked(unsigned int hash, const char *encoding, const char *rate,
+	const char *voice, const char *text)
+{
+	struct broker_job *job;
+
+	for (job = jobs[hash % BROKER_HASH_SIZE]; job; job = job->hnext) {
+		if (job->hash == hash && !strcmp(job->encoding, encoding) && !strcmp(job->rate, rate) &&
+			!strcmp(job->voice, voice) && !strcmp(job->text, text)) {
+			return job;
+		}
+	}
+	return NULL;
+}
+
+static void broker_job_unhash_locked(struct broker_job *job)
+{
+	struct broker_job **cur;
+
+	if (!job->hashed) {
+		return;
+	}
+	for (cur = &jobs[job->hash % BROKER_HASH_SIZE]; *cur; cur = &(*cur)->hnext) {
+		if (*cur == job) {
+			*cur = job->hnext;
+			break;
+		}
+	}
+	job->hashed = 0;
+}
+
+/*! \brief A memory file of size bytes, to be passed to clients. */
+static int broker_memfd(size_t size)
+{
+	int fd;
+#if defined __linux__ && defined MFD_CLOEXEC
+	fd = memfd_create("swift_broker", MFD_CLOEXEC);
+#else
+	static unsigned int seq;
+	char name[64];
+
+	snprintf(name, sizeof(name), "/swift_broker.%d.%u", (int) getpid(), seq++);
+	if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) >= 0) {
+		shm_unlink(name);
+	}
+#endif
+	if (fd >= 0 && ftruncate(fd, size)) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+static void broker_job_free(struct broker_job *job)
+{
+	if (job->map) {
+		munmap(job->map, job->capacity);
+	}
+	if (job->fd >= 0) {
+		close(job->fd);
+	}
+	free(job->text);
+	free(job);
+}
+
+static struct broker_job *broker_job_new(int priority, const char *encoding, const char *rate, const char *voice,
+	const char *text, unsigned int hash)
+{
+	struct broker_job *job;
+
+	if (!(job = calloc(1, sizeof(*job)))) {
+		return NULL;
+	}
+	job->fd = -1;
+	if (!(job->text = strdup(text))) {
+		broker_job_free(job);
+		return NULL;
+	}
+	snprintf(job->encoding, sizeof(job->encoding), "%s", encoding);
+	snprintf(job->rate, sizeof(job->rate), "%s", rate);
+	snprintf(job->voice, sizeof(job->voice), "%s", voice);
+	job->hash = hash;
+	job->priority = priority;
+
+	/* Room for the longest audio allowed; only what is rendered takes memory */
+	job->capacity = (size_t) atoi(rate) * (strcmp(encoding, "pcm16") ? 1 : 2) * SWIFT_BROKER_MAX_SECONDS;
+	if ((job->fd = broker_memfd(job->capacity)) < 0 ||
+		(job->map = mmap(NULL, job->capacity, PROT_READ | PROT_WRITE, MAP_SHARED, job->fd, 0)) == MAP_FAILED) {
+		broker_log(LOG_ERR, "Unable to map %zu bytes for audio: %s\n", job->capacity, strerror(errno));
+		job->map = NULL;
+		broker_job_free(job);
+		return NULL;
+	}
+	return job;
+}
+
+/*! \brief Free the job once no client, queue, worker or cache has it. */
+static void broker_job_put_locked(struct broker_job *job)
+{
+	if (!job->listeners && !job->held) {
+		broker_job_unhash_locked(job);
+		broker_job_free(job);
+	}
+}
+
+static void broker_cache_trim_locked(void)
+{
+	struct broker_job *job;
+
+	while (cache_bytes > opt_cache_size && (job = cache.head)) {
+		broker_list_remove(&cache, job);
+		cache_bytes -= job->len;
+		broker_job_unhash_locked(job);
+		job->held = 0;
+		broker_job_put_locked(job);
+	}
+}
+
+static swift_result_t broker_cb(swift_event *event, swift_event_t type, void *udata)
+{
+	struct broker_job *job = udata;
+	void *buf;
+	int len;
+
+	if (type == SWIFT_EVENT_AUDIO) {
+		if (__atomic_load_n(&job->stop, __ATOMIC_ACQUIRE)) {
+			return SWIFT_INTERRUPTED;
+		}
+		if (SWIFT_FAILED(swift_event_get_audio(event, &buf, &len)) || len <= 0) {
+			return SWIFT_SUCCESS;
+		}
+		if (len > job->capacity - job->len) {
+			broker_log(LOG_WARNING, "Audio runs past %d seconds, cut short: %.40s\n", SWIFT_BROKER_MAX_SECONDS, job->text);
+			job->failed = 1;
+			return SWIFT_INTERRUPTED;
+		}
+		/* Only this thread writes the audio; clients read up to len */
+		memcpy(job->map + job->len, buf, len);
+		__atomic_store_n(&job->len, job->len + len, __ATOMIC_RELEASE);
+		broker_wake();
+#if defined _SWIFT_VER_6
+	} else if (type == SWIFT_EVENT_ERROR) {
+		swift_result_t error_code;
+
+		if (swift_event_get_error(event, &error_code, NULL) == SWIFT_SUCCESS && error_code == SWIFT_PORT_UNAVAILABLE) {
+			broker_log(LOG_WARNING, "The engine refused a port; are more ports open than licensed?\n");
+			job->failed = 1;
+		}
+#endif
+	}
+	return SWIFT_SUCCESS;
+}
+
+/*! \brief What a worker's port is set up for. */
+struct broker_port {
+	swift_port *port;
+	char encoding[16];
+	char rate[8];
+	char voice[64];
+};
+
+static swift_result_t broker_render(struct broker_port *bp, struct broker_job *job)
+{
+	unsigned int event_mask;
+
+	if (strcmp(bp->encoding, job->encoding) || strcmp(bp->rate, job->rate)) {
+		if (SWIFT_FAILED(swift_port_set_param_string(bp->port, "audio/encoding", job->encoding, SWIFT_ASYNC_NONE)) ||
+			SWIFT_FAILED(swift_port_set_param_string(bp->port, "audio/sampling-rate", job->rate, SWIFT_ASYNC_NONE))) {
+			broker_log(LOG_ERR, "Failed to set Swift port to %s/%s audio\n", job->encoding, job->rate);
+			/* Half switched; make sure it is set again next time */
+			bp->encoding[0] = '\0';
+			return SWIFT_UNKNOWN_ERROR;
+		}
+		snprintf(bp->encoding, sizeof(bp->encoding), "%s", job->encoding);
+		snprintf(bp->rate, sizeof(bp->rate), "%s", job->rate);
+	}
+	if (strcmp(bp->voice, job->voice)) {
+		if (!swift_port_set_voice_by_name(bp->port, job->voice)) {
+			broker_log(LOG_ERR, "Failed to set voice %s\n", job->voice);
+			bp->voice[0] = '\0';
+			return SWIFT_UNKNOWN_ERROR;
+		}
+		snprintf(bp->voice, sizeof(bp->voice), "%s", job->voice);
+	}
+
+#if defined _SWIFT_VER_6
+	event_mask = SWIFT_EVENT_AUDIO | SWIFT_EVENT_END | SWIFT_EVENT_ERROR;
+#elif defined _SWIFT_VER_5
+	event_mask = SWIFT_EVENT_AUDIO | SWIFT_EVENT_END;
+#endif
+	swift_port_set_callback(bp->port, &broker_cb, event_mask, job);
+	return swift_port_speak_text(bp->port, job->text, 0, NULL, NULL, NULL);
+}
+
+/*! \brief Render queued jobs, one at a time, on a port of our own. */
+static void *broker_worker(void *data)
+{
+	struct broker_port bp = { .encoding = "pcm16", .rate = "8000", };
+	swift_params *params = swift_params_new(NULL);
+	struct broker_job *job;
+	swift_result_t res;
+
+	swift_params_set_string(params, "audio/encoding", bp.encoding);
+	swift_params_set_string(params, "audio/sampling-rate", bp.rate);
+	swift_params_set_string(params, "audio/output-format", "raw");
+	swift_params_set_string(params, "tts/text-encoding", "utf-8");
+	if (!(bp.port = swift_port_open(data, params))) {
+		broker_log(LOG_ERR, "Failed to open Swift port\n");
+		pthread_mutex_lock(&lock);
+		workers--;
+		pthread_mutex_unlock(&lock);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&lock);
+	while (running) {
+		if (!(job = queue.head)) {
+			pthread_cond_wait(&work, &lock);
+			continue;
+		}
+		broker_list_remove(&queue, job);
+		job->state = BROKER_RUNNING;
+		job->port = bp.port;
+		busy++;
+		pthread_mutex_unlock(&lock);
+		broker_wake();
+
+		res = broker_render(&bp, job);
+
+		pthread_mutex_lock(&lock);
+		job->port = NULL;
+		busy--;
+		if (SWIFT_FAILED(res) || job->failed || job->stop) {
+			if (!job->stop) {
+				counts.failed++;
+			}
+			job->state = BROKER_FAILED;
+			broker_job_unhash_locked(job);
+			job->held = 0;
+			broker_job_put_locked(job);
+		} else {
+			counts.rendered++;
+			job->state = BROKER_DONE;
+			broker_list_insert(&cache, NULL, job);
+			cache_bytes += job->len;
+			broker_cache_trim_locked();
+		}
+		broker_wake();
+	}
+	pthread_mutex_unlock(&lock);
+	swift_port_close(bp.port);
+	return NULL;
+}
+
+/*! \brief Send a line to a client, with a file descriptor if fd is not -1.
+ * \retval 0 sent
+ * \retval 1 the socket is full; try again later
+ * \retval -1 the client is gone
+ */
+static int broker_send(struct broker_client *c, int fd, const char *fmt, ...)
+{
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct msghdr msg = { 0, };
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char line[128];
+	va_list ap;
+	ssize_t res;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+
+	iov.iov_base = line;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (fd >= 0) {
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+	if ((res = sendmsg(c->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT)) == len) {
+		c->behind = 0;
+		return 0;
+	}
+	if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		c->behind = 1;
+		return 1;
+	}
+	/* Half a line is no use to it */
+	return -1;
+}
+
+/*! \brief Take a client's request, joining a rendering of the same audio
+ * if there is one. */
+static int broker_request(struct broker_client *c, const char *line, struct timeval now)
+{
+	char encoding[16], rate[8], voice[64];
+	int priority, max_wait, n = 0;
+	struct broker_job *job, *before;
+	unsigned int hash;
+	const char *text;
+
+	if (sscanf(line, "SPEAK %d %d %15s %7s %63s %n", &priority, &max_wait, encoding, rate, voice, &n) < 5 || !n ||
+		(strcmp(encoding, "ulaw") && strcmp(encoding, "alaw") && strcmp(encoding, "pcm16")) || atoi(rate) <= 0 ||
+		!*(text = line + n)) {
+		broker_log(LOG_WARNING, "Bad request: %.60s\n", line);
+		broker_send(c, -1, "FAIL ERROR 0\n");
+		return -1;
+	}
+	counts.requests++;
+	c->since = now;
+	/* Without a wait the request was only asking if a port is free; when
+	 * one is, it has the port as soon as the worker takes the job */
+	timerclear(&c->until);
+	if (max_wait > 0) {
+		c->until = now;
+		c->until.tv_sec += max_wait / 1000;
+		c->until.tv_usec += (max_wait % 1000) * 1000;
+		if (c->until.tv_usec >= 1000000) {
+			c->until.tv_sec++;
+			c->until.tv_usec -= 1000000;
+		}
+	}
+	hash = broker_hash(encoding, rate, voice, text);
+
+	pthread_mutex_lock(&lock);
+	if ((job = broker_job_find_locked(hash, encoding, rate, voice, text))) {
+		if (job->state == BROKER_QUEUED && max_wait <= 0) {
+			/* Waiting for a port, which the client said it would not do */
+			pthread_mutex_unlock(&lock);
+			broker_send(c, -1, "FAIL QUEUEFULL 0\n");
+			return -1;
+		}
+		if (job->state == BROKER_DONE) {
+			/* Most recently used goes to the back */
+			broker_list_remove(&cache, job);
+			broker_list_insert(&cache, NULL, job);
+			counts.hits++;
+		} else {
+			counts.joined++;
+		}
+	} else if (busy + queue.count >= workers && (max_wait <= 0 || queue.count >= opt_queue_size)) {
+		pthread_mutex_unlock(&lock);
+		if (max_wait > 0) {
+			broker_log(LOG_WARNING, "All %d ports are in use and %d requests are queued\n", workers, queue.count);
+			counts.refused++;
+		}
+		broker_send(c, -1, "FAIL QUEUEFULL 0\n");
+		return -1;
+	} else if ((job = broker_job_new(priority, encoding, rate, voice, text, hash))) {
+		job->hnext = jobs[hash % BROKER_HASH_SIZE];
+		jobs[hash % BROKER_HASH_SIZE] = job;
+		job->hashed = 1;
+		job->held = 1;
+		/* Highest priority first, first come first served within it */
+		for (before = queue.head; before && before->priority >= priority; before = before->next) {
+		}
+		broker_list_insert(&queue, before, job);
+		pthread_cond_signal(&work);
+	} else {
+		pthread_mutex_unlock(&lock);
+		broker_send(c, -1, "FAIL ERROR 0\n");
+		return -1;
+	}
+	job->listeners++;
+	c->job = job;
+	pthread_mutex_unlock(&lock);
+	broker_log(LOG_DEBUG, "%s %s/%s: %.60s\n", job->state == BROKER_DONE ? "Cached" : "Rendering", voice, encoding, text);
+	return 0;
+}
+
+/*! \brief Read what a client sent: its request, or that it hung up. */
+static int broker_input(struct broker_client *c, struct timeval now)
+{
+	ssize_t n;
+	char *nl;
+
+	if ((n = recv(c->fd, c->buf + c->have, sizeof(c->buf) - 1 - c->have, 0)) <= 0) {
+		return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+	}
+	if (c->job) {
+		/* After its request a client only ever hangs up */
+		return 0;
+	}
+	c->have += n;
+	c->buf[c->have] = '\0';
+	if (!(nl = strchr(c->buf, '\n'))) {
+		return c->have < sizeof(c->buf) - 1 ? 0 : -1;
+	}
+	*nl = '\0';
+	if (nl > c->buf && nl[-1] == '\r') {
+		nl[-1] = '\0';
+	}
+	return broker_request(c, c->buf, now);
+}
+
+/*! \brief Tell a client what has changed since we last did.  Returns -1
+ * once there is nothing more to say. */
+static int broker_update(struct broker_client *c, struct timeval now)
+{
+	struct broker_job *job = c->job;
+	enum broker_state state;
+	size_t len;
+	int res;
+
+	pthread_mutex_lock(&lock);
+	state = job->state;
+	pthread_mutex_unlock(&lock);
+	len = __atomic_load_n(&job->len, __ATOMIC_ACQUIRE);
+
+	if (!c->answered) {
+		if (state == BROKER_QUEUED) {
+			if (!timerisset(&c->until) || timercmp(&now, &c->until, <)) {
+				return 0;
+			}
+			broker_log(LOG_WARNING, "Gave up waiting for a port after %dms\n", broker_ms(now, c->since));
+			counts.refused++;
+			broker_send(c, -1, "FAIL TIMEOUT %d\n", broker_ms(now, c->since));
+			return -1;
+		}
+		if (state == BROKER_FAILED) {
+			broker_send(c, -1, "FAIL ERROR %d\n", broker_ms(now, c->since));
+			return -1;
+		}
+		if ((res = broker_send(c, job->fd, "OK %d %zu\n", broker_ms(now, c->since), job->capacity))) {
+			return res;
+		}
+		c->answered = 1;
+	}
+	if (state == BROKER_DONE) {
+		return broker_send(c, -1, "END %zu\n", len) > 0 ? 0 : -1;
+	}
+	if (state == BROKER_FAILED) {
+		broker_send(c, -1, "ERROR\n");
+		return -1;
+	}
+	if (len > c->sent && !broker_send(c, -1, "AUDIO %zu\n", len)) {
+		c->sent = len;
+	}
+	return 0;
+}
+
+/*! \brief Hang up on a client.  A rendering no one else is listening to
+ * is stopped, so its port goes to the next request. */
+static void broker_drop(struct broker_client *c)
+{
+	struct broker_job *job = c->job;
+
+	close(c->fd);
+	if (job) {
+		pthread_mutex_lock(&lock);
+		if (!--job->listeners && (job->state == BROKER_QUEUED || job->state == BROKER_RUNNING)) {
+			broker_job_unhash_locked(job);
+			if (job->state == BROKER_QUEUED) {
+				broker_list_remove(&queue, job);
+				job->state = BROKER_FAILED;
+				job->held = 0;
+			} else {
+				/* Our callback stops it at its next audio at the latest */
+				__atomic_store_n(&job->stop, 1, __ATOMIC_RELEASE);
+				swift_port_stop(job->port, SWIFT_ASYNC_ANY, SWIFT_EVENT_NOW);
+			}
+			counts.stopped++;
+		}
+		broker_job_put_locked(job);
+		pthread_mutex_unlock(&lock);
+	}
+	free(c);
+}
+
+static void broker_run(int listener)
+{
+	struct broker_client *clients = NULL, *c, **cp;
+	struct pollfd *fds = NULL, *tmp;
+	int nfds, alloc = 0, timeout, ms, fd, i;
+	struct timeval now;
+	char drain[64];
+
+	while (!quit) {
+		/* The listener, the wake pipe, then every client */
+		for (nfds = 2, c = clients; c; c = c->next) {
+			nfds++;
+		}
+		if (nfds > alloc) {
+			if (!(tmp = realloc(fds, nfds * 2 * sizeof(*fds)))) {
+				broker_log(LOG_ERR, "Out of memory\n");
+				break;
+			}
+			fds = tmp;
+			alloc = nfds * 2;
+		}
+		fds[0].fd = listener;
+		fds[1].fd = wake_pipe[0];
+		timeout = -1;
+		now = broker_now();
+		for (i = 2, c = clients; c; c = c->next, i++) {
+			fds[i].fd = c->fd;
+			if (c->behind) {
+				ms = BROKER_RETRY_MS;
+			} else if (c->job && !c->answered && timerisset(&c->until)) {
+				ms = broker_ms(c->until, now) + 1;
+			} else {
+				/* Nothing due; a worker taking a job wakes us */
+				continue;
+			}
+			if (timeout < 0 || ms < timeout) {
+				timeout = ms < 0 ? 0 : ms;
+			}
+		}
+		for (i = 0; i < nfds; i++) {
+			fds[i].events = POLLIN;
+			fds[i].revents = 0;
+		}
+		if (poll(fds, nfds, timeout) < 0 && errno != EINTR) {
+			broker_log(LOG_ERR, "poll: %s\n", strerror(errno));
+			break;
+		}
+		if (fds[1].revents & POLLIN) {
+			while (read(wake_pipe[0], drain, sizeof(drain)) > 0) {
+			}
+		}
+
+		now = broker_now();
+		for (i = 2, cp = &clients; (c = *cp); i++) {
+			if ((fds[i].revents && broker_input(c, now) < 0) || (c->job && broker_update(c, now) < 0)) {
+				*cp = c->next;
+				broker_drop(c);
+			} else {
+				cp = &c->next;
+			}
+		}
+
+		if (fds[0].revents & POLLIN) {
+			while ((fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+				if (!(c = calloc(1, sizeof(*c)))) {
+					close(fd);
+					continue;
+				}
+				c->fd = fd;
+				c->next = clients;
+				clients = c;
+			}
+		}
+	}
+
+	while ((c = clients)) {
+		clients = c->next;
+		broker_drop(c);
+	}
+	free(fds);
+}
+
+/*! \brief Listen on path, taking it over from a broker that is gone. */
+static int broker_listen(const char *path)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX, };
+	int fd;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		broker_log(LOG_ERR, "Socket path %s is too long\n", path);
+		return -1;
+	}
+	strcpy(sun.sun_path, path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+		broker_log(LOG_ERR, "socket: %s\n", strerror(errno));
+		return -1;
+	}
+	if (!connect(fd, (struct sockaddr *) &sun, sizeof(sun))) {
+		broker_log(LOG_ERR, "A broker is already listening on %s\n", path);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	unlink(path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ||
+		bind(fd, (struct sockaddr *) &sun, sizeof(sun)) || listen(fd, 128)) {
+		broker_log(LOG_ERR, "Unable to listen on %s: %s\n", path, strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+	return fd;
+}
+
+static void broker_usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -s socket    listen here (" SWIFT_BROKER_SOCKET ")\n"
+		"  -p ports     Swift ports to render on, as many as licensed (1)\n"
+		"  -q size      most requests to queue for a port (100)\n"
+		"  -m MB        rendered audio to keep for repeat requests (64)\n"
+		"  -f           stay in the foreground and log to stderr\n"
+		"  -v           log every request\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sigaction sa = { .sa_handler = broker_signal, };
+	swift_engine *engine;
+	pthread_t *threads;
+	int listener, opt, i, started = 0;
+
+	while ((opt = getopt(argc, argv, "s:p:q:m:fvh")) != -1) {
+		switch (opt) {
+		case 's':
+			opt_socket = optarg;
+			break;
+		case 'p':
+			opt_ports = atoi(optarg);
+			break;
+		case 'q':
+			opt_queue_size = atoi(optarg);
+			break;
+		case 'm':
+			opt_cache_size = (size_t) atoi(optarg) * 1024 * 1024;
+			break;
+		case 'f':
+			opt_foreground = 1;
+			break;
+		case 'v':
+			opt_verbose = 1;
+			break;
+		default:
+			broker_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (opt_ports < 1) {
+		broker_usage(argv[0]);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	if (pipe2(wake_pipe, O_NONBLOCK | O_CLOEXEC)) {
+		perror("pipe");
+		return 1;
+	}
+	/* Fail where it can be seen, before going into the background */
+	if ((listener = broker_listen(opt_socket)) < 0) {
+		return 1;
+	}
+	if (!opt_foreground) {
+		if (daemon(0, 0)) {
+			perror("daemon");
+			return 1;
+		}
+		openlog("swift_broker", LOG_PID, LOG_DAEMON);
+		use_syslog = 1;
+	}
+
+	/* The engine's threads would not survive daemon() */
+	if (!(engine = swift_engine_open(NULL))) {
+		broker_log(LOG_ERR, "Failed to open Swift Engine\n");
+		unlink(opt_socket);
+		return 1;
+	}
+	if (!(threads = calloc(opt_ports, sizeof(*threads)))) {
+		swift_engine_close(engine);
+		unlink(opt_socket);
+		return 1;
+	}
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < opt_ports; i++) {
+		if (pthread_create(&threads[started], NULL, broker_worker, engine)) {
+			broker_log(LOG_ERR, "Unable to start a worker: %s\n", strerror(errno));
+			continue;
+		}
+		started++;
+		workers++;
+	}
+	pthread_mutex_unlock(&lock);
+	broker_log(LOG_NOTICE, "Listening on %s with %d Swift ports\n", opt_socket, started);
+
+	broker_run(listener);
+
+	close(listener);
+	unlink(opt_socket);
+	pthread_mutex_lock(&lock);
+	running = 0;
+	pthread_cond_broadcast(&work);
+	pthread_mutex_unlock(&lock);
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+	pthread_mutex_lock(&lock);
+	opt_cache_size = 0;
+	broker_cache_trim_locked();
+	pthread_mutex_unlock(&lock);
+	swift_engine_close(engine);
+
+	broker_log(LOG_NOTICE, "%lu requests: %lu rendered, %lu from the cache, %lu shared, %lu stopped, %lu failed, %lu refused\n",
+		counts.requests, counts.rendered, counts.hits, counts.joined, counts.stopped, counts.failed, counts.refused);
+	return 0;
+}
@@ -0,0 +1,45 @@
+/*
+ * app_swift -- A Cepstral Swift TTS engine interface
+ *
+ * The protocol between app_swift and swift_broker.
+ *
+ * This program is free software, distributed under the
+ * terms of the GNU General Public License Version 2. See
+ * the LICENSE file at the top of the source tree for more
+ * information.
+ *
+ * A client connects to the broker's Unix socket and sends one request on
+ * one line, the text last and without line breaks:
+ *
+ *   SPEAK <priority> <max wait ms> <encoding> <rate> <voice> <text>
+ *
+ * The broker answers as soon as a port is rendering the text, or right
+ * away when the text is cached or already being rendered for someone else:
+ *
+ *   OK <ms waited> <bytes>        with the audio's memory file attached
+ *   FAIL <status> <ms waited>     TIMEOUT, QUEUEFULL or ERROR
+ *
+ * After OK the client maps the first <bytes> of the file.  The broker then
+ * says how far the audio in it goes as it is rendered, and closes the
+ * connection after the last line:
+ *
+ *   AUDIO <bytes>
+ *   END <bytes>
+ *   ERROR
+ *
+ * A client that hangs up stops the rendering, unless another client is
+ * listening to it too.
+ */
+
+#ifndef _SWIFT_BROKER_H
+#define _SWIFT_BROKER_H
+
+#define SWIFT_BROKER_SOCKET "/var/run/swift_broker.sock"
+
+/* Longest request, text included */
+#define SWIFT_BROKER_REQUEST_MAX 16384
+
+/* Most audio one rendering may come to, in seconds */
+#define SWIFT_BROKER_MAX_SECONDS 600
+
+#endif /* _SWIFT_BROKER_H */